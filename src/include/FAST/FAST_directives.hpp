@@ -1,3 +1,6 @@
+// Devices
+#include <FAST/DeviceManager.hpp>
+
 // FAST Data
 #include <FAST/Data/BoundingBox.hpp>
 #include <FAST/Data/Color.hpp>
@@ -12,6 +15,7 @@
 // Optimized Algorithms
 #include <FAST/Algorithms/BinaryThresholding/BinaryThresholding.hpp>
 #include <FAST/Algorithms/ImageCaster/ImageCaster.hpp>
+#include <FAST/Algorithms/ImageResizer/ImageResizer.hpp>
 #include <FAST/Algorithms/ImageSharpening/ImageSharpening.hpp>
 #include <FAST/Algorithms/IntensityClipping/IntensityClipping.hpp>
 #include <FAST/Algorithms/IntensityNormalization/IntensityNormalization.hpp>
@@ -0,0 +1,321 @@
+#pragma once
+
+// Reads DICOM slices straight out of tar/zip archives (optionally gzip, xz,
+// bzip2 or zstd compressed) without extracting them to disk.
+// The archive is indexed once on construction. Its data is then
+// decompressed in one sequential pass shared by all workers: a worker asking
+// for a member nobody has reached yet becomes the reader and decompresses
+// entries in archive order, handing every selected member it passes to a
+// buffer, until it reaches its own. Workers asking meanwhile wait for the
+// reader, so the order slices are scheduled in never causes a rewind and
+// the archive is decompressed once for reading whatever the thread count.
+// A buffer is freed when its member is taken. Built on libarchive when
+// HAVE_LIBARCHIVE is defined; otherwise supported() is false and the
+// constructor throws.
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_LIBARCHIVE
+#include <archive.h>
+#include <archive_entry.h>
+#endif
+
+// A buffer exposed through a memfd, so APIs that only take a file path (like
+// FAST's DICOMFileImporter) can read it without a temporary file on disk.
+class InMemoryFile {
+private:
+  int fd = -1;
+
+public:
+  InMemoryFile(const std::string &name, const std::vector<char> &data) {
+    fd = memfd_create(name.c_str(), MFD_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("memfd_create failed for " + name + ": " +
+                               std::strerror(errno));
+    }
+    const char *cursor = data.data();
+    size_t remaining = data.size();
+    while (remaining > 0) {
+      ssize_t written = ::write(fd, cursor, remaining);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        ::close(fd);
+        throw std::runtime_error("Failed to write in-memory file " + name +
+                                 ": " + std::strerror(errno));
+      }
+      cursor += written;
+      remaining -= static_cast<size_t>(written);
+    }
+  }
+
+  ~InMemoryFile() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  InMemoryFile(const InMemoryFile &) = delete;
+  InMemoryFile &operator=(const InMemoryFile &) = delete;
+
+  std::string path() const { return "/proc/self/fd/" + std::to_string(fd); }
+};
+
+class ArchiveSource {
+public:
+  struct Member {
+    std::string name; // path inside the archive
+    size_t ordinal;   // position among all entries, used to seek
+    size_t size;
+  };
+
+  static constexpr bool supported() {
+#ifdef HAVE_LIBARCHIVE
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Archive extensions recognised as patient studies
+  static bool isArchive(const std::string &path) {
+    static const char *extensions[] = {".tar",     ".tar.gz", ".tgz",
+                                       ".tar.zst", ".tar.xz", ".tar.bz2",
+                                       ".zip"};
+    for (const char *ext : extensions) {
+      size_t length = std::strlen(ext);
+      if (path.size() > length &&
+          path.compare(path.size() - length, length, ext) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // File name without the archive extension(s), e.g. "PGBM-001.tar.zst"
+  // gives "PGBM-001"
+  static std::string stem(const std::string &filename) {
+    std::string name = filename.substr(filename.find_last_of('/') + 1);
+    size_t dot = name.find('.');
+    return dot == std::string::npos ? name : name.substr(0, dot);
+  }
+
+private:
+  std::string path;
+  std::vector<Member> members;
+
+#ifdef HAVE_LIBARCHIVE
+  struct ArchiveDeleter {
+    void operator()(archive *handle) const { archive_read_free(handle); }
+  };
+  using Handle = std::unique_ptr<archive, ArchiveDeleter>;
+
+  // The shared sequential pass: the entry the reader stands before, whether
+  // a thread is decompressing, and selected members read ahead of the
+  // workers that will take them
+  std::mutex mutex;
+  std::condition_variable progressed;
+  Handle reader;
+  size_t nextOrdinal = 0;
+  bool reading = false;
+  std::string failure;
+  std::set<size_t> selected;
+  std::map<size_t, std::vector<char>> buffered;
+
+  Handle open() const {
+    Handle handle(archive_read_new());
+    archive_read_support_filter_all(handle.get());
+    archive_read_support_format_all(handle.get());
+    if (archive_read_open_filename(handle.get(), path.c_str(), 1 << 16) !=
+        ARCHIVE_OK) {
+      throw std::runtime_error("Failed to open archive " + path + ": " +
+                               archive_error_string(handle.get()));
+    }
+    return handle;
+  }
+
+  // The data of the entry whose header was just read
+  std::vector<char> readData(archive *handle, const std::string &name,
+                             size_t size) const {
+    std::vector<char> data(size);
+    size_t offset = 0;
+    while (offset < data.size()) {
+      la_ssize_t count = archive_read_data(handle, data.data() + offset,
+                                           data.size() - offset);
+      if (count < 0) {
+        throw std::runtime_error("Failed to read " + name + " from " + path +
+                                 ": " + archive_error_string(handle));
+      }
+      if (count == 0) {
+        break;
+      }
+      offset += static_cast<size_t>(count);
+    }
+    data.resize(offset);
+    return data;
+  }
+
+  // A member the shared pass is already past (read twice, or never
+  // selected): a private pass up to it
+  std::vector<char> readAlone(const Member &member) const {
+    Handle handle = open();
+    archive_entry *entry;
+    for (size_t ordinal = 0; ordinal <= member.ordinal; ++ordinal) {
+      if (archive_read_next_header(handle.get(), &entry) != ARCHIVE_OK) {
+        throw std::runtime_error("Failed to seek to " + member.name + " in " +
+                                 path);
+      }
+    }
+    return readData(handle.get(), member.name, member.size);
+  }
+
+  const Member *memberAt(size_t ordinal) const {
+    auto it = std::lower_bound(
+        members.begin(), members.end(), ordinal,
+        [](const Member &member, size_t o) { return member.ordinal < o; });
+    return it != members.end() && it->ordinal == ordinal ? &*it : nullptr;
+  }
+#endif
+
+public:
+  explicit ArchiveSource(const std::string &path) : path(path) {
+#ifdef HAVE_LIBARCHIVE
+    Handle handle = open();
+    archive_entry *entry;
+    size_t ordinal = 0;
+    int status;
+    while ((status = archive_read_next_header(handle.get(), &entry)) ==
+           ARCHIVE_OK) {
+      std::string name = archive_entry_pathname(entry);
+      if (archive_entry_filetype(entry) == AE_IFREG && name.size() > 4 &&
+          name.compare(name.size() - 4, 4, ".dcm") == 0) {
+        members.push_back({name, ordinal,
+                           static_cast<size_t>(archive_entry_size(entry))});
+        selected.insert(ordinal);
+      }
+      ordinal++;
+    }
+    if (status != ARCHIVE_EOF) {
+      throw std::runtime_error("Failed to index archive " + path + ": " +
+                               archive_error_string(handle.get()));
+    }
+#else
+    throw std::runtime_error("Cannot read " + path +
+                             ": built without libarchive support");
+#endif
+  }
+
+  const std::vector<Member> &getMembers() const { return members; }
+
+  const std::string &getPath() const { return path; }
+
+  // Limits the shared pass to buffering these members (all .dcm members by
+  // default); call before the first read()
+  void select(const std::vector<Member> &wanted) {
+#ifdef HAVE_LIBARCHIVE
+    std::lock_guard<std::mutex> lock(mutex);
+    selected.clear();
+    for (const Member &member : wanted) {
+      selected.insert(member.ordinal);
+    }
+#else
+    (void)wanted;
+#endif
+  }
+
+  // One member's data, from the shared pass. Blocks while another thread
+  // is decompressing; may itself decompress other selected members on the
+  // way to this one.
+  std::vector<char> read(const Member &member) { return fetch(member, true); }
+
+  // A copy of a member's data that stays buffered for the read() that takes
+  // it, e.g. to look at its header ahead of time
+  std::vector<char> peek(const Member &member) { return fetch(member, false); }
+
+private:
+  std::vector<char> fetch(const Member &member, bool take) {
+#ifdef HAVE_LIBARCHIVE
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      auto it = buffered.find(member.ordinal);
+      if (it != buffered.end() && !take) {
+        return it->second;
+      }
+      if (it != buffered.end()) {
+        std::vector<char> data = std::move(it->second);
+        buffered.erase(it);
+        selected.erase(member.ordinal);
+        return data;
+      }
+      if (!failure.empty()) {
+        throw std::runtime_error(failure);
+      }
+      if (member.ordinal < nextOrdinal) {
+        lock.unlock();
+        return readAlone(member);
+      }
+      if (reading) {
+        progressed.wait(lock);
+        continue;
+      }
+
+      // Become the reader for one entry; the lock is released while it is
+      // decompressed so finished members can be taken meanwhile
+      reading = true;
+      size_t ordinal = nextOrdinal;
+      const Member *current = memberAt(ordinal);
+      bool keep = current && selected.count(ordinal);
+      lock.unlock();
+      std::vector<char> data;
+      std::string error;
+      try {
+        if (!reader) {
+          reader = open();
+        }
+        archive_entry *entry;
+        if (archive_read_next_header(reader.get(), &entry) != ARCHIVE_OK) {
+          throw std::runtime_error("Failed to read entry " +
+                                   std::to_string(ordinal) + " of " + path);
+        }
+        // Unread data of entries not kept is skipped by next_header
+        if (keep) {
+          data = readData(reader.get(), current->name, current->size);
+        }
+      } catch (const std::exception &e) {
+        error = e.what();
+      }
+      lock.lock();
+      reading = false;
+      nextOrdinal++;
+      if (!error.empty()) {
+        failure = error;
+        reader.reset();
+      } else if (keep) {
+        buffered[ordinal] = std::move(data);
+      }
+      if (!members.empty() && nextOrdinal > members.back().ordinal) {
+        reader.reset(); // past the last member
+      }
+      progressed.notify_all();
+    }
+#else
+    (void)member;
+    (void)take;
+    return {};
+#endif
+  }
+};
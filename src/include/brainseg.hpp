@@ -0,0 +1,104 @@
+#pragma once
+
+// libbrainseg: the segmentation pipeline as an in-process library.
+// Inputs are caller-owned pixel buffers, DICOM files or series directories;
+// masks (0 = background, 1 = tumour) are written into caller-provided
+// buffers or returned as owned vectors. A Context amortises setup across
+// calls and reuses its scratch memory. Contexts are not thread-safe: use one
+// per thread. This header does not expose FAST; errors are thrown as
+// brainseg::Error.
+
+#include "pipeline_params.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace brainseg {
+
+class Error : public std::runtime_error {
+public:
+  using std::runtime_error::runtime_error;
+};
+
+enum class PixelType { UInt8, Int16, UInt16, Float32 };
+
+// A 2D single-channel image the caller owns. rowStride is in bytes; 0 means
+// tightly packed rows.
+struct ImageView {
+  const void *data = nullptr;
+  int width = 0;
+  int height = 0;
+  PixelType type = PixelType::UInt16;
+  size_t rowStride = 0;
+  float spacingX = 1.0f;
+  float spacingY = 1.0f;
+};
+
+// Caller-owned output, at least rowStride * height bytes. rowStride 0 means
+// width bytes per row.
+struct MaskBuffer {
+  uint8_t *data = nullptr;
+  int width = 0;
+  int height = 0;
+  size_t rowStride = 0;
+};
+
+struct SliceResult {
+  std::string source; // file path, empty for buffer input
+  int width = 0;
+  int height = 0;
+  size_t foregroundPixels = 0;
+  double milliseconds = 0.0;
+};
+
+// Owned mask for the allocating overloads
+struct Mask {
+  SliceResult result;
+  std::vector<uint8_t> pixels; // width * height, row-major
+};
+
+// Called once per slice of a series with its index, path and size; returns
+// where that slice's mask should be written
+using MaskAllocator = std::function<MaskBuffer(
+    size_t index, const std::string &path, int width, int height)>;
+
+class Context {
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+
+public:
+  explicit Context(const PipelineParams &params = PipelineParams::reference());
+  ~Context();
+
+  Context(Context &&) noexcept;
+  Context &operator=(Context &&) noexcept;
+  Context(const Context &) = delete;
+  Context &operator=(const Context &) = delete;
+
+  const PipelineParams &getParams() const;
+  void setParams(const PipelineParams &params);
+
+  // Segments a buffer into output, which must match the input size
+  SliceResult segment(const ImageView &input, const MaskBuffer &output);
+  Mask segment(const ImageView &input);
+
+  // Segments one 2D DICOM slice
+  SliceResult segmentFile(const std::string &path, const MaskBuffer &output);
+  Mask segmentFile(const std::string &path);
+
+  // Segments every .dcm file of a series directory in slice order
+  std::vector<SliceResult> segmentSeries(const std::string &directory,
+                                         const MaskAllocator &allocate);
+  std::vector<Mask> segmentSeries(const std::string &directory);
+};
+
+// Library version, "major.minor.patch"
+const char *version();
+
+} // namespace brainseg
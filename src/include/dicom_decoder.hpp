@@ -0,0 +1,686 @@
+#pragma once
+
+// Native decoding of compressed DICOM slices.
+// FAST's importer decodes compressed pixel data single-threaded inside
+// update(). This reads the transfer syntax from the file meta header and,
+// for the compressed syntaxes we can handle, decodes the pixel data here
+// instead so it can run on the worker threads (and, for JPEG 2000, across
+// tiles). RLE Lossless is decoded natively; JPEG-LS uses CharLS
+// (HAVE_CHARLS) and JPEG 2000 uses OpenJPEG (HAVE_OPENJPEG). Samples are
+// masked to BitsStored (sign-extended when signed). Anything else, including
+// the uncompressed syntaxes and slices that need a modality rescale, a
+// MONOCHROME1 inversion or a HighBit other than BitsStored - 1, is left to
+// the importer.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_CHARLS
+#include <charls/charls.h>
+#endif
+#ifdef HAVE_OPENJPEG
+#include <openjpeg.h>
+#endif
+
+namespace dicom {
+
+const std::string RLE_LOSSLESS = "1.2.840.10008.1.2.5";
+const std::string JPEG_LS_LOSSLESS = "1.2.840.10008.1.2.4.80";
+const std::string JPEG_LS_NEAR_LOSSLESS = "1.2.840.10008.1.2.4.81";
+const std::string JPEG_2000_LOSSLESS = "1.2.840.10008.1.2.4.90";
+const std::string JPEG_2000 = "1.2.840.10008.1.2.4.91";
+const std::string IMPLICIT_VR_LITTLE_ENDIAN = "1.2.840.10008.1.2";
+
+// What a slice's header says before its pixel data is read
+struct Header {
+  std::string transferSyntax; // "" when there is no file meta header
+  int rows = 0;
+  int columns = 0;
+
+  size_t pixels() const { return static_cast<size_t>(rows) * columns; }
+};
+
+struct DecodedImage {
+  int width = 0;
+  int height = 0;
+  int bitsAllocated = 16;
+  bool isSigned = false;
+  float spacingX = 1.0f;
+  float spacingY = 1.0f;
+  // Little-endian samples, width * height * bitsAllocated / 8 bytes
+  std::vector<uint8_t> pixels;
+};
+
+namespace detail {
+
+inline uint16_t read16(const uint8_t *p) {
+  return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+inline uint32_t read32(const uint8_t *p) {
+  return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+         (static_cast<uint32_t>(p[2]) << 16) |
+         (static_cast<uint32_t>(p[3]) << 24);
+}
+
+constexpr uint32_t UNDEFINED_LENGTH = 0xFFFFFFFF;
+constexpr uint32_t ITEM = 0xFFFEE000;
+constexpr uint32_t ITEM_DELIMITATION = 0xFFFEE00D;
+constexpr uint32_t SEQUENCE_DELIMITATION = 0xFFFEE0DD;
+constexpr uint32_t PIXEL_DATA = 0x7FE00010;
+
+// Little-endian element reader. Every compressed transfer syntax uses
+// explicit VR for the data set; implicit VR is only read for the header of
+// uncompressed slices.
+class Reader {
+private:
+  const uint8_t *data;
+  size_t size;
+  size_t offset;
+  bool implicitVR;
+
+  void require(size_t bytes) const {
+    if (offset + bytes > size) {
+      throw std::runtime_error("Truncated DICOM data");
+    }
+  }
+
+public:
+  Reader(const uint8_t *data, size_t size, size_t offset,
+         bool implicitVR = false)
+      : data(data), size(size), offset(offset), implicitVR(implicitVR) {}
+
+  bool atEnd() const { return offset >= size; }
+  size_t position() const { return offset; }
+
+  uint32_t readTag() {
+    require(4);
+    uint32_t tag = (static_cast<uint32_t>(read16(data + offset)) << 16) |
+                   read16(data + offset + 2);
+    offset += 4;
+    return tag;
+  }
+
+  uint32_t readLength32() {
+    require(4);
+    uint32_t value = read32(data + offset);
+    offset += 4;
+    return value;
+  }
+
+  // Reads VR and length of a non-item element
+  uint32_t readVRAndLength(char vr[2]) {
+    if (implicitVR) {
+      vr[0] = 'U';
+      vr[1] = 'N';
+      return readLength32();
+    }
+    require(4);
+    vr[0] = static_cast<char>(data[offset]);
+    vr[1] = static_cast<char>(data[offset + 1]);
+    static const char *longVRs[] = {"OB", "OD", "OF", "OL", "OV", "OW", "SQ",
+                                    "SV", "UC", "UN", "UR", "UT", "UV"};
+    for (const char *longVR : longVRs) {
+      if (vr[0] == longVR[0] && vr[1] == longVR[1]) {
+        offset += 4; // VR + 2 reserved bytes
+        return readLength32();
+      }
+    }
+    uint16_t length = read16(data + offset + 2);
+    offset += 4;
+    return length;
+  }
+
+  void skip(size_t bytes) {
+    require(bytes);
+    offset += bytes;
+  }
+
+  // The next `bytes` bytes, checked against the end of the data and then
+  // skipped
+  const uint8_t *take(size_t bytes) {
+    require(bytes);
+    const uint8_t *value = data + offset;
+    offset += bytes;
+    return value;
+  }
+
+  // Skips the items of an undefined-length sequence up to and including
+  // its delimiter
+  void skipUndefinedSequence() {
+    while (true) {
+      uint32_t tag = readTag();
+      uint32_t length = readLength32();
+      if (tag == SEQUENCE_DELIMITATION) {
+        return;
+      }
+      if (tag != ITEM) {
+        throw std::runtime_error("Malformed DICOM sequence");
+      }
+      if (length == UNDEFINED_LENGTH) {
+        skipUndefinedItem();
+      } else {
+        skip(length);
+      }
+    }
+  }
+
+  void skipUndefinedItem() {
+    while (true) {
+      uint32_t tag = readTag();
+      if (tag == ITEM_DELIMITATION) {
+        readLength32();
+        return;
+      }
+      char vr[2];
+      uint32_t length = readVRAndLength(vr);
+      if (length == UNDEFINED_LENGTH) {
+        skipUndefinedSequence();
+      } else {
+        skip(length);
+      }
+    }
+  }
+};
+
+// PackBits decoding of one RLE segment into exactly outSize bytes, written
+// with the given stride (DICOM PS3.5 G.3.1)
+inline void decodeRLESegment(const uint8_t *in, size_t inSize, uint8_t *out,
+                             size_t outSize, size_t stride) {
+  size_t i = 0;
+  size_t o = 0;
+  while (i < inSize && o < outSize) {
+    int8_t n = static_cast<int8_t>(in[i++]);
+    if (n >= 0) {
+      size_t count = std::min<size_t>(static_cast<size_t>(n) + 1, outSize - o);
+      if (i + count > inSize) {
+        throw std::runtime_error("Truncated RLE segment");
+      }
+      for (size_t k = 0; k < count; ++k) {
+        out[(o++) * stride] = in[i++];
+      }
+    } else if (n != -128) {
+      if (i >= inSize) {
+        throw std::runtime_error("Truncated RLE segment");
+      }
+      size_t count = std::min<size_t>(static_cast<size_t>(1 - n), outSize - o);
+      uint8_t value = in[i++];
+      for (size_t k = 0; k < count; ++k) {
+        out[(o++) * stride] = value;
+      }
+    }
+  }
+  if (o < outSize) {
+    throw std::runtime_error("RLE segment decoded to too few bytes");
+  }
+}
+
+// Segments hold the bytes of each sample most significant first; segment s
+// fills byte (bytesPerSample - 1 - s) of every little-endian sample. A slice
+// has at most two segments and each decodes in well under a millisecond at
+// 512x512, so they are decoded in turn: the slices running on the other
+// workers keep the CPUs busy, and a thread per segment cost about as much
+// to start as it saved.
+inline void decodeRLE(const std::vector<uint8_t> &frame, DecodedImage &image) {
+  if (frame.size() < 64) {
+    throw std::runtime_error("RLE frame too short");
+  }
+  size_t bytesPerSample = static_cast<size_t>(image.bitsAllocated / 8);
+  size_t pixels = static_cast<size_t>(image.width) * image.height;
+  uint32_t segments = read32(frame.data());
+  if (segments != bytesPerSample) {
+    throw std::runtime_error("Unsupported RLE segment count " +
+                             std::to_string(segments));
+  }
+  image.pixels.assign(pixels * bytesPerSample, 0);
+  for (uint32_t s = 0; s < segments; ++s) {
+    size_t begin = read32(frame.data() + 4 + 4 * s);
+    size_t end = s + 1 < segments ? read32(frame.data() + 8 + 4 * s)
+                                  : frame.size();
+    if (begin > end || end > frame.size()) {
+      throw std::runtime_error("Bad RLE segment offsets");
+    }
+    decodeRLESegment(frame.data() + begin, end - begin,
+                     image.pixels.data() + (bytesPerSample - 1 - s), pixels,
+                     bytesPerSample);
+  }
+}
+
+// Keeps the low bitsStored bits of every sample, sign-extending them for
+// signed pixels; the bits above may hold overlays (PS3.5 8.1.1)
+inline void maskToBitsStored(DecodedImage &image, int bitsStored) {
+  if (bitsStored >= image.bitsAllocated) {
+    return;
+  }
+  uint32_t mask = (1u << bitsStored) - 1;
+  uint32_t sign = 1u << (bitsStored - 1);
+  size_t bytesPerSample = static_cast<size_t>(image.bitsAllocated / 8);
+  for (size_t i = 0; i < image.pixels.size(); i += bytesPerSample) {
+    uint32_t value = image.pixels[i];
+    if (bytesPerSample == 2) {
+      value |= static_cast<uint32_t>(image.pixels[i + 1]) << 8;
+    }
+    value &= mask;
+    if (image.isSigned && (value & sign)) {
+      value |= ~mask;
+    }
+    image.pixels[i] = static_cast<uint8_t>(value);
+    if (bytesPerSample == 2) {
+      image.pixels[i + 1] = static_cast<uint8_t>(value >> 8);
+    }
+  }
+}
+
+#ifdef HAVE_CHARLS
+inline void decodeJPEGLS(const std::vector<uint8_t> &frame,
+                         DecodedImage &image) {
+  charls_jpegls_decoder *decoder = charls_jpegls_decoder_create();
+  if (!decoder) {
+    throw std::runtime_error("Failed to create JPEG-LS decoder");
+  }
+  size_t size = 0;
+  charls_frame_info info{};
+  bool ok = charls_jpegls_decoder_set_source_buffer(decoder, frame.data(),
+                                                    frame.size()) == 0 &&
+            charls_jpegls_decoder_read_header(decoder) == 0 &&
+            charls_jpegls_decoder_get_frame_info(decoder, &info) == 0 &&
+            charls_jpegls_decoder_get_destination_size(decoder, 0, &size) == 0;
+  if (ok) {
+    image.pixels.resize(size);
+    ok = charls_jpegls_decoder_decode_to_buffer(decoder, image.pixels.data(),
+                                                size, 0) == 0;
+  }
+  charls_jpegls_decoder_destroy(decoder);
+  if (!ok || static_cast<int>(info.width) != image.width ||
+      static_cast<int>(info.height) != image.height) {
+    throw std::runtime_error("JPEG-LS decoding failed");
+  }
+}
+#endif
+
+#ifdef HAVE_OPENJPEG
+struct MemoryStream {
+  const uint8_t *data;
+  OPJ_SIZE_T size;
+  OPJ_SIZE_T offset;
+};
+
+inline OPJ_SIZE_T memoryRead(void *buffer, OPJ_SIZE_T bytes, void *user) {
+  auto *stream = static_cast<MemoryStream *>(user);
+  if (stream->offset >= stream->size) {
+    return static_cast<OPJ_SIZE_T>(-1);
+  }
+  OPJ_SIZE_T count = std::min(bytes, stream->size - stream->offset);
+  std::memcpy(buffer, stream->data + stream->offset, count);
+  stream->offset += count;
+  return count;
+}
+
+inline OPJ_OFF_T memorySkip(OPJ_OFF_T bytes, void *user) {
+  auto *stream = static_cast<MemoryStream *>(user);
+  OPJ_OFF_T target = static_cast<OPJ_OFF_T>(stream->offset) + bytes;
+  target = std::max<OPJ_OFF_T>(
+      0, std::min<OPJ_OFF_T>(target, static_cast<OPJ_OFF_T>(stream->size)));
+  OPJ_OFF_T skipped = target - static_cast<OPJ_OFF_T>(stream->offset);
+  stream->offset = static_cast<OPJ_SIZE_T>(target);
+  return skipped;
+}
+
+inline OPJ_BOOL memorySeek(OPJ_OFF_T position, void *user) {
+  auto *stream = static_cast<MemoryStream *>(user);
+  if (position < 0 || static_cast<OPJ_SIZE_T>(position) > stream->size) {
+    return OPJ_FALSE;
+  }
+  stream->offset = static_cast<OPJ_SIZE_T>(position);
+  return OPJ_TRUE;
+}
+
+// threads > 1 lets OpenJPEG decode code-blocks/tiles in parallel
+inline void decodeJPEG2000(const std::vector<uint8_t> &frame,
+                           DecodedImage &image, int threads) {
+  // DICOM usually stores a raw codestream, occasionally a JP2 file
+  bool rawCodestream = frame.size() >= 4 && frame[0] == 0xFF &&
+                       frame[1] == 0x4F && frame[2] == 0xFF &&
+                       frame[3] == 0x51;
+  opj_codec_t *codec =
+      opj_create_decompress(rawCodestream ? OPJ_CODEC_J2K : OPJ_CODEC_JP2);
+  opj_dparameters_t parameters;
+  opj_set_default_decoder_parameters(&parameters);
+  opj_setup_decoder(codec, &parameters);
+  if (threads > 1) {
+    opj_codec_set_threads(codec, threads);
+  }
+
+  MemoryStream memory{frame.data(), frame.size(), 0};
+  opj_stream_t *stream = opj_stream_create(OPJ_J2K_STREAM_CHUNK_SIZE, OPJ_TRUE);
+  opj_stream_set_user_data(stream, &memory, nullptr);
+  opj_stream_set_user_data_length(stream, frame.size());
+  opj_stream_set_read_function(stream, memoryRead);
+  opj_stream_set_skip_function(stream, memorySkip);
+  opj_stream_set_seek_function(stream, memorySeek);
+
+  opj_image_t *decoded = nullptr;
+  bool ok = opj_read_header(stream, codec, &decoded) &&
+            opj_decode(codec, stream, decoded) &&
+            opj_end_decompress(codec, stream);
+  if (ok && decoded->numcomps >= 1 &&
+      static_cast<int>(decoded->comps[0].w) == image.width &&
+      static_cast<int>(decoded->comps[0].h) == image.height) {
+    size_t pixels = static_cast<size_t>(image.width) * image.height;
+    size_t bytesPerSample = static_cast<size_t>(image.bitsAllocated / 8);
+    image.pixels.resize(pixels * bytesPerSample);
+    const OPJ_INT32 *samples = decoded->comps[0].data;
+    for (size_t i = 0; i < pixels; ++i) {
+      uint32_t value = static_cast<uint32_t>(samples[i]);
+      for (size_t b = 0; b < bytesPerSample; ++b) {
+        image.pixels[i * bytesPerSample + b] =
+            static_cast<uint8_t>(value >> (8 * b));
+      }
+    }
+  } else {
+    ok = false;
+  }
+  if (decoded) {
+    opj_image_destroy(decoded);
+  }
+  opj_stream_destroy(stream);
+  opj_destroy_codec(codec);
+  if (!ok) {
+    throw std::runtime_error("JPEG 2000 decoding failed");
+  }
+}
+#endif
+
+} // namespace detail
+
+// Returns the transfer syntax UID from a Part 10 file's meta header, or ""
+// if the data does not start with one. Only the meta group is read, so the
+// first few hundred bytes of the file are enough.
+inline std::string readTransferSyntax(const uint8_t *data, size_t size) {
+  if (size < 132 || std::memcmp(data + 128, "DICM", 4) != 0) {
+    return "";
+  }
+  try {
+    detail::Reader reader(data, size, 132);
+    while (!reader.atEnd()) {
+      uint32_t tag = reader.readTag();
+      if ((tag >> 16) != 0x0002) {
+        break;
+      }
+      char vr[2];
+      uint32_t length = reader.readVRAndLength(vr);
+      if (tag == 0x00020010) {
+        std::string uid(reinterpret_cast<const char *>(reader.take(length)),
+                        length);
+        // UIDs are padded to even length with NUL
+        while (!uid.empty() && (uid.back() == '\0' || uid.back() == ' ')) {
+          uid.pop_back();
+        }
+        return uid;
+      }
+      reader.skip(length);
+    }
+  } catch (const std::exception &) {
+    // Truncated header: treat as unknown
+  }
+  return "";
+}
+
+// Reads just enough of a file to find its transfer syntax
+inline std::string readTransferSyntax(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> header(1024);
+  file.read(reinterpret_cast<char *>(header.data()),
+            static_cast<std::streamsize>(header.size()));
+  header.resize(static_cast<size_t>(file.gcount()));
+  return readTransferSyntax(header.data(), header.size());
+}
+
+// Reads the transfer syntax and the Rows and Columns elements from the start
+// of a Part 10 file. data may stop anywhere: whatever was found before the
+// end is returned, with rows and columns 0 if they were not reached.
+inline Header readHeader(const uint8_t *data, size_t size) {
+  Header header;
+  header.transferSyntax = readTransferSyntax(data, size);
+  if (header.transferSyntax.empty()) {
+    return header;
+  }
+  try {
+    detail::Reader reader(data, size, 132);
+    // Skip the meta group, which is always explicit VR
+    while (!reader.atEnd()) {
+      size_t start = reader.position();
+      uint32_t tag = reader.readTag();
+      if ((tag >> 16) != 0x0002) {
+        reader = detail::Reader(
+            data, size, start,
+            header.transferSyntax == IMPLICIT_VR_LITTLE_ENDIAN);
+        break;
+      }
+      char vr[2];
+      reader.skip(reader.readVRAndLength(vr));
+    }
+    while (!reader.atEnd() && (header.rows == 0 || header.columns == 0)) {
+      uint32_t tag = reader.readTag();
+      if ((tag >> 16) > 0x0028) {
+        break; // elements are in tag order
+      }
+      char vr[2];
+      uint32_t length = reader.readVRAndLength(vr);
+      if (length == detail::UNDEFINED_LENGTH) {
+        reader.skipUndefinedSequence();
+        continue;
+      }
+      const uint8_t *value = reader.take(length);
+      if (length == 2 && tag == 0x00280010) {
+        header.rows = detail::read16(value);
+      } else if (length == 2 && tag == 0x00280011) {
+        header.columns = detail::read16(value);
+      }
+    }
+  } catch (const std::exception &) {
+    // Header cut off by the end of data: keep what was found
+  }
+  return header;
+}
+
+// Reads the header of a file from its first bytes
+inline Header readHeader(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> data(16384);
+  file.read(reinterpret_cast<char *>(data.data()),
+            static_cast<std::streamsize>(data.size()));
+  data.resize(static_cast<size_t>(file.gcount()));
+  return readHeader(data.data(), data.size());
+}
+
+inline std::vector<uint8_t> readFile(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("Failed to open " + path);
+  }
+  return std::vector<uint8_t>((std::istreambuf_iterator<char>(file)),
+                              std::istreambuf_iterator<char>());
+}
+
+inline bool canDecode(const std::string &transferSyntax) {
+  if (transferSyntax == RLE_LOSSLESS) {
+    return true;
+  }
+#ifdef HAVE_CHARLS
+  if (transferSyntax == JPEG_LS_LOSSLESS ||
+      transferSyntax == JPEG_LS_NEAR_LOSSLESS) {
+    return true;
+  }
+#endif
+#ifdef HAVE_OPENJPEG
+  if (transferSyntax == JPEG_2000_LOSSLESS || transferSyntax == JPEG_2000) {
+    return true;
+  }
+#endif
+  return false;
+}
+
+// Decodes the first frame of a single-sample (grayscale) compressed slice.
+// threads is the intra-slice parallelism OpenJPEG may use.
+inline DecodedImage decode(const std::vector<uint8_t> &file, int threads = 1) {
+  std::string transferSyntax = readTransferSyntax(file.data(), file.size());
+  if (!canDecode(transferSyntax)) {
+    throw std::runtime_error("Unsupported transfer syntax: " +
+                             (transferSyntax.empty() ? std::string("unknown")
+                                                     : transferSyntax));
+  }
+
+  DecodedImage image;
+  int samplesPerPixel = 1;
+  std::string photometric;
+  int bitsStored = 0;
+  int highBit = -1;
+  std::vector<uint8_t> frame;
+  bool haveFrame = false;
+
+  detail::Reader reader(file.data(), file.size(), 132);
+  while (!reader.atEnd() && !haveFrame) {
+    uint32_t tag = reader.readTag();
+    char vr[2];
+    uint32_t length = reader.readVRAndLength(vr);
+
+    if (tag == detail::PIXEL_DATA) {
+      if (length != detail::UNDEFINED_LENGTH) {
+        throw std::runtime_error("Compressed pixel data is not encapsulated");
+      }
+      // First item is the basic offset table; the fragments of frame one
+      // follow. Single-frame slices may still be split into fragments.
+      bool offsetTable = true;
+      while (true) {
+        uint32_t itemTag = reader.readTag();
+        uint32_t itemLength = reader.readLength32();
+        if (itemTag == detail::SEQUENCE_DELIMITATION) {
+          break;
+        }
+        if (itemTag != detail::ITEM) {
+          throw std::runtime_error("Malformed encapsulated pixel data");
+        }
+        const uint8_t *fragment = reader.take(itemLength);
+        if (!offsetTable) {
+          frame.insert(frame.end(), fragment, fragment + itemLength);
+        }
+        offsetTable = false;
+      }
+      haveFrame = true;
+      break;
+    }
+
+    if (length == detail::UNDEFINED_LENGTH) {
+      reader.skipUndefinedSequence();
+      continue;
+    }
+    const uint8_t *p = reader.take(length);
+    // US values: anything shorter would read into the next element
+    auto us = [&] {
+      if (length < 2) {
+        throw std::runtime_error("Malformed DICOM element");
+      }
+      return detail::read16(p);
+    };
+    switch (tag) {
+    case 0x00280002:
+      samplesPerPixel = us();
+      break;
+    case 0x00280010:
+      image.height = us();
+      break;
+    case 0x00280011:
+      image.width = us();
+      break;
+    case 0x00280004:
+      photometric.assign(reinterpret_cast<const char *>(p), length);
+      while (!photometric.empty() && photometric.back() == ' ') {
+        photometric.pop_back();
+      }
+      break;
+    case 0x00280100:
+      image.bitsAllocated = us();
+      break;
+    case 0x00280101:
+      bitsStored = us();
+      break;
+    case 0x00280102:
+      highBit = us();
+      break;
+    case 0x00280103:
+      image.isSigned = us() == 1;
+      break;
+    case 0x00281052:
+    case 0x00281053: {
+      // Rescale Intercept / Slope. The importer applies the modality
+      // rescale, so anything but the identity is left to it.
+      std::string value(reinterpret_cast<const char *>(p), length);
+      float number = std::stof(value);
+      if (number != (tag == 0x00281053 ? 1.0f : 0.0f)) {
+        throw std::runtime_error("Modality rescale is not supported");
+      }
+      break;
+    }
+    case 0x00280030: {
+      // Pixel Spacing: "row\column" in mm
+      std::string spacing(reinterpret_cast<const char *>(p), length);
+      size_t separator = spacing.find('\\');
+      if (separator != std::string::npos) {
+        image.spacingY = std::stof(spacing.substr(0, separator));
+        image.spacingX = std::stof(spacing.substr(separator + 1));
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  if (!haveFrame || image.width <= 0 || image.height <= 0) {
+    throw std::runtime_error("No pixel data found");
+  }
+  if (samplesPerPixel != 1 ||
+      (image.bitsAllocated != 8 && image.bitsAllocated != 16)) {
+    throw std::runtime_error("Only 8/16-bit grayscale slices are supported");
+  }
+  if (photometric == "MONOCHROME1") {
+    throw std::runtime_error("MONOCHROME1 inversion is not supported");
+  }
+  if (bitsStored <= 0 || bitsStored > image.bitsAllocated) {
+    bitsStored = image.bitsAllocated;
+  }
+  if (highBit >= 0 && highBit != bitsStored - 1) {
+    throw std::runtime_error("HighBit other than BitsStored - 1 is not "
+                             "supported");
+  }
+
+  if (transferSyntax == RLE_LOSSLESS) {
+    detail::decodeRLE(frame, image);
+  }
+#ifdef HAVE_CHARLS
+  else if (transferSyntax == JPEG_LS_LOSSLESS ||
+           transferSyntax == JPEG_LS_NEAR_LOSSLESS) {
+    detail::decodeJPEGLS(frame, image);
+  }
+#endif
+#ifdef HAVE_OPENJPEG
+  else if (transferSyntax == JPEG_2000_LOSSLESS ||
+           transferSyntax == JPEG_2000) {
+    detail::decodeJPEG2000(frame, image, threads);
+  }
+#endif
+#ifndef HAVE_OPENJPEG
+  (void)threads;
+#endif
+  detail::maskToBitsStored(image, bitsStored);
+  return image;
+}
+
+} // namespace dicom
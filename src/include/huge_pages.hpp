@@ -0,0 +1,201 @@
+#pragma once
+
+// Huge-page backed buffers for slice stacks.
+// Large buffers (e.g. a patient's stack of slices) are mapped directly and
+// backed by 2 MB pages, so strided access across rows and slices touches
+// far fewer TLB entries. Explicit mode asks for hugetlbfs
+// pages (MAP_HUGETLB, needs vm.nr_hugepages); if none are reserved it falls
+// back to transparent huge pages (a 2 MB aligned mapping plus
+// madvise(MADV_HUGEPAGE)), and if that is refused too, to normal pages.
+// madvise() succeeds even when THP is disabled system-wide, so a buffer is
+// only reported as THP-backed when the kernel's THP mode is "always" or
+// "madvise". Small requests always use regular memory.
+//
+// Only bench_hugepages uses these buffers. The pipeline keeps no slice
+// stacks of its own: FAST allocates every image it passes between stages,
+// and the native stages only hold one slice per worker, which at 512x512
+// is below a huge page.
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <new>
+#include <string>
+
+namespace hugepages {
+
+constexpr size_t HUGE_PAGE_SIZE = 2u << 20;
+
+enum class Mode { Off, Transparent, Explicit };
+
+// What a buffer actually got
+enum class Backing { Regular, Transparent, Explicit };
+
+inline const char *modeName(Mode mode) {
+  switch (mode) {
+  case Mode::Off:
+    return "off";
+  case Mode::Transparent:
+    return "thp";
+  case Mode::Explicit:
+    return "explicit";
+  }
+  return "unknown";
+}
+
+inline const char *backingName(Backing backing) {
+  switch (backing) {
+  case Backing::Regular:
+    return "regular";
+  case Backing::Transparent:
+    return "thp";
+  case Backing::Explicit:
+    return "hugetlb";
+  }
+  return "unknown";
+}
+
+// The system's THP mode, the bracketed word in
+// /sys/kernel/mm/transparent_hugepage/enabled ("always", "madvise" or
+// "never"); "" when the kernel has no THP. Read once per process.
+inline const std::string &transparentMode() {
+  static const std::string mode = [] {
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string line;
+    std::getline(file, line);
+    size_t open = line.find('[');
+    size_t close = line.find(']', open);
+    return open == std::string::npos || close == std::string::npos
+               ? std::string()
+               : line.substr(open + 1, close - open - 1);
+  }();
+  return mode;
+}
+
+// Whether madvise(MADV_HUGEPAGE) can actually get a mapping huge pages
+inline bool transparentAvailable() {
+  return transparentMode() == "always" || transparentMode() == "madvise";
+}
+
+struct Allocation {
+  void *data = nullptr;
+  size_t bytes = 0;  // mapped length, a multiple of HUGE_PAGE_SIZE if mapped
+  bool mapped = false;
+  Backing backing = Backing::Regular;
+};
+
+inline size_t roundUp(size_t bytes, size_t to) {
+  return (bytes + to - 1) / to * to;
+}
+
+// 2 MB aligned anonymous mapping of exactly `length` bytes
+inline void *mapAligned(size_t length) {
+  size_t padded = length + HUGE_PAGE_SIZE;
+  void *raw = mmap(nullptr, padded, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    return nullptr;
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(raw);
+  uintptr_t aligned = roundUp(start, HUGE_PAGE_SIZE);
+  // Trim the unaligned head and the unused tail
+  if (aligned > start) {
+    munmap(raw, aligned - start);
+  }
+  size_t tail = start + padded - (aligned + length);
+  if (tail > 0) {
+    munmap(reinterpret_cast<void *>(aligned + length), tail);
+  }
+  return reinterpret_cast<void *>(aligned);
+}
+
+inline Allocation allocate(size_t bytes, Mode mode) {
+  Allocation allocation;
+  if (mode == Mode::Off || bytes < HUGE_PAGE_SIZE) {
+    allocation.data = ::operator new(std::max<size_t>(bytes, 1));
+    allocation.bytes = bytes;
+    return allocation;
+  }
+
+  allocation.bytes = roundUp(bytes, HUGE_PAGE_SIZE);
+  allocation.mapped = true;
+  if (mode == Mode::Explicit) {
+    void *data = mmap(nullptr, allocation.bytes, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) {
+      allocation.data = data;
+      allocation.backing = Backing::Explicit;
+      return allocation;
+    }
+  }
+
+  allocation.data = mapAligned(allocation.bytes);
+  if (!allocation.data) {
+    throw std::bad_alloc();
+  }
+  if (madvise(allocation.data, allocation.bytes, MADV_HUGEPAGE) == 0 &&
+      transparentAvailable()) {
+    allocation.backing = Backing::Transparent;
+  }
+  return allocation;
+}
+
+inline void release(const Allocation &allocation) {
+  if (!allocation.data) {
+    return;
+  }
+  if (allocation.mapped) {
+    munmap(allocation.data, allocation.bytes);
+  } else {
+    ::operator delete(allocation.data);
+  }
+}
+
+} // namespace hugepages
+
+// Owning, move-only buffer of `count` elements of T (trivially copyable
+// types only; elements are not constructed)
+template <typename T> class HugePageBuffer {
+private:
+  hugepages::Allocation allocation;
+  size_t count = 0;
+
+public:
+  HugePageBuffer() = default;
+
+  HugePageBuffer(size_t count, hugepages::Mode mode)
+      : allocation(hugepages::allocate(count * sizeof(T), mode)),
+        count(count) {}
+
+  ~HugePageBuffer() { hugepages::release(allocation); }
+
+  HugePageBuffer(HugePageBuffer &&other) noexcept
+      : allocation(other.allocation), count(other.count) {
+    other.allocation = {};
+    other.count = 0;
+  }
+
+  HugePageBuffer &operator=(HugePageBuffer &&other) noexcept {
+    if (this != &other) {
+      hugepages::release(allocation);
+      allocation = other.allocation;
+      count = other.count;
+      other.allocation = {};
+      other.count = 0;
+    }
+    return *this;
+  }
+
+  HugePageBuffer(const HugePageBuffer &) = delete;
+  HugePageBuffer &operator=(const HugePageBuffer &) = delete;
+
+  T *data() { return static_cast<T *>(allocation.data); }
+  const T *data() const { return static_cast<const T *>(allocation.data); }
+  size_t size() const { return count; }
+  T &operator[](size_t i) { return data()[i]; }
+  const T &operator[](size_t i) const { return data()[i]; }
+  hugepages::Backing backing() const { return allocation.backing; }
+};
@@ -0,0 +1,105 @@
+#pragma once
+
+// Comparisons between two images of the same size: maximum absolute error
+// for intensity images, Dice and differing-pixel count for masks (any
+// non-zero pixel is foreground).
+
+#include "FAST/FAST_directives.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Copies the first channel of a 2D image to floats, whatever its type
+inline std::vector<float> imageToFloats(fast::Image::pointer image) {
+  using namespace fast;
+  size_t pixels = static_cast<size_t>(image->getWidth()) * image->getHeight();
+  size_t channels = static_cast<size_t>(image->getNrOfChannels());
+  std::vector<float> values(pixels);
+  auto access = image->getImageAccess(ACCESS_READ);
+  const void *data = access->get();
+
+  auto copy = [&](const auto *typed) {
+    for (size_t i = 0; i < pixels; ++i) {
+      values[i] = static_cast<float>(typed[i * channels]);
+    }
+  };
+  switch (image->getDataType()) {
+  case TYPE_FLOAT:
+    copy(static_cast<const float *>(data));
+    break;
+  case TYPE_UINT8:
+    copy(static_cast<const uint8_t *>(data));
+    break;
+  case TYPE_INT8:
+    copy(static_cast<const int8_t *>(data));
+    break;
+  case TYPE_UINT16:
+    copy(static_cast<const uint16_t *>(data));
+    break;
+  case TYPE_INT16:
+    copy(static_cast<const int16_t *>(data));
+    break;
+  case TYPE_UINT32:
+    copy(static_cast<const uint32_t *>(data));
+    break;
+  case TYPE_INT32:
+    copy(static_cast<const int32_t *>(data));
+    break;
+  default:
+    throw std::runtime_error("Unsupported image data type");
+  }
+  return values;
+}
+
+inline void requireSameSize(fast::Image::pointer a, fast::Image::pointer b) {
+  if (a->getWidth() != b->getWidth() || a->getHeight() != b->getHeight()) {
+    throw std::runtime_error(
+        "Image sizes differ: " + std::to_string(a->getWidth()) + "x" +
+        std::to_string(a->getHeight()) + " vs " +
+        std::to_string(b->getWidth()) + "x" + std::to_string(b->getHeight()));
+  }
+}
+
+inline double maxAbsError(fast::Image::pointer a, fast::Image::pointer b) {
+  requireSameSize(a, b);
+  std::vector<float> x = imageToFloats(a);
+  std::vector<float> y = imageToFloats(b);
+  double error = 0.0;
+  for (size_t i = 0; i < x.size(); ++i) {
+    error = std::max(error, std::fabs(static_cast<double>(x[i]) - y[i]));
+  }
+  return error;
+}
+
+struct MaskComparison {
+  double dice = 1.0;       // 1.0 when both masks are empty
+  size_t differing = 0;    // pixels foreground in exactly one mask
+  size_t foregroundA = 0;
+  size_t foregroundB = 0;
+};
+
+inline MaskComparison compareMasks(const std::vector<float> &a,
+                                   const std::vector<float> &b) {
+  MaskComparison result;
+  size_t both = 0;
+  for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+    bool inA = a[i] != 0.0f;
+    bool inB = b[i] != 0.0f;
+    result.foregroundA += inA;
+    result.foregroundB += inB;
+    both += inA && inB;
+    result.differing += inA != inB;
+  }
+  size_t total = result.foregroundA + result.foregroundB;
+  result.dice = total > 0 ? 2.0 * both / total : 1.0;
+  return result;
+}
+
+inline MaskComparison compareMasks(fast::Image::pointer a,
+                                   fast::Image::pointer b) {
+  requireSameSize(a, b);
+  return compareMasks(imageToFloats(a), imageToFloats(b));
+}
@@ -0,0 +1,219 @@
+#pragma once
+
+// Native preprocessing: IntensityNormalization and IntensityClipping fused
+// into one pass over the slice.
+// Normalization maps [minIntensity, maxIntensity] linearly onto
+// [low, high] and clipping then clamps to [clipMin, clipMax]; both are one
+// multiply-add and a clamp per pixel, written straight to float. In
+// percentile mode the intensity bounds come from a histogram of the slice
+// instead of fixed constants, so scanners with other intensity ranges land
+// on the same normalized scale. The histogram is built by several threads,
+// each into its own interleaved sub-histograms, and merged at the end.
+
+#include "pipeline_params.hpp"
+#include "unsharp_mask.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace preprocess {
+
+// Pixel counts of an 8 or 16-bit slice, one bin per possible value
+struct Histogram {
+  std::vector<uint64_t> counts;
+  // Intensity of bin 0 (-32768 for signed data)
+  int offset = 0;
+  uint64_t total = 0;
+
+  // Lowest intensity with at least `percent` % of the pixels at or below it
+  float percentile(double percent) const {
+    if (total == 0) {
+      return 0.0f;
+    }
+    double target = std::min(std::max(percent, 0.0), 100.0) / 100.0 * total;
+    uint64_t cumulative = 0;
+    for (size_t bin = 0; bin < counts.size(); ++bin) {
+      cumulative += counts[bin];
+      if (cumulative > 0 && cumulative >= target) {
+        return static_cast<float>(static_cast<int>(bin) + offset);
+      }
+    }
+    return static_cast<float>(static_cast<int>(counts.size()) - 1 + offset);
+  }
+};
+
+namespace detail {
+
+// Slices smaller than this per thread are not worth a thread
+constexpr size_t MIN_PIXELS_PER_THREAD = 1 << 16;
+
+// Counts pixels [begin, end) into four sub-histograms in turn, so runs of
+// equal values do not serialize on one counter
+template <typename T>
+void countRange(const T *pixels, size_t begin, size_t end, uint32_t *lanes,
+                size_t bins) {
+  using Unsigned = std::make_unsigned_t<T>;
+  // Flipping the sign bit maps signed values onto bins in order
+  constexpr Unsigned bias =
+      std::is_signed<T>::value ? Unsigned(1) << (8 * sizeof(T) - 1) : 0;
+  size_t i = begin;
+  for (; i + 4 <= end; i += 4) {
+    ++lanes[static_cast<Unsigned>(static_cast<Unsigned>(pixels[i]) ^ bias)];
+    ++lanes[bins + static_cast<Unsigned>(
+                       static_cast<Unsigned>(pixels[i + 1]) ^ bias)];
+    ++lanes[2 * bins + static_cast<Unsigned>(
+                           static_cast<Unsigned>(pixels[i + 2]) ^ bias)];
+    ++lanes[3 * bins + static_cast<Unsigned>(
+                           static_cast<Unsigned>(pixels[i + 3]) ^ bias)];
+  }
+  for (; i < end; ++i) {
+    ++lanes[static_cast<Unsigned>(static_cast<Unsigned>(pixels[i]) ^ bias)];
+  }
+}
+
+template <typename T>
+void applyScalar(const T *pixels, float *out, size_t count, float scale,
+                 float bias, float clipMin, float clipMax) {
+  for (size_t i = 0; i < count; ++i) {
+    float value = static_cast<float>(pixels[i]) * scale + bias;
+    out[i] = std::min(std::max(value, clipMin), clipMax);
+  }
+}
+
+#ifdef UNSHARP_HAVE_X86
+// Eight 16-bit pixels per step: widen to 32-bit, convert, multiply-add and
+// clamp in registers
+template <typename T>
+__attribute__((target("avx2,fma"))) void
+applyAVX2(const T *pixels, float *out, size_t count, float scale, float bias,
+          float clipMin, float clipMax) {
+  static_assert(sizeof(T) == 2, "AVX2 path handles 16-bit pixels");
+  __m256 scales = _mm256_set1_ps(scale);
+  __m256 biases = _mm256_set1_ps(bias);
+  __m256 lower = _mm256_set1_ps(clipMin);
+  __m256 upper = _mm256_set1_ps(clipMax);
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i raw =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + i));
+    __m256i wide = std::is_signed<T>::value ? _mm256_cvtepi16_epi32(raw)
+                                            : _mm256_cvtepu16_epi32(raw);
+    __m256 value =
+        _mm256_fmadd_ps(_mm256_cvtepi32_ps(wide), scales, biases);
+    value = _mm256_min_ps(_mm256_max_ps(value, lower), upper);
+    _mm256_storeu_ps(out + i, value);
+  }
+  applyScalar(pixels + i, out + i, count - i, scale, bias, clipMin, clipMax);
+}
+#endif
+
+} // namespace detail
+
+// Histogram of an 8 or 16-bit slice on up to `threads` threads
+template <typename T>
+Histogram buildHistogram(const T *pixels, size_t count, int threads = 1) {
+  static_assert(std::is_integral<T>::value && sizeof(T) <= 2,
+                "Histograms need 8 or 16-bit pixels");
+  size_t bins = size_t(1) << (8 * sizeof(T));
+  size_t workers = std::max<size_t>(
+      1, std::min<size_t>(threads > 0 ? threads : 1,
+                          count / detail::MIN_PIXELS_PER_THREAD));
+
+  // Four lanes of bins per worker, merged below
+  std::vector<std::vector<uint32_t>> lanes(
+      workers, std::vector<uint32_t>(4 * bins, 0));
+  size_t chunk = (count + workers - 1) / workers;
+  auto work = [&](size_t w) {
+    size_t begin = std::min(count, w * chunk);
+    size_t end = std::min(count, begin + chunk);
+    detail::countRange(pixels, begin, end, lanes[w].data(), bins);
+  };
+  std::vector<std::thread> pool;
+  for (size_t w = 1; w < workers; ++w) {
+    pool.emplace_back(work, w);
+  }
+  work(0);
+  for (auto &thread : pool) {
+    thread.join();
+  }
+
+  Histogram histogram;
+  histogram.counts.assign(bins, 0);
+  histogram.offset = static_cast<int>(std::numeric_limits<T>::min());
+  histogram.total = count;
+  for (const auto &lane : lanes) {
+    for (size_t bin = 0; bin < bins; ++bin) {
+      histogram.counts[bin] += static_cast<uint64_t>(lane[bin]) +
+                               lane[bins + bin] + lane[2 * bins + bin] +
+                               lane[3 * bins + bin];
+    }
+  }
+  return histogram;
+}
+
+// The linear map and clamp both stages amount to
+struct Transform {
+  float minIntensity = 0.0f;
+  float maxIntensity = 1.0f;
+  float low = 0.0f;  // value minIntensity maps to
+  float high = 1.0f; // value maxIntensity maps to
+  float clipMin = -std::numeric_limits<float>::max();
+  float clipMax = std::numeric_limits<float>::max();
+
+  float scale() const {
+    float range = maxIntensity - minIntensity;
+    return (high - low) / (range != 0.0f ? range : 1.0f);
+  }
+  float bias() const { return low - minIntensity * scale(); }
+};
+
+// IntensityNormalization(params.normalizeLowest, params.normalizeHighest,
+// params.normalizeMinIntensity, params.normalizeMaxIntensity) followed by
+// IntensityClipping(params.clipMin, params.clipMax)
+inline Transform transformFor(const PipelineParams &params) {
+  Transform transform;
+  transform.minIntensity = params.normalizeMinIntensity;
+  transform.maxIntensity = params.normalizeMaxIntensity;
+  transform.low = params.normalizeLowest;
+  transform.high = params.normalizeHighest;
+  transform.clipMin = params.clipMin;
+  transform.clipMax = params.clipMax;
+  return transform;
+}
+
+// Takes the transform's intensity range from the histogram percentiles of
+// params.percentileNormalize
+inline void setPercentileRange(Transform &transform,
+                               const Histogram &histogram,
+                               const PipelineParams &params) {
+  transform.minIntensity = histogram.percentile(params.normalizeLowPercentile);
+  transform.maxIntensity =
+      histogram.percentile(params.normalizeHighPercentile);
+}
+
+// Normalizes and clips `count` pixels into out in one pass
+template <typename T>
+void apply(const T *pixels, float *out, size_t count,
+           const Transform &transform, unsharp::Isa isa = unsharp::bestIsa()) {
+  float scale = transform.scale();
+  float bias = transform.bias();
+#ifdef UNSHARP_HAVE_X86
+  if constexpr (sizeof(T) == 2) {
+    if (isa == unsharp::Isa::AVX2 && unsharp::cpuHasAVX2()) {
+      detail::applyAVX2(pixels, out, count, scale, bias, transform.clipMin,
+                        transform.clipMax);
+      return;
+    }
+  }
+#endif
+  (void)isa;
+  detail::applyScalar(pixels, out, count, scale, bias, transform.clipMin,
+                      transform.clipMax);
+}
+
+} // namespace preprocess
@@ -0,0 +1,148 @@
+#pragma once
+
+// Slice-granularity priority scheduler.
+// Every slice of every patient job is a separate task. Workers pop the
+// highest-priority task each time they finish a slice, so raising a job's
+// priority takes effect at the next slice boundary without interrupting work
+// already running. Tasks of equal priority come out in submission order,
+// which keeps the default run identical to a FIFO over the sorted patients.
+//
+// Slices pushed with pushAfterPrevious form a chain per job: each waits
+// until the slice before it completes, as seed propagation needs. Many jobs'
+// chains advance side by side (a wavefront), and pop() waits for a running
+// slice to release its successor rather than letting the worker go idle.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <queue>
+#include <vector>
+
+// Priority 0 is the bulk backlog; anything higher jumps ahead of it
+constexpr int BULK_PRIORITY = 0;
+constexpr int URGENT_PRIORITY = 1;
+
+struct SliceTask {
+  int priority = BULK_PRIORITY;
+  size_t sequence = 0; // submission order, breaks ties
+  size_t job = 0;      // index of the owning job
+  size_t slice = 0;    // index of the slice within the job
+};
+
+class SliceScheduler {
+private:
+  struct Compare {
+    // std::priority_queue pops the "largest" element
+    bool operator()(const SliceTask &a, const SliceTask &b) const {
+      if (a.priority != b.priority) {
+        return a.priority < b.priority;
+      }
+      return a.sequence > b.sequence;
+    }
+  };
+
+  std::vector<SliceTask> heap;
+  // Chained slices whose predecessor has not completed yet
+  std::vector<SliceTask> waiting;
+  // Slices popped and not yet completed
+  size_t running = 0;
+  std::mutex mutex;
+  std::condition_variable released;
+  size_t nextSequence = 0;
+
+public:
+  void push(size_t job, size_t slice, int priority) {
+    std::lock_guard<std::mutex> lock(mutex);
+    heap.push_back({priority, nextSequence++, job, slice});
+    std::push_heap(heap.begin(), heap.end(), Compare());
+  }
+
+  // Queues a slice that only becomes ready once slice - 1 of the same job
+  // has completed; the first slice of a job is ready at once
+  void pushAfterPrevious(size_t job, size_t slice, int priority) {
+    if (slice == 0) {
+      push(job, slice, priority);
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    waiting.push_back({priority, nextSequence++, job, slice});
+  }
+
+  // Returns false when no work is left. While chained slices still wait on
+  // running ones, blocks until one is released.
+  bool pop(SliceTask &task) {
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock, [this] {
+      return !heap.empty() || running == 0 || waiting.empty();
+    });
+    if (heap.empty()) {
+      return false;
+    }
+    std::pop_heap(heap.begin(), heap.end(), Compare());
+    task = heap.back();
+    heap.pop_back();
+    running++;
+    return true;
+  }
+
+  // Marks a popped slice as finished (whatever its outcome) and releases
+  // the chained slice after it
+  void complete(size_t job, size_t slice) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running--;
+      for (size_t i = 0; i < waiting.size(); ++i) {
+        if (waiting[i].job == job && waiting[i].slice == slice + 1) {
+          heap.push_back(waiting[i]);
+          std::push_heap(heap.begin(), heap.end(), Compare());
+          waiting.erase(waiting.begin() + i);
+          break;
+        }
+      }
+    }
+    released.notify_all();
+  }
+
+  // Returns a popped slice that was not started to the queue. It keeps its
+  // sequence, so it comes out again ahead of later slices of its priority.
+  void putBack(const SliceTask &task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      running--;
+      heap.push_back(task);
+      std::push_heap(heap.begin(), heap.end(), Compare());
+    }
+    released.notify_all();
+  }
+
+  // Changes the priority of every still-queued slice of a job. Slices that
+  // are already running finish under their old priority.
+  size_t setJobPriority(size_t job, int priority) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t changed = 0;
+    for (auto &task : heap) {
+      if (task.job == job && task.priority != priority) {
+        task.priority = priority;
+        changed++;
+      }
+    }
+    for (auto &task : waiting) {
+      if (task.job == job && task.priority != priority) {
+        task.priority = priority;
+        changed++;
+      }
+    }
+    if (changed > 0) {
+      std::make_heap(heap.begin(), heap.end(), Compare());
+    }
+    return changed;
+  }
+
+  // Queued slices, ready or waiting
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return heap.size() + waiting.size();
+  }
+};
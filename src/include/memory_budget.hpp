@@ -0,0 +1,161 @@
+#pragma once
+
+// Memory governor for the worker pool.
+// Tracks the bytes held by slices, from admission until their results are
+// exported, plus pooled buffers (scratch, montages), and throttles admission
+// of new slices against a budget. A slice is admitted at its working size
+// (every intermediate of the pipeline alive at once). When it finishes it
+// shrinks to what it keeps for export, and that is released after export.
+// A slice that does not fit waits while other slices are still processing,
+// since their finishing frees memory. If none are processing, admit()
+// refuses, so the caller can export what it holds first. A slice is always
+// admitted when no other slice holds memory, so one larger than the whole
+// budget still runs, alone. Pooled buffers count towards the budget and the
+// peak but are never waited for. All of this is accounting from estimates;
+// peakResidentBytes() gives the process' measured peak to set it against.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+class MemoryBudget {
+private:
+  size_t budget; // 0 is unlimited
+  size_t sliceBytes = 0;
+  size_t pooledBytes = 0;
+  size_t processing = 0; // slices admitted and not finished
+  size_t peak = 0;
+  size_t waits = 0;
+  size_t refusals = 0;
+  double waitSeconds = 0.0;
+  std::mutex mutex;
+  std::condition_variable freed;
+
+  bool fits(size_t bytes) const {
+    return budget == 0 || sliceBytes == 0 ||
+           sliceBytes + pooledBytes + bytes <= budget;
+  }
+
+  void notePeak() { peak = std::max(peak, sliceBytes + pooledBytes); }
+
+public:
+  explicit MemoryBudget(size_t budget = 0) : budget(budget) {}
+
+  // Admits a slice of `bytes`, waiting while it does not fit and other
+  // slices are processing. False when it does not fit and none are.
+  bool admit(size_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!fits(bytes)) {
+      auto start = std::chrono::steady_clock::now();
+      waits++;
+      freed.wait(lock, [&] { return fits(bytes) || processing == 0; });
+      waitSeconds += std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+      if (!fits(bytes)) {
+        refusals++;
+        return false;
+      }
+    }
+    sliceBytes += bytes;
+    processing++;
+    notePeak();
+    return true;
+  }
+
+  // An admitted slice is done processing; of the `admitted` bytes it keeps
+  // `retained` until release()
+  void finish(size_t admitted, size_t retained) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      sliceBytes = sliceBytes - admitted + retained;
+      processing--;
+      notePeak();
+    }
+    freed.notify_all();
+  }
+
+  void release(size_t bytes) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      sliceBytes -= std::min(sliceBytes, bytes);
+    }
+    freed.notify_all();
+  }
+
+  // Pooled buffers grown (positive) or freed (negative)
+  void addPooled(int64_t delta) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pooledBytes = delta < 0 ? pooledBytes - std::min<size_t>(pooledBytes,
+                                                              -delta)
+                              : pooledBytes + delta;
+      notePeak();
+    }
+    if (delta < 0) {
+      freed.notify_all();
+    }
+  }
+
+  size_t getBudget() const { return budget; }
+  size_t getPeak() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return peak;
+  }
+  size_t getWaits() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return waits;
+  }
+  size_t getRefusals() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return refusals;
+  }
+  double getWaitSeconds() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return waitSeconds;
+  }
+};
+
+// The process' peak resident set size (VmHWM), 0 when /proc is unavailable
+inline size_t peakResidentBytes() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      std::istringstream in(line.substr(6));
+      size_t kib = 0;
+      in >> kib;
+      return kib * 1024;
+    }
+  }
+  return 0;
+}
+
+// Parses a byte count with an optional K, M or G suffix (powers of 1024)
+inline size_t parseBytes(const std::string &text) {
+  size_t end = 0;
+  double value = std::stod(text, &end);
+  std::string suffix = text.substr(end);
+  double scale = 1.0;
+  if (suffix == "K" || suffix == "k") {
+    scale = 1024.0;
+  } else if (suffix == "M" || suffix == "m") {
+    scale = 1024.0 * 1024.0;
+  } else if (suffix == "G" || suffix == "g") {
+    scale = 1024.0 * 1024.0 * 1024.0;
+  } else if (!suffix.empty()) {
+    throw std::invalid_argument("Unknown size suffix in " + text +
+                                " (expected K, M or G)");
+  }
+  if (value < 0) {
+    throw std::invalid_argument("Negative size: " + text);
+  }
+  return static_cast<size_t>(value * scale);
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+// Per-patient montage of exported slices.
+// Instead of rendering and encoding two JPEGs per slice, every slice of a
+// patient is drawn straight into one RGB image: a cell per slice holding the
+// original and the mask overlaid on it side by side, each scaled to fit a
+// square tile. Slices are drawn in parallel (every slice owns its cell) and
+// the montage is encoded once when the patient is done.
+//
+// The index (.tsv) has one line per slice: the slice name, the x and y of
+// its original and overlay crops in the montage, and their width and height.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace montage {
+
+constexpr int DEFAULT_TILE_SIZE = 256;
+// Twice the usual 512x512 slice; a montage of a long series at this size
+// is already over a gigabyte
+constexpr int MAX_TILE_SIZE = 1024;
+// SegmentationRenderer opacity used by the per-slice export
+constexpr float OVERLAY_OPACITY = 0.6f;
+// Mask colour in the overlay; white, as in the per-slice export, would be
+// lost on bright tissue
+constexpr uint8_t OVERLAY_COLOR[3] = {255, 0, 0};
+
+// Where one slice landed in the montage
+struct Entry {
+  std::string slice;
+  int originalX = 0;
+  int originalY = 0;
+  int overlayX = 0;
+  int overlayY = 0;
+  int width = 0;
+  int height = 0;
+};
+
+class Montage {
+private:
+  int tileSize;
+  int columns;
+  int rows;
+  std::vector<uint8_t> rgb;
+  std::vector<Entry> entries;
+  // One byte per cell, not vector<bool>: cells are filled concurrently
+  std::vector<uint8_t> filled;
+
+  uint8_t *pixel(int x, int y) {
+    return rgb.data() + (static_cast<size_t>(y) * getWidth() + x) * 3;
+  }
+
+public:
+  // Room for `slices` cells, laid out as close to square as possible
+  explicit Montage(size_t slices, int tileSize = DEFAULT_TILE_SIZE)
+      : tileSize(tileSize), entries(slices), filled(slices, 0) {
+    if (slices == 0 || tileSize <= 0) {
+      throw std::invalid_argument("Montage needs slices and a tile size");
+    }
+    // Cells are two tiles wide, so half as many columns keeps it square
+    columns = std::max(
+        1, static_cast<int>(std::ceil(std::sqrt(slices / 2.0))));
+    rows = static_cast<int>((slices + columns - 1) / columns);
+    rgb.assign(static_cast<size_t>(getWidth()) * getHeight() * 3, 0);
+  }
+
+  int getWidth() const { return columns * 2 * tileSize; }
+  int getHeight() const { return rows * tileSize; }
+  int getTileSize() const { return tileSize; }
+  const uint8_t *data() const { return rgb.data(); }
+  size_t cellCount() const { return entries.size(); }
+  size_t bytes() const { return rgb.size(); }
+
+  // Draws slice `cell`: its pixels scaled to the tile with the intensity
+  // range stretched to 0-255, as ImageRenderer does by default, and next to
+  // it the same with the non-zero pixels of mask blended in. The mask is
+  // sampled at its own resolution. Different cells may be drawn at once.
+  template <typename T>
+  void addSlice(size_t cell, const std::string &name, const T *pixels,
+                int width, int height, const uint8_t *mask, int maskWidth,
+                int maskHeight) {
+    if (cell >= entries.size() || width <= 0 || height <= 0) {
+      throw std::invalid_argument("Invalid montage slice " + name);
+    }
+    auto range = std::minmax_element(
+        pixels, pixels + static_cast<size_t>(width) * height);
+    double low = static_cast<double>(*range.first);
+    double span = std::max(1e-12, static_cast<double>(*range.second) - low);
+
+    double scale = static_cast<double>(tileSize) / std::max(width, height);
+    int drawnWidth = std::max(1, static_cast<int>(width * scale + 0.5));
+    int drawnHeight = std::max(1, static_cast<int>(height * scale + 0.5));
+
+    Entry &entry = entries[cell];
+    entry.slice = name;
+    entry.originalX = static_cast<int>(cell % columns) * 2 * tileSize +
+                      (tileSize - drawnWidth) / 2;
+    entry.originalY = static_cast<int>(cell / columns) * tileSize +
+                      (tileSize - drawnHeight) / 2;
+    entry.overlayX = entry.originalX + tileSize;
+    entry.overlayY = entry.originalY;
+    entry.width = drawnWidth;
+    entry.height = drawnHeight;
+
+    for (int y = 0; y < drawnHeight; ++y) {
+      int sourceY = static_cast<int>(static_cast<int64_t>(y) * height /
+                                     drawnHeight);
+      int maskY = static_cast<int>(static_cast<int64_t>(y) * maskHeight /
+                                   drawnHeight);
+      uint8_t *original = pixel(entry.originalX, entry.originalY + y);
+      uint8_t *overlay = pixel(entry.overlayX, entry.overlayY + y);
+      for (int x = 0; x < drawnWidth; ++x) {
+        int sourceX = static_cast<int>(static_cast<int64_t>(x) * width /
+                                       drawnWidth);
+        int maskX = static_cast<int>(static_cast<int64_t>(x) * maskWidth /
+                                     drawnWidth);
+        double value =
+            (pixels[static_cast<size_t>(sourceY) * width + sourceX] - low) /
+            span;
+        uint8_t grey = static_cast<uint8_t>(
+            std::min(255.0, std::max(0.0, value * 255.0 + 0.5)));
+        bool labelled =
+            mask && mask[static_cast<size_t>(maskY) * maskWidth + maskX];
+        for (int c = 0; c < 3; ++c) {
+          original[3 * x + c] = grey;
+          overlay[3 * x + c] =
+              labelled ? static_cast<uint8_t>(
+                             grey * (1.0f - OVERLAY_OPACITY) +
+                             OVERLAY_COLOR[c] * OVERLAY_OPACITY + 0.5f)
+                       : grey;
+        }
+      }
+    }
+    filled[cell] = 1;
+  }
+
+  // Entries of the cells drawn so far, in cell order
+  std::vector<Entry> getEntries() const {
+    std::vector<Entry> drawn;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (filled[i]) {
+        drawn.push_back(entries[i]);
+      }
+    }
+    return drawn;
+  }
+
+  void writeIndex(const std::string &path) const {
+    std::ofstream out(path);
+    out << "slice\toriginal_x\toriginal_y\toverlay_x\toverlay_y\twidth\t"
+           "height\n";
+    for (const Entry &entry : getEntries()) {
+      out << entry.slice << '\t' << entry.originalX << '\t' << entry.originalY
+          << '\t' << entry.overlayX << '\t' << entry.overlayY << '\t'
+          << entry.width << '\t' << entry.height << '\n';
+    }
+    if (!out) {
+      throw std::runtime_error("Failed to write montage index " + path);
+    }
+  }
+};
+
+inline std::vector<Entry> readIndex(const std::string &path) {
+  std::ifstream in(path);
+  if (!in) {
+    throw std::runtime_error("Cannot open montage index " + path);
+  }
+  std::vector<Entry> entries;
+  std::string line;
+  std::getline(in, line); // header
+  while (std::getline(in, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    std::istringstream fields(line);
+    Entry entry;
+    if (!std::getline(fields, entry.slice, '\t') ||
+        !(fields >> entry.originalX >> entry.originalY >> entry.overlayX >>
+          entry.overlayY >> entry.width >> entry.height)) {
+      throw std::runtime_error("Corrupt montage index " + path);
+    }
+    entries.push_back(entry);
+  }
+  return entries;
+}
+
+// Copies one crop (e.g. an entry's original) out of a montage-sized RGB
+// buffer
+inline std::vector<uint8_t> crop(const uint8_t *rgb, int montageWidth, int x,
+                                 int y, int width, int height) {
+  std::vector<uint8_t> out(static_cast<size_t>(width) * height * 3);
+  for (int row = 0; row < height; ++row) {
+    std::copy_n(rgb + (static_cast<size_t>(y + row) * montageWidth + x) * 3,
+                static_cast<size_t>(width) * 3,
+                out.data() + static_cast<size_t>(row) * width * 3);
+  }
+  return out;
+}
+
+} // namespace montage
@@ -0,0 +1,229 @@
+#pragma once
+
+// Binary morphology whose cost does not depend on the radius.
+// Dilation by a disk thresholds the exact squared Euclidean distance
+// transform (Felzenszwalb & Huttenlocher: one linear pass over every row,
+// then one over every column). Dilation by a square, which is what FAST's
+// Dilation(size) does with radius (size - 1) / 2, is a row pass and a column
+// pass of 1D distance to the nearest foreground pixel. Erosion is dilation
+// of the background; pixels outside the image count as foreground there, so
+// the image border does not erode the mask. Rows and columns are split
+// across threads.
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace morphology {
+
+enum class Shape { Square, Disk };
+
+inline const char *shapeName(Shape shape) {
+  return shape == Shape::Disk ? "disk" : "square";
+}
+
+inline Shape parseShape(const std::string &name) {
+  if (name == "square") {
+    return Shape::Square;
+  }
+  if (name == "disk") {
+    return Shape::Disk;
+  }
+  throw std::invalid_argument("Unknown structuring element: " + name +
+                              " (expected square or disk)");
+}
+
+namespace detail {
+
+constexpr float INF = 1e20f;
+
+// Runs body(begin, end) over [0, count) split across threads
+template <typename Body> void parallelFor(int count, int threads, Body body) {
+  int workers = std::max(1, std::min(threads, count));
+  int chunk = (count + workers - 1) / workers;
+  std::vector<std::thread> pool;
+  for (int w = 1; w < workers; ++w) {
+    pool.emplace_back(body, std::min(count, w * chunk),
+                      std::min(count, (w + 1) * chunk));
+  }
+  body(0, std::min(count, chunk));
+  for (auto &thread : pool) {
+    thread.join();
+  }
+}
+
+// 1D squared distance transform of f (0 at sources, INF elsewhere) into d:
+// d[p] = min over q of (p - q)^2 + f[q], via the lower envelope of the
+// parabolas rooted at each q. v and z are scratch of n and n + 1 entries.
+inline void squaredDistance1D(const float *f, float *d, int n, int *v,
+                              float *z) {
+  int k = 0;
+  v[0] = 0;
+  z[0] = -INF;
+  z[1] = INF;
+  auto intersection = [&](int q, int r) {
+    return ((f[q] + static_cast<float>(q) * q) -
+            (f[r] + static_cast<float>(r) * r)) /
+           (2.0f * (q - r));
+  };
+  for (int q = 1; q < n; ++q) {
+    float s = intersection(q, v[k]);
+    // z[0] is -INF, so this stops at the first parabola at the latest
+    while (s <= z[k]) {
+      --k;
+      s = intersection(q, v[k]);
+    }
+    ++k;
+    v[k] = q;
+    z[k] = s;
+    z[k + 1] = INF;
+  }
+  k = 0;
+  for (int q = 0; q < n; ++q) {
+    while (z[k + 1] < q) {
+      ++k;
+    }
+    float offset = static_cast<float>(q - v[k]);
+    d[q] = offset * offset + f[v[k]];
+  }
+}
+
+// Steps to the nearest source, saturating well before int overflow
+constexpr int FAR = std::numeric_limits<int>::max() / 2;
+
+inline int step(bool source, int distance) {
+  return source ? 0 : std::min(FAR, distance + 1);
+}
+
+} // namespace detail
+
+// Squared Euclidean distance of every pixel to the nearest non-zero pixel of
+// mask (INF-ish when there is none)
+inline std::vector<float> squaredDistanceTransform(const uint8_t *mask,
+                                                   int width, int height,
+                                                   int threads = 1) {
+  size_t pixels = static_cast<size_t>(width) * height;
+  std::vector<float> distance(pixels);
+
+  // Rows: sources are the mask pixels themselves
+  detail::parallelFor(height, threads, [&](int begin, int end) {
+    std::vector<float> f(width);
+    std::vector<int> v(width);
+    std::vector<float> z(width + 1);
+    for (int y = begin; y < end; ++y) {
+      const uint8_t *row = mask + static_cast<size_t>(y) * width;
+      for (int x = 0; x < width; ++x) {
+        f[x] = row[x] ? 0.0f : detail::INF;
+      }
+      detail::squaredDistance1D(f.data(), distance.data() + y * size_t(width),
+                                width, v.data(), z.data());
+    }
+  });
+
+  // Columns: sources are the row distances
+  detail::parallelFor(width, threads, [&](int begin, int end) {
+    std::vector<float> f(height);
+    std::vector<float> d(height);
+    std::vector<int> v(height);
+    std::vector<float> z(height + 1);
+    for (int x = begin; x < end; ++x) {
+      for (int y = 0; y < height; ++y) {
+        f[y] = distance[static_cast<size_t>(y) * width + x];
+      }
+      detail::squaredDistance1D(f.data(), d.data(), height, v.data(),
+                                z.data());
+      for (int y = 0; y < height; ++y) {
+        distance[static_cast<size_t>(y) * width + x] = d[y];
+      }
+    }
+  });
+  return distance;
+}
+
+// 0/1 mask of the pixels within `radius` of a non-zero pixel of mask
+inline std::vector<uint8_t> dilate(const uint8_t *mask, int width, int height,
+                                   int radius, Shape shape = Shape::Square,
+                                   int threads = 1) {
+  if (width <= 0 || height <= 0 || radius < 0) {
+    throw std::invalid_argument("Invalid morphology arguments");
+  }
+  size_t pixels = static_cast<size_t>(width) * height;
+  std::vector<uint8_t> result(pixels);
+
+  if (shape == Shape::Disk) {
+    std::vector<float> distance =
+        squaredDistanceTransform(mask, width, height, threads);
+    float limit = static_cast<float>(radius) * radius;
+    for (size_t i = 0; i < pixels; ++i) {
+      result[i] = distance[i] <= limit;
+    }
+    return result;
+  }
+
+  // Square: a row dilation, then a column dilation of its result. Each is
+  // a forward and a backward scan of the distance to the nearest source.
+  std::vector<uint8_t> rows(pixels);
+  detail::parallelFor(height, threads, [&](int begin, int end) {
+    for (int y = begin; y < end; ++y) {
+      const uint8_t *in = mask + static_cast<size_t>(y) * width;
+      uint8_t *out = rows.data() + static_cast<size_t>(y) * width;
+      int distance = detail::FAR;
+      for (int x = 0; x < width; ++x) {
+        distance = detail::step(in[x], distance);
+        out[x] = distance <= radius;
+      }
+      distance = detail::FAR;
+      for (int x = width - 1; x >= 0; --x) {
+        distance = detail::step(in[x], distance);
+        out[x] |= distance <= radius;
+      }
+    }
+  });
+  // Columns are scanned a row at a time so every step reads contiguous
+  // memory; each thread owns a range of columns
+  detail::parallelFor(width, threads, [&](int begin, int end) {
+    std::vector<int> distance(end - begin, detail::FAR);
+    for (int y = 0; y < height; ++y) {
+      size_t offset = static_cast<size_t>(y) * width;
+      for (int x = begin; x < end; ++x) {
+        distance[x - begin] =
+            detail::step(rows[offset + x], distance[x - begin]);
+        result[offset + x] = distance[x - begin] <= radius;
+      }
+    }
+    std::fill(distance.begin(), distance.end(), detail::FAR);
+    for (int y = height - 1; y >= 0; --y) {
+      size_t offset = static_cast<size_t>(y) * width;
+      for (int x = begin; x < end; ++x) {
+        distance[x - begin] =
+            detail::step(rows[offset + x], distance[x - begin]);
+        result[offset + x] |= distance[x - begin] <= radius;
+      }
+    }
+  });
+  return result;
+}
+
+// 0/1 mask of the non-zero pixels of mask with no background pixel within
+// `radius`
+inline std::vector<uint8_t> erode(const uint8_t *mask, int width, int height,
+                                  int radius, Shape shape = Shape::Square,
+                                  int threads = 1) {
+  size_t pixels = static_cast<size_t>(width) * height;
+  std::vector<uint8_t> background(pixels);
+  for (size_t i = 0; i < pixels; ++i) {
+    background[i] = !mask[i];
+  }
+  std::vector<uint8_t> grown =
+      dilate(background.data(), width, height, radius, shape, threads);
+  for (size_t i = 0; i < pixels; ++i) {
+    grown[i] = !grown[i];
+  }
+  return grown;
+}
+
+} // namespace morphology
@@ -0,0 +1,227 @@
+#pragma once
+
+// Intra-slice parallel region growing.
+// Follows the rules of SeededRegionGrowing's 2D OpenCL kernel but spreads
+// the work over threads. Every seed is foreground whatever its intensity,
+// and growth spreads from the seeds to 8-connected pixels within
+// [min, max]. So a seed outside the range still starts the regions of its
+// in-range neighbours. A seed outside the image is an error, as in FAST.
+// The image is cut into square tiles. Each tile first joins its own in-range
+// pixels into regions; then the pixel pairs that straddle tile borders are
+// joined, all threads working on one shared, lock-free union-find. A region
+// is foreground when a seed lies in it or next to it. Only worth it for
+// large slices; see PARALLEL_THRESHOLD_PIXELS. The parallel-region-growing
+// case of test_equivalence compares the masks with FAST's.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace regiongrow {
+
+// Slices below this many pixels grow faster on one thread with FAST
+constexpr size_t PARALLEL_THRESHOLD_PIXELS = 2048 * 2048;
+
+constexpr int DEFAULT_TILE_SIZE = 256;
+
+struct Seed {
+  int x;
+  int y;
+};
+
+// Union-find over pixel indices that any number of threads may use at once.
+// Roots only ever link to a smaller index, so the structure stays a forest
+// whatever order the unions land in.
+class ConcurrentUnionFind {
+private:
+  std::unique_ptr<std::atomic<uint32_t>[]> parent;
+
+public:
+  explicit ConcurrentUnionFind(size_t size)
+      : parent(new std::atomic<uint32_t>[size]) {
+    for (size_t i = 0; i < size; ++i) {
+      parent[i].store(static_cast<uint32_t>(i), std::memory_order_relaxed);
+    }
+  }
+
+  // Root of x, halving the path on the way
+  uint32_t find(uint32_t x) {
+    while (true) {
+      uint32_t p = parent[x].load(std::memory_order_relaxed);
+      if (p == x) {
+        return x;
+      }
+      uint32_t grandparent = parent[p].load(std::memory_order_relaxed);
+      if (grandparent != p) {
+        parent[x].compare_exchange_weak(p, grandparent,
+                                        std::memory_order_relaxed);
+      }
+      x = grandparent;
+    }
+  }
+
+  void unite(uint32_t a, uint32_t b) {
+    while (true) {
+      a = find(a);
+      b = find(b);
+      if (a == b) {
+        return;
+      }
+      if (a < b) {
+        std::swap(a, b);
+      }
+      // a may have been linked by another thread since find(); retry then
+      uint32_t expected = a;
+      if (parent[a].compare_exchange_strong(expected, b,
+                                            std::memory_order_relaxed)) {
+        return;
+      }
+    }
+  }
+};
+
+// Foreground mask (0/1, row major) of a width x height float image grown
+// from the seeds
+inline std::vector<uint8_t> grow(const float *image, int width, int height,
+                                 float minimum, float maximum,
+                                 const std::vector<Seed> &seeds,
+                                 int threads = 1,
+                                 int tileSize = DEFAULT_TILE_SIZE) {
+  if (width <= 0 || height <= 0 || tileSize <= 0) {
+    throw std::invalid_argument("Region growing needs a non-empty image");
+  }
+  size_t pixels = static_cast<size_t>(width) * height;
+  if (pixels > UINT32_MAX) {
+    throw std::invalid_argument("Image too large for region growing");
+  }
+  auto inRange = [&](size_t i) {
+    return image[i] >= minimum && image[i] <= maximum;
+  };
+  auto index = [width](int x, int y) {
+    return static_cast<size_t>(y) * width + x;
+  };
+
+  int tilesX = (width + tileSize - 1) / tileSize;
+  int tilesY = (height + tileSize - 1) / tileSize;
+  int tileCount = tilesX * tilesY;
+  ConcurrentUnionFind regions(pixels);
+
+  // Runs body(x0, y0, x1, y1) for every tile on `threads` threads
+  auto forEachTile = [&](auto body) {
+    std::atomic<int> next{0};
+    auto work = [&]() {
+      for (int t = next++; t < tileCount; t = next++) {
+        int x0 = t % tilesX * tileSize;
+        int y0 = t / tilesX * tileSize;
+        body(x0, y0, std::min(width, x0 + tileSize),
+             std::min(height, y0 + tileSize));
+      }
+    };
+    std::vector<std::thread> pool;
+    for (int i = 1; i < std::min(threads, tileCount); ++i) {
+      pool.emplace_back(work);
+    }
+    work();
+    for (auto &thread : pool) {
+      thread.join();
+    }
+  };
+
+  // Each 8-connected pair is visited once, from its lower/right pixel:
+  // the left, upper-left, upper and upper-right neighbours
+  const int dx[] = {-1, -1, 0, 1};
+  const int dy[] = {0, -1, -1, -1};
+
+  // Within tiles
+  forEachTile([&](int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        size_t i = index(x, y);
+        if (!inRange(i)) {
+          continue;
+        }
+        for (int n = 0; n < 4; ++n) {
+          int nx = x + dx[n];
+          int ny = y + dy[n];
+          if (nx >= x0 && nx < x1 && ny >= y0 && inRange(index(nx, ny))) {
+            regions.unite(static_cast<uint32_t>(i),
+                          static_cast<uint32_t>(index(nx, ny)));
+          }
+        }
+      }
+    }
+  });
+
+  // Across tile borders: pairs whose neighbour lies in another tile. Only
+  // the top row and the left and right columns of a tile have any.
+  forEachTile([&](int x0, int y0, int x1, int y1) {
+    auto joinOutside = [&](int x, int y) {
+      size_t i = index(x, y);
+      if (!inRange(i)) {
+        return;
+      }
+      for (int n = 0; n < 4; ++n) {
+        int nx = x + dx[n];
+        int ny = y + dy[n];
+        bool outside = nx < x0 || nx >= x1 || ny < y0;
+        if (outside && nx >= 0 && nx < width && ny >= 0 &&
+            inRange(index(nx, ny))) {
+          regions.unite(static_cast<uint32_t>(i),
+                        static_cast<uint32_t>(index(nx, ny)));
+        }
+      }
+    };
+    for (int x = x0; x < x1; ++x) {
+      joinOutside(x, y0);
+    }
+    for (int y = y0 + 1; y < y1; ++y) {
+      joinOutside(x0, y);
+      joinOutside(x1 - 1, y);
+    }
+  });
+
+  // The seeds themselves, and the regions they lie in or next to: an
+  // out-of-range seed is not part of any region, but growth still leaves
+  // it for its in-range neighbours
+  std::vector<uint8_t> mask(pixels, 0);
+  std::vector<uint8_t> seeded(pixels, 0);
+  for (const Seed &seed : seeds) {
+    if (seed.x < 0 || seed.x >= width || seed.y < 0 || seed.y >= height) {
+      throw std::invalid_argument("Seed point out of bounds for region "
+                                  "growing");
+    }
+    size_t i = index(seed.x, seed.y);
+    mask[i] = 1;
+    if (inRange(i)) {
+      seeded[regions.find(static_cast<uint32_t>(i))] = 1;
+      continue;
+    }
+    for (int ny = std::max(0, seed.y - 1);
+         ny <= std::min(height - 1, seed.y + 1); ++ny) {
+      for (int nx = std::max(0, seed.x - 1);
+           nx <= std::min(width - 1, seed.x + 1); ++nx) {
+        if (inRange(index(nx, ny))) {
+          seeded[regions.find(static_cast<uint32_t>(index(nx, ny)))] = 1;
+        }
+      }
+    }
+  }
+
+  forEachTile([&](int x0, int y0, int x1, int y1) {
+    for (int y = y0; y < y1; ++y) {
+      for (int x = x0; x < x1; ++x) {
+        size_t i = index(x, y);
+        if (inRange(i) && seeded[regions.find(static_cast<uint32_t>(i))]) {
+          mask[i] = 1;
+        }
+      }
+    }
+  });
+  return mask;
+}
+
+} // namespace regiongrow
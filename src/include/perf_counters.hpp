@@ -0,0 +1,236 @@
+#pragma once
+
+// Hardware performance counters for the calling thread via perf_event_open.
+// One group per worker thread counts cycles, instructions, last-level cache
+// misses and branch misses in user space. Reads are scaled for multiplexing.
+// If the kernel refuses (perf_event_paranoid, containers, VMs without a PMU)
+// the group reports itself unavailable and readings stay zero; events the CPU
+// lacks are left out of the group and marked missing.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+
+enum class Counter { Cycles, Instructions, LLCMisses, BranchMisses, Count };
+
+constexpr size_t COUNTER_COUNT = static_cast<size_t>(Counter::Count);
+
+struct CounterValues {
+  std::array<uint64_t, COUNTER_COUNT> values{};
+  // Which counters actually counted
+  std::array<bool, COUNTER_COUNT> valid{};
+
+  uint64_t operator[](Counter counter) const {
+    return values[static_cast<size_t>(counter)];
+  }
+
+  bool has(Counter counter) const {
+    return valid[static_cast<size_t>(counter)];
+  }
+
+  CounterValues &operator+=(const CounterValues &other) {
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+      values[i] += other.values[i];
+      valid[i] = valid[i] || other.valid[i];
+    }
+    return *this;
+  }
+};
+
+class PerfEventGroup {
+private:
+  std::array<int, COUNTER_COUNT> fds;
+  // Position of each counter in the group read, -1 if it failed to open
+  std::array<int, COUNTER_COUNT> slot;
+  int members = 0;
+  bool opened = false;
+
+  static int open(uint64_t config, int groupFd) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = groupFd == -1 ? 1 : 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // pid 0, cpu -1: this thread, on whichever CPU it runs
+    return static_cast<int>(
+        syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, 0));
+  }
+
+  void close() {
+    for (int &fd : fds) {
+      if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+  }
+
+public:
+  PerfEventGroup() {
+    fds.fill(-1);
+    slot.fill(-1);
+  }
+
+  ~PerfEventGroup() { close(); }
+
+  PerfEventGroup(const PerfEventGroup &) = delete;
+  PerfEventGroup &operator=(const PerfEventGroup &) = delete;
+
+  PerfEventGroup(PerfEventGroup &&other) noexcept
+      : fds(other.fds), slot(other.slot), members(other.members),
+        opened(other.opened) {
+    other.fds.fill(-1);
+    other.members = 0;
+  }
+
+  PerfEventGroup &operator=(PerfEventGroup &&other) noexcept {
+    if (this != &other) {
+      close();
+      fds = other.fds;
+      slot = other.slot;
+      members = other.members;
+      opened = other.opened;
+      other.fds.fill(-1);
+      other.members = 0;
+    }
+    return *this;
+  }
+
+  // Opens the group for the calling thread. Must be called from the thread
+  // that will be measured; later calls are no-ops.
+  bool openForThisThread() {
+    if (opened) {
+      return available();
+    }
+    opened = true;
+    static const uint64_t configs[COUNTER_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+      int fd = open(configs[i], fds[0]);
+      if (fd < 0) {
+        if (i == 0) {
+          return false; // no leader, no group
+        }
+        continue;
+      }
+      fds[i] = fd;
+      slot[i] = members++;
+    }
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+  }
+
+  bool available() const { return fds[0] >= 0; }
+
+  // Running totals since the group was opened. Subtract two reads to get
+  // the counts of the code in between.
+  CounterValues read() const {
+    CounterValues result;
+    if (!available()) {
+      return result;
+    }
+    uint64_t buffer[3 + COUNTER_COUNT];
+    ssize_t bytes = ::read(fds[0], buffer, sizeof(buffer));
+    if (bytes < static_cast<ssize_t>(3 * sizeof(uint64_t))) {
+      return result;
+    }
+    uint64_t enabled = buffer[1];
+    uint64_t running = buffer[2];
+    double scale =
+        running > 0 ? static_cast<double>(enabled) / running : 0.0;
+    for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+      if (slot[i] >= 0 && static_cast<uint64_t>(slot[i]) < buffer[0]) {
+        result.values[i] = static_cast<uint64_t>(buffer[3 + slot[i]] * scale);
+        result.valid[i] = true;
+      }
+    }
+    return result;
+  }
+
+  // Explains an unavailable PMU, for the one warning printed at startup
+  static std::string unavailableReason() {
+    std::ifstream file("/proc/sys/kernel/perf_event_paranoid");
+    std::string level;
+    if (file >> level) {
+      return "perf_event_open failed (kernel.perf_event_paranoid = " + level +
+             ")";
+    }
+    return "perf_event_open failed";
+  }
+};
+
+// A single event outside the group, e.g. dTLB misses for benchmarks that
+// only care about one number. Counts the calling thread in user space.
+class PerfEventCounter {
+private:
+  int fd = -1;
+
+public:
+  PerfEventCounter(uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+  }
+
+  // Data TLB load misses
+  static PerfEventCounter dtlbMisses() {
+    return PerfEventCounter(PERF_TYPE_HW_CACHE,
+                            PERF_COUNT_HW_CACHE_DTLB |
+                                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+  }
+
+  ~PerfEventCounter() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  PerfEventCounter(PerfEventCounter &&other) noexcept : fd(other.fd) {
+    other.fd = -1;
+  }
+  PerfEventCounter(const PerfEventCounter &) = delete;
+  PerfEventCounter &operator=(const PerfEventCounter &) = delete;
+  PerfEventCounter &operator=(PerfEventCounter &&) = delete;
+
+  bool available() const { return fd >= 0; }
+
+  uint64_t read() const {
+    uint64_t value = 0;
+    if (fd >= 0 && ::read(fd, &value, sizeof(value)) !=
+                       static_cast<ssize_t>(sizeof(value))) {
+      value = 0;
+    }
+    return value;
+  }
+};
+
+inline CounterValues operator-(const CounterValues &end,
+                               const CounterValues &begin) {
+  CounterValues delta;
+  for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+    delta.values[i] =
+        end.values[i] >= begin.values[i] ? end.values[i] - begin.values[i] : 0;
+    delta.valid[i] = end.valid[i] && begin.valid[i];
+  }
+  return delta;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+// Stage parameters of the segmentation pipeline.
+// reference() holds the values the pipeline has always used; the other
+// presets trade mask quality for speed.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+// --quality levels. Full is the reference pipeline; Balanced uses smaller
+// median and sharpening windows; Preview additionally grows regions at half
+// resolution and skips dilation.
+enum class Quality { Full, Balanced, Preview };
+
+inline const char *qualityName(Quality quality) {
+  switch (quality) {
+  case Quality::Full:
+    return "full";
+  case Quality::Balanced:
+    return "balanced";
+  case Quality::Preview:
+    return "preview";
+  }
+  return "unknown";
+}
+
+inline Quality parseQuality(const std::string &name) {
+  if (name == "full") {
+    return Quality::Full;
+  }
+  if (name == "balanced") {
+    return Quality::Balanced;
+  }
+  if (name == "preview") {
+    return Quality::Preview;
+  }
+  throw std::invalid_argument("Unknown quality: " + name +
+                              " (expected full, balanced or preview)");
+}
+
+struct PipelineParams {
+  // IntensityNormalization(lowestValue, highestValue, minimumIntensity,
+  // maximumIntensity): minimumIntensity maps to lowestValue and
+  // maximumIntensity to highestValue
+  float normalizeLowest = 0.5f;
+  float normalizeHighest = 2.5f;
+  float normalizeMinIntensity = 0.0f;
+  float normalizeMaxIntensity = 10000.0f;
+  // Take the intensity range from these percentiles of the slice's
+  // histogram instead of the two constants above (native preprocessing only)
+  bool percentileNormalize = false;
+  float normalizeLowPercentile = 1.0f;
+  float normalizeHighPercentile = 99.0f;
+
+  // IntensityClipping(min, max)
+  float clipMin = 0.68f;
+  float clipMax = 4000.0f;
+
+  // VectorMedianFilter(size)
+  int medianSize = 7;
+
+  // ImageSharpening(gain, stddev, maskSize)
+  float sharpenGain = 2.0f;
+  float sharpenStdDev = 0.5f;
+  int sharpenMaskSize = 9;
+
+  // SeededRegionGrowing(min, max, seeds)
+  float regionMin = 0.74f;
+  float regionMax = 0.91f;
+  // Adds the grid of seeds over the central half of the image on top of the
+  // five centre seeds
+  bool gridSeeds = true;
+
+  // Region growing runs on the image scaled by this factor (seeds scaled
+  // with it) and the mask is scaled back up with nearest neighbour
+  float regionScale = 1.0f;
+
+  // Dilation(size); 0 skips dilation
+  int dilationSize = 3;
+  // Dilate with a disk of radius (dilationSize - 1) / 2 instead of FAST's
+  // square (native morphology only)
+  bool diskDilation = false;
+
+  static PipelineParams reference() { return PipelineParams(); }
+
+  // Stable fingerprint (FNV-1a) of every parameter, recorded in the run
+  // journal so a resumed run only skips slices made with the same settings
+  std::string hash() const {
+    uint64_t h = 14695981039346656037ull;
+    auto mix = [&h](const auto &value) {
+      unsigned char bytes[sizeof(value)];
+      std::memcpy(bytes, &value, sizeof(value));
+      for (unsigned char byte : bytes) {
+        h = (h ^ byte) * 1099511628211ull;
+      }
+    };
+    mix(normalizeLowest);
+    mix(normalizeHighest);
+    mix(normalizeMinIntensity);
+    mix(normalizeMaxIntensity);
+    mix(clipMin);
+    mix(clipMax);
+    mix(medianSize);
+    mix(sharpenGain);
+    mix(sharpenStdDev);
+    mix(sharpenMaskSize);
+    mix(regionMin);
+    mix(regionMax);
+    mix(gridSeeds);
+    mix(dilationSize);
+    // Fields added later only count when changed from their default, so
+    // journals written before they existed keep matching
+    if (regionScale != 1.0f) {
+      mix(regionScale);
+    }
+    if (diskDilation) {
+      mix(diskDilation);
+    }
+    if (percentileNormalize) {
+      mix(percentileNormalize);
+      mix(normalizeLowPercentile);
+      mix(normalizeHighPercentile);
+    }
+
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx",
+                  static_cast<unsigned long long>(h));
+    return hex;
+  }
+
+  // Used to retry slices that blew their deadline: the quality level's
+  // parameters with filter windows no larger than 3 (median) and 5
+  // (sharpening) and only the centre seeds, so a runaway region has fewer
+  // starting points. Everything else, such as Preview's region scale and
+  // skipped dilation, stays as the level has it.
+  static PipelineParams cheap(Quality quality = Quality::Full) {
+    PipelineParams params = forQuality(quality);
+    params.medianSize = std::min(params.medianSize, 3);
+    params.sharpenMaskSize = std::min(params.sharpenMaskSize, 5);
+    params.gridSeeds = false;
+    return params;
+  }
+
+  static PipelineParams forQuality(Quality quality);
+};
+
+inline PipelineParams PipelineParams::forQuality(Quality quality) {
+  PipelineParams params;
+  if (quality == Quality::Full) {
+    return params;
+  }
+  params.medianSize = 5;
+  params.sharpenMaskSize = 7;
+  if (quality == Quality::Preview) {
+    params.sharpenMaskSize = 5;
+    params.regionScale = 0.5f;
+    params.dilationSize = 0;
+  }
+  return params;
+}
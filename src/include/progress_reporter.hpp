@@ -0,0 +1,222 @@
+#pragma once
+
+// Periodic progress/ETA reporting for long runs.
+// Workers only bump relaxed atomic counters and store the index of the item
+// they started; a separate reporter thread samples them at a fixed interval,
+// names the current item, prints throughput and an ETA, and rewrites a small
+// JSON status file that can be watched from outside.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+
+struct ProgressCounters {
+  std::atomic<size_t> completedImages{0}; // attempted, successful or not
+  std::atomic<size_t> failedImages{0};
+  std::atomic<size_t> completedPixels{0};
+
+  void sliceDone(size_t pixels, bool success) {
+    completedImages.fetch_add(1, std::memory_order_relaxed);
+    completedPixels.fetch_add(pixels, std::memory_order_relaxed);
+    if (!success) {
+      failedImages.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+class ProgressReporter {
+public:
+  // Names an item index passed to setCurrent(), e.g. a job's patient ID.
+  // Only ever called on the reporter thread.
+  using Describe = std::function<std::string(size_t)>;
+
+private:
+  static constexpr size_t NO_ITEM = static_cast<size_t>(-1);
+
+  const ProgressCounters &counters;
+  size_t totalImages;
+  std::chrono::milliseconds interval;
+  std::string statusPath;
+
+  std::chrono::steady_clock::time_point startTime;
+  std::thread worker;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+  Describe describe;
+  std::atomic<size_t> currentItem{NO_ITEM};
+
+  // Previous sample, for the rate over the last interval
+  size_t lastImages = 0;
+  size_t lastPixels = 0;
+  std::chrono::steady_clock::time_point lastSample;
+
+  // The label is free-form (patient IDs come from directory names), so it
+  // is escaped before it goes into the JSON string
+  static std::string jsonEscape(const std::string &text) {
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (unsigned char c : text) {
+      if (c == '"' || c == '\\') {
+        escaped += '\\';
+        escaped += static_cast<char>(c);
+      } else if (c < 0x20) {
+        char buffer[8];
+        std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+        escaped += buffer;
+      } else {
+        escaped += static_cast<char>(c);
+      }
+    }
+    return escaped;
+  }
+
+  static std::string formatDuration(double seconds) {
+    if (seconds < 0 || seconds > 1e7) {
+      return "--:--:--";
+    }
+    long s = static_cast<long>(seconds + 0.5);
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%02ld:%02ld:%02ld", s / 3600,
+                  (s / 60) % 60, s % 60);
+    return buffer;
+  }
+
+  void report(bool finished) {
+    auto now = std::chrono::steady_clock::now();
+    size_t images = counters.completedImages.load(std::memory_order_relaxed);
+    size_t failed = counters.failedImages.load(std::memory_order_relaxed);
+    size_t pixels = counters.completedPixels.load(std::memory_order_relaxed);
+
+    double elapsed = std::chrono::duration<double>(now - startTime).count();
+    double window = std::chrono::duration<double>(now - lastSample).count();
+    double overallRate = elapsed > 0 ? images / elapsed : 0.0;
+    double recentRate = window > 0 ? (images - lastImages) / window : 0.0;
+    double mpixRate = window > 0 ? (pixels - lastPixels) / window / 1e6 : 0.0;
+    if (finished) {
+      // The summary line reports the whole run, not the last interval
+      recentRate = overallRate;
+      mpixRate = elapsed > 0 ? pixels / elapsed / 1e6 : 0.0;
+    }
+    // The overall rate is steadier than the last window for the ETA
+    double eta = overallRate > 0 && totalImages > images
+                     ? (totalImages - images) / overallRate
+                     : (totalImages > images ? -1.0 : 0.0);
+    double percent = totalImages > 0 ? 100.0 * images / totalImages : 100.0;
+
+    lastImages = images;
+    lastPixels = pixels;
+    lastSample = now;
+
+    size_t item = currentItem.load(std::memory_order_relaxed);
+    std::string label = item != NO_ITEM && describe ? describe(item) : "";
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << "[progress] " << images
+         << "/" << totalImages << " slices (" << percent << "%)";
+    if (failed > 0) {
+      line << ", " << failed << " failed";
+    }
+    line << std::setprecision(2) << " | " << recentRate << " slices/s | "
+         << mpixRate << " MPix/s | elapsed " << formatDuration(elapsed)
+         << " | ETA " << (finished ? formatDuration(0) : formatDuration(eta));
+    if (!label.empty()) {
+      line << " | " << label;
+    }
+    std::cout << line.str() << std::endl;
+
+    if (!statusPath.empty()) {
+      // Write-then-rename so readers never see a half-written file
+      std::string tmpPath = statusPath + ".tmp";
+      {
+        std::ofstream status(tmpPath, std::ios::trunc);
+        status << std::fixed << std::setprecision(3) << "{\n"
+               << "  \"state\": \"" << (finished ? "finished" : "running")
+               << "\",\n"
+               << "  \"current\": \"" << jsonEscape(label) << "\",\n"
+               << "  \"completed_slices\": " << images << ",\n"
+               << "  \"failed_slices\": " << failed << ",\n"
+               << "  \"total_slices\": " << totalImages << ",\n"
+               << "  \"elapsed_s\": " << elapsed << ",\n"
+               << "  \"slices_per_s\": " << recentRate << ",\n"
+               << "  \"mpix_per_s\": " << mpixRate << ",\n"
+               << "  \"eta_s\": " << (finished ? 0.0 : eta) << "\n"
+               << "}\n";
+      }
+      std::rename(tmpPath.c_str(), statusPath.c_str());
+    }
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+      if (wake.wait_for(lock, interval, [this] { return stopping; })) {
+        break;
+      }
+      lock.unlock();
+      report(false);
+      lock.lock();
+    }
+  }
+
+public:
+  // interval == 0 disables the periodic reports; the final summary line and
+  // status file are still written by stop(). A negative interval throws.
+  // Without describe, no current item is reported.
+  ProgressReporter(const ProgressCounters &counters, size_t totalImages,
+                   std::chrono::milliseconds interval,
+                   const std::string &statusPath,
+                   Describe describe = nullptr)
+      : counters(counters), totalImages(totalImages), interval(interval),
+        statusPath(statusPath), describe(std::move(describe)) {
+    if (interval.count() < 0) {
+      throw std::invalid_argument("Negative progress interval");
+    }
+  }
+
+  ~ProgressReporter() { stop(); }
+
+  ProgressReporter(const ProgressReporter &) = delete;
+  ProgressReporter &operator=(const ProgressReporter &) = delete;
+
+  void start() {
+    startTime = lastSample = std::chrono::steady_clock::now();
+    lastImages = counters.completedImages.load(std::memory_order_relaxed);
+    lastPixels = counters.completedPixels.load(std::memory_order_relaxed);
+    if (interval.count() > 0) {
+      worker = std::thread(&ProgressReporter::run, this);
+    }
+  }
+
+  // Index of the item a worker has just started; one relaxed store, so it
+  // can be called per slice
+  void setCurrent(size_t item) {
+    currentItem.store(item, std::memory_order_relaxed);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (stopping) {
+        return;
+      }
+      stopping = true;
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+      worker.join();
+    }
+    report(true);
+  }
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+// Append-only journal of completed slices, used to resume interrupted runs.
+// Each line is "patient<TAB>slice<TAB>parameter-hash". Completed slices are
+// buffered in memory and written with a single write + fdatasync at batch
+// boundaries, so an interrupted run loses at most the batch in flight.
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+class RunJournal {
+private:
+  std::string path;
+  int fd = -1;
+  std::unordered_set<std::string> completed;
+  std::string pending;
+  std::mutex mutex;
+
+  static std::string key(const std::string &patient, const std::string &slice,
+                         const std::string &paramHash) {
+    return patient + '\t' + slice + '\t' + paramHash;
+  }
+
+public:
+  // resume == false starts a fresh journal; resume == true loads the
+  // existing entries and appends to them
+  RunJournal(const std::string &path, bool resume) : path(path) {
+    if (resume) {
+      std::ifstream in(path);
+      std::string line;
+      while (std::getline(in, line)) {
+        // A torn last line from a crash mid-write has fewer than two tabs
+        if (line.find('\t') != line.rfind('\t')) {
+          completed.insert(line);
+        }
+      }
+    }
+    fd = ::open(path.c_str(),
+                O_WRONLY | O_CREAT | O_APPEND | (resume ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open run journal " + path + ": " +
+                               std::strerror(errno));
+    }
+  }
+
+  ~RunJournal() {
+    try {
+      flush();
+    } catch (const std::exception &) {
+      // Nothing sensible to do while unwinding
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  RunJournal(const RunJournal &) = delete;
+  RunJournal &operator=(const RunJournal &) = delete;
+
+  bool isCompleted(const std::string &patient, const std::string &slice,
+                   const std::string &paramHash) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return completed.count(key(patient, slice, paramHash)) > 0;
+  }
+
+  // Indices of a patient's slices that still have to be processed. With
+  // wholePatient, one missing slice brings back all of them: an output that
+  // holds the whole patient, like a montage, is rewritten from scratch.
+  std::vector<size_t> unfinished(const std::string &patient,
+                                 const std::vector<std::string> &slices,
+                                 const std::string &paramHash,
+                                 bool wholePatient) {
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < slices.size(); ++i) {
+      if (!isCompleted(patient, slices[i], paramHash)) {
+        indices.push_back(i);
+      }
+    }
+    if (wholePatient && !indices.empty()) {
+      indices.resize(slices.size());
+      for (size_t i = 0; i < slices.size(); ++i) {
+        indices[i] = i;
+      }
+    }
+    return indices;
+  }
+
+  size_t completedCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return completed.size();
+  }
+
+  // Buffers an entry; it becomes durable on the next flush()
+  void markCompleted(const std::string &patient, const std::string &slice,
+                     const std::string &paramHash) {
+    std::string entry = key(patient, slice, paramHash);
+    std::lock_guard<std::mutex> lock(mutex);
+    if (completed.insert(entry).second) {
+      pending += entry + '\n';
+    }
+  }
+
+  void flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    const char *data = pending.data();
+    size_t remaining = pending.size();
+    while (remaining > 0) {
+      ssize_t written = ::write(fd, data, remaining);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("Failed to write run journal " + path +
+                                 ": " + std::strerror(errno));
+      }
+      data += written;
+      remaining -= static_cast<size_t>(written);
+    }
+    if (!pending.empty()) {
+      // Written either way; only durability is in doubt if the sync fails
+      pending.clear();
+      if (::fdatasync(fd) != 0) {
+        throw std::runtime_error("Failed to sync run journal " + path + ": " +
+                                 std::strerror(errno));
+      }
+    }
+  }
+};
@@ -0,0 +1,197 @@
+#pragma once
+
+// Inter-slice seed propagation.
+// Adjacent slices of a series show nearly the same anatomy, so instead of
+// the ~30 fixed seeds of seedPoints, slice N + 1 can grow from slice N's
+// mask: the mask is eroded so only its solid core remains, and each
+// connected piece of the core gives one seed, the pixel nearest its
+// centroid. Growing is limited to the previous mask's bounding box plus a
+// margin, so the flood never visits the rest of the slice. A mask with no
+// core left gives no seeds, and the caller falls back to seedPoints.
+
+#include "morphology.hpp"
+#include "parallel_region_growing.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace propagation {
+
+constexpr int DEFAULT_EROSION_RADIUS = 3;
+constexpr int DEFAULT_MARGIN = 16;
+
+// Pixels [x0, x1) x [y0, y1)
+struct Region {
+  int x0 = 0;
+  int y0 = 0;
+  int x1 = 0;
+  int y1 = 0;
+
+  int width() const { return x1 - x0; }
+  int height() const { return y1 - y0; }
+  bool empty() const { return x1 <= x0 || y1 <= y0; }
+  bool contains(int x, int y) const {
+    return x >= x0 && x < x1 && y >= y0 && y < y1;
+  }
+};
+
+struct Propagation {
+  // Dimensions of the mask the seeds come from
+  int width = 0;
+  int height = 0;
+  std::vector<regiongrow::Seed> seeds;
+  // Where the next slice's region may grow
+  Region search;
+
+  bool empty() const { return seeds.empty(); }
+
+  // The same seeds and search region for an image of width x height
+  Propagation scaledTo(int targetWidth, int targetHeight) const {
+    if (targetWidth == width && targetHeight == height) {
+      return *this;
+    }
+    double sx = static_cast<double>(targetWidth) / width;
+    double sy = static_cast<double>(targetHeight) / height;
+    Propagation scaled;
+    scaled.width = targetWidth;
+    scaled.height = targetHeight;
+    for (const regiongrow::Seed &seed : seeds) {
+      scaled.seeds.push_back(
+          {std::min(targetWidth - 1, static_cast<int>(seed.x * sx)),
+           std::min(targetHeight - 1, static_cast<int>(seed.y * sy))});
+    }
+    scaled.search = {static_cast<int>(std::floor(search.x0 * sx)),
+                     static_cast<int>(std::floor(search.y0 * sy)),
+                     std::min(targetWidth,
+                              static_cast<int>(std::ceil(search.x1 * sx))),
+                     std::min(targetHeight,
+                              static_cast<int>(std::ceil(search.y1 * sy)))};
+    return scaled;
+  }
+};
+
+// Seeds and search region for the slice after one whose mask (non-zero is
+// foreground, width x height) is given
+inline Propagation fromMask(const uint8_t *mask, int width, int height,
+                            int erosionRadius = DEFAULT_EROSION_RADIUS,
+                            int margin = DEFAULT_MARGIN) {
+  Propagation result;
+  result.width = width;
+  result.height = height;
+
+  Region box{width, height, 0, 0};
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      if (mask[static_cast<size_t>(y) * width + x]) {
+        box.x0 = std::min(box.x0, x);
+        box.y0 = std::min(box.y0, y);
+        box.x1 = std::max(box.x1, x + 1);
+        box.y1 = std::max(box.y1, y + 1);
+      }
+    }
+  }
+  if (box.empty()) {
+    return result;
+  }
+  result.search = {std::max(0, box.x0 - margin), std::max(0, box.y0 - margin),
+                   std::min(width, box.x1 + margin),
+                   std::min(height, box.y1 + margin)};
+
+  std::vector<uint8_t> core =
+      morphology::erode(mask, width, height, erosionRadius);
+
+  // One seed per 8-connected piece of the core
+  std::vector<uint8_t> visited(core.size(), 0);
+  std::vector<size_t> piece;
+  for (size_t start = 0; start < core.size(); ++start) {
+    if (!core[start] || visited[start]) {
+      continue;
+    }
+    piece.assign(1, start);
+    visited[start] = 1;
+    double sumX = 0.0;
+    double sumY = 0.0;
+    for (size_t next = 0; next < piece.size(); ++next) {
+      int x = static_cast<int>(piece[next] % width);
+      int y = static_cast<int>(piece[next] / width);
+      sumX += x;
+      sumY += y;
+      for (int dy = -1; dy <= 1; ++dy) {
+        for (int dx = -1; dx <= 1; ++dx) {
+          int nx = x + dx;
+          int ny = y + dy;
+          if (nx < 0 || nx >= width || ny < 0 || ny >= height) {
+            continue;
+          }
+          size_t i = static_cast<size_t>(ny) * width + nx;
+          if (core[i] && !visited[i]) {
+            visited[i] = 1;
+            piece.push_back(i);
+          }
+        }
+      }
+    }
+    // The centroid of a curved piece may lie outside it
+    double centerX = sumX / piece.size();
+    double centerY = sumY / piece.size();
+    size_t best = piece[0];
+    double bestDistance = std::numeric_limits<double>::max();
+    for (size_t i : piece) {
+      double ox = static_cast<double>(i % width) - centerX;
+      double oy = static_cast<double>(i / width) - centerY;
+      if (ox * ox + oy * oy < bestDistance) {
+        bestDistance = ox * ox + oy * oy;
+        best = i;
+      }
+    }
+    result.seeds.push_back(
+        {static_cast<int>(best % width), static_cast<int>(best / width)});
+  }
+  return result;
+}
+
+// Region growing (see regiongrow::grow) from propagated seeds, limited to
+// the search region; the returned mask covers the whole width x height
+// image
+inline std::vector<uint8_t> grow(const float *image, int width, int height,
+                                 float minimum, float maximum,
+                                 const Propagation &from, int threads = 1) {
+  if (from.width != width || from.height != height) {
+    throw std::invalid_argument("Propagated seeds are for another image size");
+  }
+  const Region &search = from.search;
+  std::vector<float> window(static_cast<size_t>(search.width()) *
+                            search.height());
+  for (int y = 0; y < search.height(); ++y) {
+    std::copy_n(image + static_cast<size_t>(search.y0 + y) * width +
+                    search.x0,
+                search.width(),
+                window.data() + static_cast<size_t>(y) * search.width());
+  }
+  // Seeds come from inside the previous mask, which the search region
+  // contains; one outside it would only be out of bounds for the window
+  std::vector<regiongrow::Seed> seeds;
+  for (const regiongrow::Seed &seed : from.seeds) {
+    if (search.contains(seed.x, seed.y)) {
+      seeds.push_back({seed.x - search.x0, seed.y - search.y0});
+    }
+  }
+  std::vector<uint8_t> grown =
+      regiongrow::grow(window.data(), search.width(), search.height(),
+                       minimum, maximum, seeds, threads);
+
+  std::vector<uint8_t> mask(static_cast<size_t>(width) * height, 0);
+  for (int y = 0; y < search.height(); ++y) {
+    std::copy_n(grown.data() + static_cast<size_t>(y) * search.width(),
+                search.width(),
+                mask.data() + static_cast<size_t>(search.y0 + y) * width +
+                    search.x0);
+  }
+  return mask;
+}
+
+} // namespace propagation
@@ -0,0 +1,489 @@
+#pragma once
+
+// The reference FAST segmentation pipeline, run to completion on one image
+// with every intermediate kept. This is what optimized kernels are checked
+// against; the seed layout is shared with the production pipeline so both
+// always grow from the same points. Given a TimingReport, every stage is
+// timed as one sample on the given thread. Helpers that take a device mutex
+// hold it around each FAST filter update only (see lockDevice).
+
+#include "FAST/FAST_directives.hpp"
+#include "dicom_decoder.hpp"
+#include "intensity_preprocess.hpp"
+#include "morphology.hpp"
+#include "parallel_region_growing.hpp"
+#include "pipeline_params.hpp"
+#include "rle_mask.hpp"
+#include "seed_propagation.hpp"
+#include "timing_report.hpp"
+#include "unsharp_mask.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Held for one FAST filter update when a device mutex is given. In
+// SharedQueue mode (see thread_config.hpp) this is how workers take turns
+// on the OpenCL device, while the native stages around the updates keep
+// running in parallel.
+inline std::unique_lock<std::mutex> lockDevice(std::mutex *device) {
+  return device ? std::unique_lock<std::mutex>(*device)
+                : std::unique_lock<std::mutex>();
+}
+
+// FAST image holding a natively decoded slice
+inline fast::Image::pointer
+imageFromDecoded(const dicom::DecodedImage &decoded) {
+  using namespace fast;
+  DataType type = decoded.bitsAllocated == 8 ? TYPE_UINT8
+                  : decoded.isSigned         ? TYPE_INT16
+                                             : TYPE_UINT16;
+  auto image = Image::create(decoded.width, decoded.height, type, 1,
+                             decoded.pixels.data());
+  image->setSpacing(Vector3f(decoded.spacingX, decoded.spacingY, 1.0f));
+  return image;
+}
+
+// Normalization and clipping as one native pass (see
+// intensity_preprocess.hpp) over an 8 or 16-bit slice, giving the float
+// image the median filter takes. With params.percentileNormalize the
+// intensity range comes from the slice's histogram, built on `threads`
+// threads.
+inline fast::Image::pointer
+preprocessNative(fast::Image::pointer input, const PipelineParams &params,
+                 int threads = 1, unsharp::Isa isa = unsharp::bestIsa()) {
+  using namespace fast;
+  if (input->getNrOfChannels() != 1) {
+    throw Exception("Native preprocessing needs a single channel image");
+  }
+  size_t pixels = static_cast<size_t>(input->getWidth()) * input->getHeight();
+  std::vector<float> output(pixels);
+
+  preprocess::Transform transform = preprocess::transformFor(params);
+
+  auto run = [&](const auto *data) {
+    if (params.percentileNormalize) {
+      preprocess::setPercentileRange(
+          transform, preprocess::buildHistogram(data, pixels, threads),
+          params);
+    }
+    preprocess::apply(data, output.data(), pixels, transform, isa);
+  };
+  {
+    auto access = input->getImageAccess(ACCESS_READ);
+    const void *data = access->get();
+    switch (input->getDataType()) {
+    case TYPE_UINT8:
+      run(static_cast<const uint8_t *>(data));
+      break;
+    case TYPE_UINT16:
+      run(static_cast<const uint16_t *>(data));
+      break;
+    case TYPE_INT16:
+      run(static_cast<const int16_t *>(data));
+      break;
+    default:
+      throw Exception("Native preprocessing needs 8 or 16-bit input");
+    }
+  }
+
+  auto image = Image::create(input->getWidth(), input->getHeight(),
+                             TYPE_FLOAT, 1, output.data());
+  image->setSpacing(input->getSpacing());
+  return image;
+}
+
+// The intensity range params.percentileNormalize takes from the histogram
+// of an 8 or 16-bit slice, as {minimumIntensity, maximumIntensity}
+inline std::pair<float, float>
+percentileRange(fast::Image::pointer input, const PipelineParams &params,
+                int threads = 1) {
+  using namespace fast;
+  size_t pixels = static_cast<size_t>(input->getWidth()) * input->getHeight();
+  preprocess::Transform transform;
+  auto run = [&](const auto *data) {
+    preprocess::setPercentileRange(
+        transform, preprocess::buildHistogram(data, pixels, threads), params);
+  };
+  auto access = input->getImageAccess(ACCESS_READ);
+  const void *data = access->get();
+  switch (input->getDataType()) {
+  case TYPE_UINT8:
+    run(static_cast<const uint8_t *>(data));
+    break;
+  case TYPE_UINT16:
+    run(static_cast<const uint16_t *>(data));
+    break;
+  case TYPE_INT16:
+    run(static_cast<const int16_t *>(data));
+    break;
+  default:
+    throw Exception("Percentile normalization needs 8 or 16-bit input");
+  }
+  return {transform.minIntensity, transform.maxIntensity};
+}
+
+// The sharpening stage on the CPU (see unsharp_mask.hpp). Takes the float
+// output of the median filter; the result is a new float image.
+inline fast::Image::pointer sharpenNative(fast::Image::pointer input,
+                                          unsharp::UnsharpMask &sharpener) {
+  using namespace fast;
+  if (input->getDataType() != TYPE_FLOAT || input->getNrOfChannels() != 1) {
+    throw Exception("Native sharpening needs a single channel float image");
+  }
+  int width = input->getWidth();
+  int height = input->getHeight();
+  const float *sharpened;
+  {
+    auto access = input->getImageAccess(ACCESS_READ);
+    sharpened = sharpener.apply(static_cast<const float *>(access->get()),
+                                width, height);
+  }
+  auto output = Image::create(width, height, TYPE_FLOAT, 1, sharpened);
+  output->setSpacing(input->getSpacing());
+  return output;
+}
+
+// Five seeds around the image centre, followed by the grid over the central
+// half of the image when params.gridSeeds is set
+inline std::vector<fast::Vector3i> seedPoints(int width, int height,
+                                              const PipelineParams &params) {
+  int centerX = width / 2;
+  int centerY = height / 2;
+  int offsetX = width / 8;
+  int offsetY = height / 8;
+
+  std::vector<fast::Vector3i> seeds = {
+      fast::Vector3i(centerX, centerY, 0),
+      fast::Vector3i(centerX + offsetX, centerY, 0),
+      fast::Vector3i(centerX - offsetX, centerY, 0),
+      fast::Vector3i(centerX, centerY + offsetY, 0),
+      fast::Vector3i(centerX, centerY - offsetY, 0)};
+
+  if (params.gridSeeds) {
+    for (int x = width / 4; x < width * 3 / 4; x += width / 10) {
+      for (int y = height / 4; y < height * 3 / 4; y += height / 10) {
+        seeds.push_back(fast::Vector3i(x, y, 0));
+      }
+    }
+  }
+  return seeds;
+}
+
+// SeededRegionGrowing on `threads` threads (see parallel_region_growing.hpp)
+// for a single channel float image; gives the same UINT8 mask
+inline fast::Image::pointer
+growRegionsParallel(fast::Image::pointer input, const PipelineParams &params,
+                    int threads,
+                    int tileSize = regiongrow::DEFAULT_TILE_SIZE) {
+  using namespace fast;
+  int width = input->getWidth();
+  int height = input->getHeight();
+  std::vector<regiongrow::Seed> seeds;
+  for (const auto &seed : seedPoints(width, height, params)) {
+    seeds.push_back({seed.x(), seed.y()});
+  }
+  std::vector<uint8_t> mask;
+  {
+    auto access = input->getImageAccess(ACCESS_READ);
+    mask = regiongrow::grow(static_cast<const float *>(access->get()), width,
+                            height, params.regionMin, params.regionMax, seeds,
+                            threads, tileSize);
+  }
+  auto output = Image::create(width, height, TYPE_UINT8, 1, mask.data());
+  output->setSpacing(input->getSpacing());
+  return output;
+}
+
+// The sharpened image at params.regionScale of its resolution
+inline fast::Image::pointer regionInput(fast::Image::pointer sharpened,
+                                        const PipelineParams &params,
+                                        std::mutex *device = nullptr) {
+  using namespace fast;
+  if (params.regionScale == 1.0f) {
+    return sharpened;
+  }
+  auto resizer = ImageResizer::create(
+      std::max(1,
+               static_cast<int>(sharpened->getWidth() * params.regionScale)),
+      std::max(1,
+               static_cast<int>(sharpened->getHeight() * params.regionScale)));
+  resizer->connect(sharpened);
+  {
+    auto lock = lockDevice(device);
+    resizer->update();
+  }
+  return resizer->getOutputData<Image>(0);
+}
+
+// Seeded region growing on the sharpened image at params.regionScale of its
+// resolution. The result keeps the reduced size; postProcessMask restores it.
+// With more than one thread, slices of at least PARALLEL_THRESHOLD_PIXELS
+// grow in parallel tiles instead of in FAST's single flood.
+inline fast::Image::pointer growRegions(fast::Image::pointer sharpened,
+                                        const PipelineParams &params,
+                                        int threads = 1,
+                                        std::mutex *device = nullptr) {
+  using namespace fast;
+  Image::pointer input = regionInput(sharpened, params, device);
+
+  size_t pixels = static_cast<size_t>(input->getWidth()) * input->getHeight();
+  if (threads > 1 && pixels >= regiongrow::PARALLEL_THRESHOLD_PIXELS &&
+      input->getDataType() == TYPE_FLOAT && input->getNrOfChannels() == 1) {
+    return growRegionsParallel(input, params, threads);
+  }
+
+  auto regionGrowing = SeededRegionGrowing::create(
+      params.regionMin, params.regionMax,
+      seedPoints(input->getWidth(), input->getHeight(), params));
+  regionGrowing->connect(input);
+  {
+    auto lock = lockDevice(device);
+    regionGrowing->update();
+  }
+  return regionGrowing->getOutputData<Image>(0);
+}
+
+// growRegions from the seeds propagated from the previous slice of the
+// series, within their search region (see seed_propagation.hpp)
+inline fast::Image::pointer
+growRegionsPropagated(fast::Image::pointer sharpened,
+                      const PipelineParams &params,
+                      const propagation::Propagation &from, int threads = 1,
+                      std::mutex *device = nullptr) {
+  using namespace fast;
+  Image::pointer input = regionInput(sharpened, params, device);
+  if (input->getDataType() != TYPE_FLOAT || input->getNrOfChannels() != 1) {
+    throw Exception("Seed propagation needs a single channel float image");
+  }
+  int width = input->getWidth();
+  int height = input->getHeight();
+  std::vector<uint8_t> mask;
+  {
+    auto access = input->getImageAccess(ACCESS_READ);
+    mask = propagation::grow(static_cast<const float *>(access->get()), width,
+                             height, params.regionMin, params.regionMax,
+                             from.scaledTo(width, height), threads);
+  }
+  auto output = Image::create(width, height, TYPE_UINT8, 1, mask.data());
+  output->setSpacing(input->getSpacing());
+  return output;
+}
+
+// Seeds for the next slice of a series from this slice's UINT8 mask
+inline propagation::Propagation
+propagationFromMask(fast::Image::pointer mask,
+                    int erosionRadius = propagation::DEFAULT_EROSION_RADIUS,
+                    int margin = propagation::DEFAULT_MARGIN) {
+  using namespace fast;
+  if (mask->getDataType() != TYPE_UINT8 || mask->getNrOfChannels() != 1) {
+    throw Exception("Seed propagation needs a single channel UINT8 mask");
+  }
+  auto access = mask->getImageAccess(ACCESS_READ);
+  return propagation::fromMask(static_cast<const uint8_t *>(access->get()),
+                               mask->getWidth(), mask->getHeight(),
+                               erosionRadius, margin);
+}
+
+// Dilation(params.dilationSize) of a UINT8 mask on the CPU (see
+// morphology.hpp); a disk instead of a square with params.diskDilation
+inline fast::Image::pointer dilateNative(fast::Image::pointer mask,
+                                         const PipelineParams &params,
+                                         int threads = 1) {
+  using namespace fast;
+  int width = mask->getWidth();
+  int height = mask->getHeight();
+  std::vector<uint8_t> dilated;
+  {
+    auto access = mask->getImageAccess(ACCESS_READ);
+    dilated = morphology::dilate(
+        static_cast<const uint8_t *>(access->get()), width, height,
+        (params.dilationSize - 1) / 2,
+        params.diskDilation ? morphology::Shape::Disk
+                            : morphology::Shape::Square,
+        threads);
+  }
+  auto output = Image::create(width, height, TYPE_UINT8, 1, dilated.data());
+  output->setSpacing(mask->getSpacing());
+  return output;
+}
+
+// A region mask scaled to width x height (nearest neighbour) and cast to
+// UINT8
+inline fast::Image::pointer resizeMask(fast::Image::pointer regions,
+                                       int width, int height,
+                                       std::mutex *device = nullptr) {
+  using namespace fast;
+  Image::pointer mask = regions;
+  if (mask->getWidth() != width || mask->getHeight() != height) {
+    auto resizer = ImageResizer::create(width, height, 0, false);
+    resizer->connect(mask);
+    {
+      auto lock = lockDevice(device);
+      resizer->update();
+    }
+    mask = resizer->getOutputData<Image>(0);
+  }
+
+  auto caster = ImageCaster::create(TYPE_UINT8);
+  caster->connect(mask);
+  {
+    auto lock = lockDevice(device);
+    caster->update();
+  }
+  return caster->getOutputData<Image>(0);
+}
+
+// Scales a region mask back to width x height (nearest neighbour), casts it
+// to UINT8 and dilates it unless params.dilationSize is 0. Dilation runs
+// natively when asked to, or when the shape needs it.
+inline fast::Image::pointer postProcessMask(fast::Image::pointer regions,
+                                            int width, int height,
+                                            const PipelineParams &params,
+                                            bool nativeMorphology = false,
+                                            int threads = 1,
+                                            std::mutex *device = nullptr) {
+  using namespace fast;
+  Image::pointer mask = resizeMask(regions, width, height, device);
+
+  if (params.dilationSize > 0 &&
+      (nativeMorphology || params.diskDilation)) {
+    mask = dilateNative(mask, params, threads);
+  } else if (params.dilationSize > 0) {
+    auto dilation = Dilation::create(params.dilationSize);
+    dilation->connect(mask);
+    {
+      auto lock = lockDevice(device);
+      dilation->update();
+    }
+    mask = dilation->getOutputData<Image>(0);
+  }
+  return mask;
+}
+
+// Run-length encoding of a UINT8 mask image
+inline rle::RleMask rleFromImage(fast::Image::pointer mask) {
+  using namespace fast;
+  if (mask->getDataType() != TYPE_UINT8 || mask->getNrOfChannels() != 1) {
+    throw Exception("RLE masks need a single channel UINT8 image");
+  }
+  auto access = mask->getImageAccess(ACCESS_READ);
+  return rle::RleMask::fromDense(static_cast<const uint8_t *>(access->get()),
+                                 mask->getWidth(), mask->getHeight());
+}
+
+inline fast::Image::pointer imageFromRle(const rle::RleMask &mask) {
+  std::vector<uint8_t> pixels = mask.toDense();
+  return fast::Image::create(mask.getWidth(), mask.getHeight(),
+                             fast::TYPE_UINT8, 1, pixels.data());
+}
+
+// postProcessMask with the mask run-length encoded straight after the
+// resize, and dilated on its runs
+inline rle::RleMask postProcessMaskRle(fast::Image::pointer regions,
+                                       int width, int height,
+                                       const PipelineParams &params,
+                                       std::mutex *device = nullptr) {
+  rle::RleMask mask =
+      rleFromImage(resizeMask(regions, width, height, device));
+  if (params.dilationSize > 0) {
+    mask = mask.dilate((params.dilationSize - 1) / 2,
+                       params.diskDilation ? morphology::Shape::Disk
+                                           : morphology::Shape::Square);
+  }
+  return mask;
+}
+
+struct PipelineStages {
+  fast::Image::pointer input;
+  fast::Image::pointer normalized;
+  fast::Image::pointer clipped;
+  fast::Image::pointer median;
+  fast::Image::pointer sharpened;
+  fast::Image::pointer segmented; // region growing output
+  fast::Image::pointer mask;      // full size UINT8, dilated
+};
+
+// With seedsFrom (and seeds in it), regions grow from the previous slice's
+// propagated seeds instead of seedPoints. With device, each FAST update
+// holds it.
+inline PipelineStages
+runReferencePipeline(fast::Image::pointer input, const PipelineParams &params,
+                     TimingReport *timing = nullptr, int thread = 0,
+                     const propagation::Propagation *seedsFrom = nullptr,
+                     std::mutex *device = nullptr) {
+  using namespace fast;
+  PipelineStages stages;
+  stages.input = input;
+
+  auto timed = [&](Stage stage) {
+    return timing ? std::make_unique<ScopedStageTimer>(*timing, thread, stage)
+                  : nullptr;
+  };
+
+  {
+    // FAST has no percentile mode: only the range comes from the histogram,
+    // the normalization itself is still FAST's
+    auto timer = timed(Stage::Normalize);
+    std::pair<float, float> range = {params.normalizeMinIntensity,
+                                     params.normalizeMaxIntensity};
+    if (params.percentileNormalize) {
+      range = percentileRange(input, params);
+    }
+    auto normalize = IntensityNormalization::create(
+        params.normalizeLowest, params.normalizeHighest, range.first,
+        range.second);
+    normalize->connect(input);
+    auto lock = lockDevice(device);
+    normalize->update();
+    stages.normalized = normalize->getOutputData<Image>(0);
+  }
+
+  auto clipping = IntensityClipping::create(params.clipMin, params.clipMax);
+  clipping->connect(stages.normalized);
+  {
+    auto timer = timed(Stage::Clip);
+    auto lock = lockDevice(device);
+    clipping->update();
+  }
+  stages.clipped = clipping->getOutputData<Image>(0);
+
+  auto medianfilter = VectorMedianFilter::create(params.medianSize);
+  medianfilter->connect(stages.clipped);
+  {
+    auto timer = timed(Stage::Median);
+    auto lock = lockDevice(device);
+    medianfilter->update();
+  }
+  stages.median = medianfilter->getOutputData<Image>(0);
+
+  auto sharpen = ImageSharpening::create(
+      params.sharpenGain, params.sharpenStdDev, params.sharpenMaskSize);
+  sharpen->connect(medianfilter);
+  {
+    auto timer = timed(Stage::Sharpen);
+    auto lock = lockDevice(device);
+    sharpen->update();
+  }
+  stages.sharpened = sharpen->getOutputData<Image>(0);
+
+  {
+    auto timer = timed(Stage::RegionGrowing);
+    stages.segmented =
+        seedsFrom && !seedsFrom->empty()
+            ? growRegionsPropagated(stages.sharpened, params, *seedsFrom, 1,
+                                    device)
+            : growRegions(stages.sharpened, params, 1, device);
+  }
+
+  {
+    auto timer = timed(Stage::PostProcess);
+    stages.mask = postProcessMask(stages.segmented, input->getWidth(),
+                                  input->getHeight(), params, false, 1,
+                                  device);
+  }
+
+  return stages;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+// Per-slice deadline watchdog.
+// Each worker thread announces the slice it starts and finishes in its own
+// slot; a monitor thread polls the slots and flags slices that have been
+// running longer than the deadline. Depending on the policy, a flagged slice
+// is also asked to stop at its next checkpoint, after which the caller may
+// retry it with a cheaper configuration.
+//
+// Work inside a stage cannot be interrupted: FAST stages run to the end of
+// their update(), and so do the native kernels. A stage that overruns is only
+// noticed at the next checkpoint. The last checkpoint of a slice is
+// lastCheckpoint(), placed before the expensive stage (region growing). A
+// deadline that fires after it only flags the slice, which then finishes
+// normally, so a cancelled slice has never done the expensive work that a
+// retry would repeat.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class StragglerPolicy { Flag, Cancel, Retry };
+
+inline StragglerPolicy parseStragglerPolicy(const std::string &name) {
+  if (name == "flag") {
+    return StragglerPolicy::Flag;
+  }
+  if (name == "cancel") {
+    return StragglerPolicy::Cancel;
+  }
+  if (name == "retry") {
+    return StragglerPolicy::Retry;
+  }
+  throw std::runtime_error("Unknown straggler policy: " + name +
+                           " (expected flag, cancel or retry)");
+}
+
+// Thrown from checkpoint() when the watchdog cancelled the current slice
+class SliceCancelled : public std::runtime_error {
+public:
+  explicit SliceCancelled(const std::string &slice)
+      : std::runtime_error("Slice cancelled after exceeding deadline: " +
+                           slice) {}
+};
+
+class SliceWatchdog {
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct alignas(64) Slot {
+    // Clock ticks at slice start, 0 while the thread is idle
+    std::atomic<Clock::rep> startTicks{0};
+    std::atomic<bool> flagged{false};
+    std::atomic<bool> cancelRequested{false};
+    // Past lastCheckpoint(): runs to completion whatever the deadline says
+    std::atomic<bool> committed{false};
+    std::mutex nameMutex;
+    std::string name;
+  };
+
+  std::vector<Slot> slots;
+  std::chrono::milliseconds deadline;
+  StragglerPolicy policy;
+  std::atomic<size_t> stragglers{0};
+
+  std::thread monitor;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+
+  void poll() {
+    Clock::rep now = Clock::now().time_since_epoch().count();
+    Clock::rep limit =
+        std::chrono::duration_cast<Clock::duration>(deadline).count();
+    for (size_t i = 0; i < slots.size(); ++i) {
+      Slot &slot = slots[i];
+      Clock::rep start = slot.startTicks.load(std::memory_order_acquire);
+      if (start == 0 || now - start < limit ||
+          slot.flagged.exchange(true, std::memory_order_acq_rel)) {
+        continue;
+      }
+      stragglers.fetch_add(1, std::memory_order_relaxed);
+      // Paired with lastCheckpoint(): either the worker sees the request
+      // there, or this sees that it already went past
+      const char *action = "";
+      if (policy != StragglerPolicy::Flag) {
+        slot.cancelRequested.store(true, std::memory_order_seq_cst);
+        action = slot.committed.load(std::memory_order_seq_cst)
+                     ? ", past its last checkpoint so letting it finish"
+                     : ", cancelling at its next checkpoint";
+      }
+      std::string name;
+      {
+        std::lock_guard<std::mutex> lock(slot.nameMutex);
+        name = slot.name;
+      }
+      std::cerr << "[watchdog] Straggler on thread " << i << ": \"" << name
+                << "\" has been running for more than "
+                << deadline.count() / 1000.0 << " s" << action << std::endl;
+    }
+  }
+
+  void run() {
+    // Poll often enough that a straggler is caught within a quarter deadline
+    auto period = std::max(std::chrono::milliseconds(10), deadline / 4);
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!wake.wait_for(lock, period, [this] { return stopping; })) {
+      lock.unlock();
+      poll();
+      lock.lock();
+    }
+  }
+
+public:
+  // deadline == 0 disables the monitor thread; begin/end/checkpoint are
+  // then only a few uncontended stores per slice
+  SliceWatchdog(int threads, std::chrono::milliseconds deadline,
+                StragglerPolicy policy)
+      : slots(static_cast<size_t>(std::max(1, threads))), deadline(deadline),
+        policy(policy) {
+    if (deadline.count() > 0) {
+      monitor = std::thread(&SliceWatchdog::run, this);
+    }
+  }
+
+  ~SliceWatchdog() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    if (monitor.joinable()) {
+      monitor.join();
+    }
+  }
+
+  SliceWatchdog(const SliceWatchdog &) = delete;
+  SliceWatchdog &operator=(const SliceWatchdog &) = delete;
+
+  void begin(int thread, const std::string &slice) {
+    Slot &slot = slots[static_cast<size_t>(thread) % slots.size()];
+    {
+      std::lock_guard<std::mutex> lock(slot.nameMutex);
+      slot.name = slice;
+    }
+    slot.flagged.store(false, std::memory_order_relaxed);
+    slot.cancelRequested.store(false, std::memory_order_relaxed);
+    slot.committed.store(false, std::memory_order_relaxed);
+    slot.startTicks.store(Clock::now().time_since_epoch().count(),
+                          std::memory_order_release);
+  }
+
+  // Returns true if the slice was flagged as a straggler
+  bool end(int thread) {
+    Slot &slot = slots[static_cast<size_t>(thread) % slots.size()];
+    slot.startTicks.store(0, std::memory_order_release);
+    return slot.flagged.load(std::memory_order_acquire);
+  }
+
+  // Called between stages; throws SliceCancelled if the monitor asked the
+  // current slice to stop
+  void checkpoint(int thread) {
+    Slot &slot = slots[static_cast<size_t>(thread) % slots.size()];
+    if (slot.cancelRequested.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(slot.nameMutex);
+      throw SliceCancelled(slot.name);
+    }
+  }
+
+  // The final checkpoint, before the expensive stage: throws like
+  // checkpoint() if the slice was cancelled, and otherwise commits it to
+  // finishing, so a later deadline only flags it
+  void lastCheckpoint(int thread) {
+    Slot &slot = slots[static_cast<size_t>(thread) % slots.size()];
+    slot.committed.store(true, std::memory_order_seq_cst);
+    if (slot.cancelRequested.load(std::memory_order_seq_cst)) {
+      std::lock_guard<std::mutex> lock(slot.nameMutex);
+      throw SliceCancelled(slot.name);
+    }
+  }
+
+  StragglerPolicy getPolicy() const { return policy; }
+
+  size_t stragglerCount() const {
+    return stragglers.load(std::memory_order_relaxed);
+  }
+};
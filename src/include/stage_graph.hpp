@@ -0,0 +1,208 @@
+#pragma once
+
+// Incremental, demand-driven pipeline graph.
+// Stages are added after their inputs, so insertion order is a topological
+// order. Every stage caches its last output and carries a dirty flag.
+// Changing a parameter invalidates the stage that reads it, which marks
+// everything downstream dirty. Nothing runs until an output is asked for:
+// update() pulls the requested outputs and get() a single stage, and either
+// recomputes only the dirty stages the result depends on, on the cached
+// outputs of the clean ones upstream. Stages no requested output depends on
+// are dead and never run. Identical nodes are shared through share(), which
+// takes an explicit operation identity covering the stage's parameters;
+// add() never shares, and refuses a name its inputs already feed.
+
+#include <chrono>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+template <typename Value> class StageGraph {
+public:
+  using StageId = size_t;
+  using Compute = std::function<Value(const std::vector<Value> &)>;
+
+private:
+  struct Stage {
+    std::string name;
+    std::string operation; // "" for stages that are never shared
+    std::vector<StageId> inputs;
+    Compute compute;
+    Value value{};
+    bool dirty = true;
+    bool requested = false;
+    double milliseconds = 0.0; // last computation
+  };
+
+  std::vector<Stage> stages;
+
+  Stage &at(StageId id) {
+    if (id >= stages.size()) {
+      throw std::out_of_range("Unknown stage " + std::to_string(id));
+    }
+    return stages[id];
+  }
+
+  // Computes a dirty stage after its dirty inputs, appending what ran
+  void pull(StageId id, std::vector<StageId> &recomputed) {
+    Stage &stage = stages[id];
+    if (!stage.dirty) {
+      return;
+    }
+    std::vector<Value> inputs;
+    for (StageId input : stage.inputs) {
+      pull(input, recomputed);
+      inputs.push_back(stages[input].value);
+    }
+    auto start = std::chrono::steady_clock::now();
+    stage.value = stage.compute(inputs);
+    stage.milliseconds = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+    stage.dirty = false;
+    recomputed.push_back(id);
+  }
+
+  // Per stage, whether a requested output depends on it: a backward sweep
+  // from the outputs, valid because inputs always precede their consumers
+  std::vector<bool> liveness() const {
+    std::vector<bool> live(stages.size(), false);
+    for (StageId id = stages.size(); id-- > 0;) {
+      if (stages[id].requested) {
+        live[id] = true;
+      }
+      if (live[id]) {
+        for (StageId input : stages[id].inputs) {
+          live[input] = true;
+        }
+      }
+    }
+    return live;
+  }
+
+  void checkInputs(const std::string &name,
+                   const std::vector<StageId> &inputs) const {
+    for (StageId input : inputs) {
+      if (input >= stages.size()) {
+        throw std::invalid_argument("Stage " + name +
+                                    " added before its input");
+      }
+    }
+  }
+
+  StageId append(const std::string &name, const std::string &operation,
+                 const std::vector<StageId> &inputs, Compute compute) {
+    stages.push_back({name, operation, inputs, std::move(compute)});
+    return stages.size() - 1;
+  }
+
+public:
+  // Adds a stage computed from the outputs of `inputs`, in that order.
+  // Two computes cannot be compared, so a second stage with the same name
+  // and inputs is an error rather than silently one or the other; use
+  // share() for nodes that may repeat.
+  StageId add(const std::string &name, const std::vector<StageId> &inputs,
+              Compute compute) {
+    checkInputs(name, inputs);
+    for (const Stage &stage : stages) {
+      if (stage.name == name && stage.inputs == inputs) {
+        throw std::invalid_argument("Stage " + name +
+                                    " already reads these inputs");
+      }
+    }
+    return append(name, "", inputs, std::move(compute));
+  }
+
+  // Adds a stage that is shared with an identical one. `operation` names
+  // what compute does, parameters included (e.g. "median 5"): a stage with
+  // the same name, operation and inputs is returned and compute dropped. A
+  // different operation under the same name is a separate stage.
+  StageId share(const std::string &name, const std::string &operation,
+                const std::vector<StageId> &inputs, Compute compute) {
+    checkInputs(name, inputs);
+    if (operation.empty()) {
+      throw std::invalid_argument("Stage " + name +
+                                  " shared without an operation");
+    }
+    for (StageId id = 0; id < stages.size(); ++id) {
+      const Stage &stage = stages[id];
+      if (stage.name != name || stage.inputs != inputs) {
+        continue;
+      }
+      if (stage.operation == operation) {
+        return id;
+      }
+      if (stage.operation.empty()) {
+        throw std::invalid_argument("Stage " + name +
+                                    " already reads these inputs");
+      }
+    }
+    return append(name, operation, inputs, std::move(compute));
+  }
+
+  // Marks a stage as an output of the graph; update() keeps it current
+  void request(StageId id) { at(id).requested = true; }
+
+  void clearRequests() {
+    for (Stage &stage : stages) {
+      stage.requested = false;
+    }
+  }
+
+  // Whether a requested output depends on the stage
+  bool isLive(StageId id) {
+    at(id);
+    return liveness()[id];
+  }
+
+  // Stages no requested output depends on
+  std::vector<StageId> deadStages() {
+    std::vector<bool> live = liveness();
+    std::vector<StageId> dead;
+    for (StageId id = 0; id < stages.size(); ++id) {
+      if (!live[id]) {
+        dead.push_back(id);
+      }
+    }
+    return dead;
+  }
+
+  // Marks a stage and everything that depends on it for recomputation
+  void invalidate(StageId id) {
+    at(id).dirty = true;
+    for (StageId next = id + 1; next < stages.size(); ++next) {
+      for (StageId input : stages[next].inputs) {
+        if (stages[input].dirty) {
+          stages[next].dirty = true;
+          break;
+        }
+      }
+    }
+  }
+
+  // Brings every requested output up to date and returns the ids of the
+  // stages that ran, in the order they ran
+  std::vector<StageId> update() {
+    std::vector<StageId> recomputed;
+    for (StageId id = 0; id < stages.size(); ++id) {
+      if (stages[id].requested) {
+        pull(id, recomputed);
+      }
+    }
+    return recomputed;
+  }
+
+  // The stage's output, computing it first if it is out of date
+  const Value &get(StageId id) {
+    at(id);
+    std::vector<StageId> recomputed;
+    pull(id, recomputed);
+    return stages[id].value;
+  }
+
+  const std::string &name(StageId id) { return at(id).name; }
+  double milliseconds(StageId id) { return at(id).milliseconds; }
+  bool isDirty(StageId id) { return at(id).dirty; }
+  size_t size() const { return stages.size(); }
+};
@@ -0,0 +1,80 @@
+#pragma once
+
+// Deterministic synthetic MR-like slices for tests and benchmarks that must
+// run without the patient dataset: a noisy head-shaped ellipse with a
+// brighter lesion whose size and position vary with the slice index.
+// makeSyntheticSlice varies the lesion a lot from one index to the next;
+// makeSeriesSlice moves and resizes it by a pixel or two per index, like
+// neighbouring slices of one series.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+struct SyntheticSlice {
+  int width = 256;
+  int height = 256;
+  std::vector<uint16_t> pixels;
+};
+
+// Lesion centre and radius are in pixels; index only seeds the noise
+inline SyntheticSlice drawSyntheticSlice(int index, int width, int height,
+                                         double lesionX, double lesionY,
+                                         double lesionR) {
+  SyntheticSlice slice;
+  slice.width = width;
+  slice.height = height;
+  slice.pixels.resize(static_cast<size_t>(width) * height);
+
+  // Small LCG so every platform produces the same noise
+  uint32_t state = 2166136261u ^ static_cast<uint32_t>(index * 7919);
+  auto noise = [&state]() {
+    state = state * 1664525u + 1013904223u;
+    return static_cast<int>((state >> 16) % 201) - 100;
+  };
+
+  double cx = width / 2.0;
+  double cy = height / 2.0;
+  double headX = width * 0.42;
+  double headY = height * 0.47;
+
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      double hx = (x - cx) / headX;
+      double hy = (y - cy) / headY;
+      double lx = x - lesionX;
+      double ly = y - lesionY;
+      int value = 0;
+      if (hx * hx + hy * hy <= 1.0) {
+        value = 1200 + noise();
+        if (lx * lx + ly * ly <= lesionR * lesionR) {
+          value = 2600 + noise();
+        }
+      } else {
+        value = 20 + noise() / 10;
+      }
+      slice.pixels[static_cast<size_t>(y) * width + x] =
+          static_cast<uint16_t>(std::max(0, value));
+    }
+  }
+  return slice;
+}
+
+inline SyntheticSlice makeSyntheticSlice(int index, int width = 256,
+                                         int height = 256) {
+  return drawSyntheticSlice(
+      index, width, height, width / 2.0 + width * 0.08 * std::sin(index * 0.9),
+      height / 2.0 + height * 0.06 * std::cos(index * 0.7),
+      width * (0.06 + 0.02 * (index % 4)));
+}
+
+// Slice `index` of one series: the lesion drifts by at most 0.4% of the
+// width per slice and its radius changes by at most 0.3%
+inline SyntheticSlice makeSeriesSlice(int index, int width = 256,
+                                      int height = 256) {
+  return drawSyntheticSlice(
+      index, width, height, width / 2.0 + width * 0.08 * std::sin(index * 0.05),
+      height / 2.0 + height * 0.06 * std::cos(index * 0.04),
+      width * (0.07 + 0.02 * std::sin(index * 0.15)));
+}
@@ -0,0 +1,330 @@
+#pragma once
+
+// Worker thread count selection for the parallel pipeline.
+// Looks at what the process is actually allowed to use (sched affinity and
+// cgroup v1/v2 CPU quota) and, on larger machines, holds back a CPU for the
+// Qt main thread. The OpenCL runtime's own pool is not budgeted for: in
+// SharedQueue mode it is sized to every usable CPU and overlaps the workers
+// by design, since only one worker at a time has kernels in it. The SMT
+// layout of those CPUs sizes the threads each worker may use inside a slice:
+// workers mostly wait on OpenCL and get a logical CPU each, but the native
+// kernels they run within a slice are compute bound and gain little from SMT
+// siblings.
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// How the OpenMP workers share a CPU OpenCL device with its runtime threads.
+// Independent: no coordination, every worker's kernels fan out onto the
+//   runtime's default-sized pool (the original behaviour).
+// SharedQueue: device stages are serialized so one kernel chain at a time
+//   runs on a runtime pool sized to the usable CPUs, while import and
+//   export stay parallel across the workers.
+// The runtime pool is one per process and shared by every worker's queue,
+// so there is no way to give each worker its own slice of it: a pool sized
+// to a per-worker share would serve all workers' kernels with that many
+// threads.
+enum class ThreadingMode { Independent, SharedQueue };
+
+inline const char *threadingModeName(ThreadingMode mode) {
+  switch (mode) {
+  case ThreadingMode::Independent:
+    return "independent";
+  case ThreadingMode::SharedQueue:
+    return "shared";
+  }
+  return "unknown";
+}
+
+inline ThreadingMode parseThreadingMode(const std::string &name) {
+  if (name == "independent") {
+    return ThreadingMode::Independent;
+  }
+  if (name == "shared") {
+    return ThreadingMode::SharedQueue;
+  }
+  throw std::runtime_error("Unknown threading mode: " + name +
+                           " (expected independent or shared)");
+}
+
+struct ThreadConfig {
+  int workerThreads = 1;  // OpenMP worker threads to use
+  int affinityCpus = 1;   // CPUs in the sched affinity mask
+  double cgroupQuota = -1; // CPUs granted by the cgroup quota, -1 if unlimited
+  std::string cgroupSource = "none";
+  int physicalCores = 1;  // distinct cores among the allowed CPUs
+  int usableCpus = 1;     // min(affinity, ceil(quota))
+  int runtimeReserve = 0; // CPUs left for the Qt main thread
+  std::string reason;
+  ThreadingMode mode = ThreadingMode::Independent;
+  int runtimeThreads = 0; // OpenCL CPU runtime pool size, 0 = runtime default
+
+  // Threads one worker may use inside a slice (native decode, histogram,
+  // morphology, region growing): its share of the physical cores
+  int sliceThreads() const {
+    int cores = std::min(physicalCores, usableCpus);
+    return std::max(1, cores / std::max(1, workerThreads));
+  }
+
+  void print(std::ostream &os = std::cout) const {
+    os << "Thread configuration:\n";
+    os << "  affinity CPUs   : " << affinityCpus << "\n";
+    os << "  cgroup quota    : ";
+    if (cgroupQuota > 0) {
+      os << std::fixed << std::setprecision(2) << cgroupQuota
+         << std::defaultfloat << " CPUs (" << cgroupSource << ")\n";
+    } else {
+      os << "unlimited\n";
+    }
+    os << "  physical cores  : " << physicalCores << " (SMT x"
+       << std::max(1, affinityCpus / std::max(1, physicalCores)) << ")\n";
+    os << "  usable CPUs     : " << usableCpus << "\n";
+    os << "  runtime reserve : " << runtimeReserve
+       << " (Qt main thread only, not the OpenCL pool)\n";
+    os << "  worker threads  : " << workerThreads << " (" << reason << ")\n";
+    os << "  slice threads   : " << sliceThreads()
+       << " per worker (physical cores / workers)\n";
+    os << "  threading mode  : " << threadingModeName(mode) << "\n";
+    os << "  runtime threads : ";
+    if (runtimeThreads > 0) {
+      os << runtimeThreads << " (CPU OpenCL pool)";
+    } else {
+      os << "runtime default";
+    }
+    os << std::endl;
+  }
+};
+
+namespace thread_config {
+
+inline std::vector<int> allowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+  if (cpus.empty()) {
+    unsigned int n = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned int cpu = 0; cpu < n; ++cpu) {
+      cpus.push_back(static_cast<int>(cpu));
+    }
+  }
+  return cpus;
+}
+
+inline bool readFirstLine(const std::string &path, std::string &line) {
+  std::ifstream file(path);
+  return file && std::getline(file, line);
+}
+
+// Returns the cgroup path of this process for the given controller
+// ("" selects the unified v2 hierarchy), or "/" if it cannot be determined.
+inline std::string cgroupPath(const std::string &controller) {
+  std::ifstream file("/proc/self/cgroup");
+  std::string line;
+  while (std::getline(file, line)) {
+    // Format: hierarchy-ID:controller-list:path
+    size_t first = line.find(':');
+    size_t second = line.find(':', first + 1);
+    if (first == std::string::npos || second == std::string::npos) {
+      continue;
+    }
+    std::string controllers = line.substr(first + 1, second - first - 1);
+    std::string path = line.substr(second + 1);
+    if (controller.empty() ? controllers.empty()
+                           : ("," + controllers + ",")
+                                     .find("," + controller + ",") !=
+                                 std::string::npos) {
+      return path.empty() ? "/" : path;
+    }
+  }
+  return "/";
+}
+
+// Walks from the process' own cgroup up to the mount root and returns the
+// tightest quota found. Inside a container the namespace root is usually the
+// container's own cgroup, so the walk is short.
+inline double cgroupV2Quota() {
+  double best = -1;
+  std::string path = cgroupPath("");
+  while (true) {
+    std::string line;
+    std::string dir = "/sys/fs/cgroup" + (path == "/" ? "" : path);
+    if (readFirstLine(dir + "/cpu.max", line)) {
+      std::istringstream in(line);
+      std::string quota;
+      double period = 0;
+      in >> quota >> period;
+      if (quota != "max" && period > 0) {
+        double cpus = std::stod(quota) / period;
+        best = best < 0 ? cpus : std::min(best, cpus);
+      }
+    }
+    if (path == "/" || path.empty()) {
+      break;
+    }
+    size_t slash = path.find_last_of('/');
+    path = slash == 0 ? "/" : path.substr(0, slash);
+  }
+  return best;
+}
+
+inline double cgroupV1Quota() {
+  std::string path = cgroupPath("cpu");
+  for (std::string mount :
+       {"/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct"}) {
+    for (const std::string &dir : {mount + (path == "/" ? "" : path), mount}) {
+      std::string quota, period;
+      if (readFirstLine(dir + "/cpu.cfs_quota_us", quota) &&
+          readFirstLine(dir + "/cpu.cfs_period_us", period)) {
+        long q = std::stol(quota);
+        long p = std::stol(period);
+        if (q > 0 && p > 0) {
+          return static_cast<double>(q) / p;
+        }
+        return -1;
+      }
+    }
+  }
+  return -1;
+}
+
+// Counts distinct (package, core) pairs among the allowed CPUs.
+inline int physicalCoreCount(const std::vector<int> &cpus) {
+  std::set<std::pair<std::string, std::string>> cores;
+  for (int cpu : cpus) {
+    std::string base =
+        "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+    std::string package, core;
+    if (!readFirstLine(base + "physical_package_id", package) ||
+        !readFirstLine(base + "core_id", core)) {
+      return static_cast<int>(cpus.size());
+    }
+    cores.insert({package, core});
+  }
+  return std::max<int>(1, static_cast<int>(cores.size()));
+}
+
+// A positive integer spelled out in full, or 0 for anything else (empty,
+// trailing garbage, out of range)
+inline int parsePositive(const char *text) {
+  errno = 0;
+  char *end = nullptr;
+  long value = std::strtol(text, &end, 10);
+  if (end == text || *end != '\0' || errno == ERANGE || value <= 0 ||
+      value > std::numeric_limits<int>::max()) {
+    return 0;
+  }
+  return static_cast<int>(value);
+}
+
+// Selects the number of OpenMP worker threads.
+// requested > 0 forces a count (e.g. from --threads); maxUseful caps the
+// result at the amount of work that can actually run concurrently.
+inline ThreadConfig detect(int requested = 0, int maxUseful = 0) {
+  ThreadConfig config;
+  std::vector<int> cpus = allowedCpus();
+  config.affinityCpus = static_cast<int>(cpus.size());
+  config.physicalCores = physicalCoreCount(cpus);
+
+  config.cgroupQuota = cgroupV2Quota();
+  if (config.cgroupQuota > 0) {
+    config.cgroupSource = "cgroup v2";
+  } else {
+    config.cgroupQuota = cgroupV1Quota();
+    if (config.cgroupQuota > 0) {
+      config.cgroupSource = "cgroup v1";
+    }
+  }
+
+  config.usableCpus = config.affinityCpus;
+  if (config.cgroupQuota > 0) {
+    config.usableCpus = std::min(
+        config.usableCpus,
+        std::max(1, static_cast<int>(std::ceil(config.cgroupQuota))));
+  }
+
+  // The workers mostly enqueue OpenCL kernels and wait on them, so SMT
+  // siblings are still worth a worker each. What we do keep back is room for
+  // the Qt main thread; on small machines there is nothing to spare.
+  config.runtimeReserve = config.usableCpus >= 8 ? 1 : 0;
+
+  if (requested > 0) {
+    config.workerThreads = requested;
+    config.reason = "requested explicitly";
+    return config;
+  }
+
+  int fromEnv = 0;
+  if (const char *env = std::getenv("OMP_NUM_THREADS")) {
+    fromEnv = parsePositive(env);
+    if (fromEnv == 0) {
+      std::cerr << "Ignoring OMP_NUM_THREADS=\"" << env
+                << "\": expected a positive integer" << std::endl;
+    }
+  }
+
+  if (fromEnv > 0) {
+    config.workerThreads = fromEnv;
+    config.reason = "from OMP_NUM_THREADS";
+  } else {
+    config.workerThreads =
+        std::max(1, config.usableCpus - config.runtimeReserve);
+    if (config.cgroupQuota > 0 && config.usableCpus < config.affinityCpus) {
+      config.reason = "limited by cgroup CPU quota";
+    } else {
+      config.reason = "affinity CPUs minus runtime reserve";
+    }
+  }
+
+  if (maxUseful > 0 && config.workerThreads > maxUseful) {
+    config.workerThreads = maxUseful;
+    config.reason = "capped at batch size";
+  }
+  return config;
+}
+
+// Sizes the CPU OpenCL runtime's thread pool for the chosen mode. Has to run
+// before the first OpenCL call, because runtimes read these variables once at
+// platform initialization. GPU runtimes ignore them, so it is safe to apply
+// without knowing the device type yet. Variables already set by the user are
+// left alone.
+inline void applyRuntimeThreadCap(ThreadConfig &config, ThreadingMode mode) {
+  config.mode = mode;
+  switch (mode) {
+  case ThreadingMode::Independent:
+    config.runtimeThreads = 0;
+    return;
+  case ThreadingMode::SharedQueue:
+    config.runtimeThreads = config.usableCpus;
+    break;
+  }
+  std::string value = std::to_string(config.runtimeThreads);
+  // pocl (older and newer spellings) and the Intel CPU runtime
+  setenv("POCL_MAX_PTHREAD_COUNT", value.c_str(), 0);
+  setenv("POCL_CPU_MAX_CU_COUNT", value.c_str(), 0);
+  setenv("CL_CONFIG_CPU_TBB_NUM_WORKERS", value.c_str(), 0);
+}
+
+} // namespace thread_config
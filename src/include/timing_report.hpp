@@ -0,0 +1,305 @@
+#pragma once
+
+// Per-stage wall-clock timing for the processing pipeline.
+// Each worker thread records into its own slot, so recording never takes a
+// lock; the slots are merged once when the report is printed. With
+// enableCounters() every stage also accumulates hardware counters for the
+// thread that ran it.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "perf_counters.hpp"
+
+enum class Stage {
+  ArchiveRead,
+  Decode,
+  Import,
+  Normalize,
+  Clip,
+  Median,
+  Sharpen,
+  RegionGrowing,
+  PostProcess,
+  Export,
+  Count
+};
+
+inline const char *stageName(Stage stage) {
+  switch (stage) {
+  case Stage::ArchiveRead:
+    return "archive_read";
+  case Stage::Decode:
+    return "decode";
+  case Stage::Import:
+    return "import";
+  case Stage::Normalize:
+    return "normalize";
+  case Stage::Clip:
+    return "clip";
+  case Stage::Median:
+    return "median";
+  case Stage::Sharpen:
+    return "sharpen";
+  case Stage::RegionGrowing:
+    return "region_growing";
+  case Stage::PostProcess:
+    return "postprocess";
+  case Stage::Export:
+    return "export";
+  default:
+    return "unknown";
+  }
+}
+
+constexpr size_t STAGE_COUNT = static_cast<size_t>(Stage::Count);
+
+class TimingReport {
+private:
+  // Samples in milliseconds, one vector per stage, one slot per thread.
+  // alignas keeps neighbouring slots off the same cache line.
+  struct alignas(64) ThreadSlot {
+    std::array<std::vector<double>, STAGE_COUNT> samples;
+    // End-to-end latency of each slice, retries included
+    std::vector<double> sliceSamples;
+    // Counter totals per stage, and the pixels of the slices this thread ran
+    std::array<CounterValues, STAGE_COUNT> counters;
+    uint64_t pixels = 0;
+    PerfEventGroup group;
+  };
+
+  std::vector<ThreadSlot> slots;
+  std::chrono::steady_clock::time_point runStart;
+  double wallSeconds = 0.0;
+  size_t slices = 0;
+  size_t stragglers = 0;
+  bool countersEnabled = false;
+  // Time from a job being queued at its priority until its last slice is
+  // exported, in seconds; recorded by the dispatching thread only
+  std::vector<double> urgentJobLatencies;
+  std::vector<double> bulkJobLatencies;
+
+  static double percentile(std::vector<double> values, double p) {
+    if (values.empty()) {
+      return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    return values[std::min(index, values.size() - 1)];
+  }
+
+public:
+  explicit TimingReport(int threads = 1)
+      : slots(static_cast<size_t>(std::max(1, threads))) {}
+
+  void startRun() { runStart = std::chrono::steady_clock::now(); }
+
+  void finishRun(size_t processedSlices) {
+    wallSeconds = std::chrono::duration<double>(
+                      std::chrono::steady_clock::now() - runStart)
+                      .count();
+    slices = processedSlices;
+  }
+
+  void record(int thread, Stage stage, double milliseconds) {
+    slots[static_cast<size_t>(thread) % slots.size()]
+        .samples[static_cast<size_t>(stage)]
+        .push_back(milliseconds);
+  }
+
+  void recordSlice(int thread, double milliseconds) {
+    slots[static_cast<size_t>(thread) % slots.size()].sliceSamples.push_back(
+        milliseconds);
+  }
+
+  void setStragglers(size_t count) { stragglers = count; }
+
+  // Turns on hardware counters. Returns false (and leaves them off) if the
+  // calling thread cannot open them, in which case no other thread can.
+  bool enableCounters() {
+    countersEnabled = slots[0].group.openForThisThread();
+    return countersEnabled;
+  }
+
+  bool hasCounters() const { return countersEnabled; }
+
+  // Current counter totals of the calling thread, opening its group on first
+  // use. Zero when counters are off.
+  CounterValues readCounters(int thread) {
+    if (!countersEnabled) {
+      return {};
+    }
+    PerfEventGroup &group =
+        slots[static_cast<size_t>(thread) % slots.size()].group;
+    group.openForThisThread();
+    return group.read();
+  }
+
+  void recordCounters(int thread, Stage stage, const CounterValues &delta) {
+    slots[static_cast<size_t>(thread) % slots.size()]
+        .counters[static_cast<size_t>(stage)] += delta;
+  }
+
+  void recordPixels(int thread, uint64_t pixels) {
+    slots[static_cast<size_t>(thread) % slots.size()].pixels += pixels;
+  }
+
+  void recordJobLatency(bool urgent, double seconds) {
+    (urgent ? urgentJobLatencies : bulkJobLatencies).push_back(seconds);
+  }
+
+  std::vector<double> sliceLatencies() const {
+    std::vector<double> merged;
+    for (const auto &slot : slots) {
+      merged.insert(merged.end(), slot.sliceSamples.begin(),
+                    slot.sliceSamples.end());
+    }
+    return merged;
+  }
+
+  std::vector<double> samples(Stage stage) const {
+    std::vector<double> merged;
+    for (const auto &slot : slots) {
+      const auto &s = slot.samples[static_cast<size_t>(stage)];
+      merged.insert(merged.end(), s.begin(), s.end());
+    }
+    return merged;
+  }
+
+  double median(Stage stage) const { return percentile(samples(stage), 0.5); }
+
+  double wallTime() const { return wallSeconds; }
+
+  // IPC and misses per pixel for each stage across all threads, then the
+  // same per thread across all stages. Only user-space work of the worker
+  // threads is counted; OpenCL CPU devices run kernels on their own threads.
+  void printCounters(std::ostream &os) const {
+    auto ratio = [](uint64_t a, uint64_t b) {
+      return b > 0 ? static_cast<double>(a) / b : 0.0;
+    };
+    auto row = [&](const std::string &label, const CounterValues &c,
+                   uint64_t pixels) {
+      os << std::left << std::setw(16) << label << std::right << std::setw(14)
+         << c[Counter::Cycles] / 1000000 << std::setw(14)
+         << c[Counter::Instructions] / 1000000 << std::setw(8)
+         << ratio(c[Counter::Instructions], c[Counter::Cycles]);
+      for (Counter counter : {Counter::LLCMisses, Counter::BranchMisses}) {
+        os << std::setw(14);
+        if (c.has(counter)) {
+          os << ratio(c[counter], pixels);
+        } else {
+          os << "n/a";
+        }
+      }
+      os << "\n";
+    };
+
+    uint64_t totalPixels = 0;
+    for (const auto &slot : slots) {
+      totalPixels += slot.pixels;
+    }
+    os << "Hardware counters (user space):\n";
+    os << std::left << std::setw(16) << "stage" << std::right << std::setw(14)
+       << "Mcycles" << std::setw(14) << "Minstr" << std::setw(8) << "IPC"
+       << std::setw(14) << "LLC miss/px" << std::setw(14) << "br miss/px"
+       << "\n";
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+      CounterValues total;
+      for (const auto &slot : slots) {
+        total += slot.counters[i];
+      }
+      if (total[Counter::Cycles] > 0) {
+        row(stageName(static_cast<Stage>(i)), total, totalPixels);
+      }
+    }
+    for (size_t t = 0; t < slots.size(); ++t) {
+      CounterValues total;
+      for (const auto &stage : slots[t].counters) {
+        total += stage;
+      }
+      if (total[Counter::Cycles] > 0) {
+        row("thread " + std::to_string(t), total, slots[t].pixels);
+      }
+    }
+  }
+
+  void print(const std::string &title, std::ostream &os = std::cout) const {
+    os << "\n=== Timing Report: " << title << " ===\n";
+    os << std::left << std::setw(16) << "stage" << std::right << std::setw(8)
+       << "count" << std::setw(12) << "total s" << std::setw(12) << "mean ms"
+       << std::setw(12) << "median ms" << std::setw(12) << "p99 ms" << "\n";
+    os << std::fixed << std::setprecision(2);
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+      Stage stage = static_cast<Stage>(i);
+      std::vector<double> values = samples(stage);
+      if (values.empty()) {
+        continue;
+      }
+      double total = 0.0;
+      for (double v : values) {
+        total += v;
+      }
+      os << std::left << std::setw(16) << stageName(stage) << std::right
+         << std::setw(8) << values.size() << std::setw(12) << total / 1000.0
+         << std::setw(12) << total / values.size() << std::setw(12)
+         << percentile(values, 0.5) << std::setw(12)
+         << percentile(values, 0.99) << "\n";
+    }
+    std::vector<double> latencies = sliceLatencies();
+    if (!latencies.empty()) {
+      os << "Slice latency: p50 " << percentile(latencies, 0.5) << " ms, p99 "
+         << percentile(latencies, 0.99) << " ms, max "
+         << percentile(latencies, 1.0) << " ms, " << stragglers
+         << " straggler(s)\n";
+    }
+    if (!urgentJobLatencies.empty()) {
+      os << "Urgent job latency: " << urgentJobLatencies.size()
+         << " job(s), p50 " << percentile(urgentJobLatencies, 0.5)
+         << " s, max " << percentile(urgentJobLatencies, 1.0) << " s\n";
+    }
+    if (!bulkJobLatencies.empty()) {
+      os << "Bulk job latency: " << bulkJobLatencies.size()
+         << " job(s), p50 " << percentile(bulkJobLatencies, 0.5)
+         << " s, max " << percentile(bulkJobLatencies, 1.0) << " s\n";
+    }
+    if (countersEnabled) {
+      printCounters(os);
+    }
+    os << "Wall time: " << wallSeconds << " s, " << slices << " slices, "
+       << (wallSeconds > 0 ? slices / wallSeconds : 0.0) << " slices/s"
+       << std::defaultfloat << std::endl;
+  }
+};
+
+// Records the lifetime of a scope as one sample of the given stage, plus
+// the counter deltas when counters are enabled.
+class ScopedStageTimer {
+private:
+  TimingReport &report;
+  int thread;
+  Stage stage;
+  CounterValues startCounters;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  ScopedStageTimer(TimingReport &report, int thread, Stage stage)
+      : report(report), thread(thread), stage(stage),
+        startCounters(report.readCounters(thread)),
+        start(std::chrono::steady_clock::now()) {}
+
+  ~ScopedStageTimer() {
+    report.record(thread, stage,
+                  std::chrono::duration<double, std::milli>(
+                      std::chrono::steady_clock::now() - start)
+                      .count());
+    if (report.hasCounters()) {
+      report.recordCounters(thread, stage,
+                            report.readCounters(thread) - startCounters);
+    }
+  }
+};
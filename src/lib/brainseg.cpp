@@ -0,0 +1,260 @@
+#include "brainseg.hpp"
+
+#include "FAST/FAST_directives.hpp"
+#include "dicom_decoder.hpp"
+#include "segmentation_pipeline.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+
+using namespace fast;
+namespace fs = std::filesystem;
+
+namespace brainseg {
+
+namespace {
+
+constexpr const char *VERSION = "0.1.0";
+
+DataType toDataType(PixelType type) {
+  switch (type) {
+  case PixelType::UInt8:
+    return TYPE_UINT8;
+  case PixelType::Int16:
+    return TYPE_INT16;
+  case PixelType::UInt16:
+    return TYPE_UINT16;
+  case PixelType::Float32:
+    return TYPE_FLOAT;
+  }
+  throw Error("Unknown pixel type");
+}
+
+size_t bytesPerPixel(PixelType type) {
+  switch (type) {
+  case PixelType::UInt8:
+    return 1;
+  case PixelType::Int16:
+  case PixelType::UInt16:
+    return 2;
+  case PixelType::Float32:
+    return 4;
+  }
+  throw Error("Unknown pixel type");
+}
+
+// Same ordering as the batch processor: by the number after the last '-'
+// in "1-14.dcm", then by name
+int sliceNumber(const std::string &filename) {
+  size_t dash = filename.find_last_of('-');
+  size_t dot = filename.find(".dcm");
+  if (dash == std::string::npos || dot == std::string::npos || dot < dash) {
+    return 1000;
+  }
+  try {
+    return std::stoi(filename.substr(dash + 1, dot - dash - 1));
+  } catch (...) {
+    return 1000;
+  }
+}
+
+std::vector<std::string> seriesFiles(const std::string &directory) {
+  std::vector<std::pair<int, std::string>> files;
+  for (const auto &entry : fs::directory_iterator(directory)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".dcm") {
+      files.push_back({sliceNumber(entry.path().filename().string()),
+                       entry.path().string()});
+    }
+  }
+  std::sort(files.begin(), files.end());
+  std::vector<std::string> paths;
+  for (auto &file : files) {
+    paths.push_back(std::move(file.second));
+  }
+  return paths;
+}
+
+// Runs f, turning FAST and standard exceptions into brainseg::Error so
+// callers never see FAST types
+template <typename F> auto guarded(const std::string &what, F &&f) {
+  try {
+    return f();
+  } catch (const Error &) {
+    throw;
+  } catch (const std::exception &e) {
+    throw Error(what + ": " + e.what());
+  }
+}
+
+} // namespace
+
+struct Context::Impl {
+  PipelineParams params;
+  // Packs strided input rows; reused across calls
+  std::vector<uint8_t> scratch;
+
+  Image::pointer wrap(const ImageView &input) {
+    if (!input.data || input.width <= 0 || input.height <= 0) {
+      throw Error("Empty input image");
+    }
+    size_t rowBytes = static_cast<size_t>(input.width) *
+                      bytesPerPixel(input.type);
+    const void *pixels = input.data;
+    if (input.rowStride != 0 && input.rowStride != rowBytes) {
+      if (input.rowStride < rowBytes) {
+        throw Error("Input row stride is smaller than a row");
+      }
+      scratch.resize(rowBytes * input.height);
+      for (int y = 0; y < input.height; ++y) {
+        std::memcpy(scratch.data() + y * rowBytes,
+                    static_cast<const uint8_t *>(input.data) +
+                        y * input.rowStride,
+                    rowBytes);
+      }
+      pixels = scratch.data();
+    }
+    auto image = Image::create(input.width, input.height,
+                               toDataType(input.type), 1, pixels);
+    image->setSpacing(Vector3f(input.spacingX, input.spacingY, 1.0f));
+    return image;
+  }
+
+  static Image::pointer load(const std::string &path) {
+    if (dicom::canDecode(dicom::readTransferSyntax(path))) {
+      try {
+        return imageFromDecoded(dicom::decode(dicom::readFile(path)));
+      } catch (const std::exception &) {
+        // Fall through to the importer, which handles everything else
+      }
+    }
+    auto importer = DICOMFileImporter::create(path);
+    importer->setLoadSeries(false);
+    importer->update();
+    auto image = importer->getOutputData<Image>(0);
+    if (!image) {
+      throw Error("Failed to import " + path);
+    }
+    return image;
+  }
+
+  SliceResult run(Image::pointer image, const MaskBuffer &output,
+                  const std::string &source) {
+    auto start = std::chrono::steady_clock::now();
+    SliceResult result;
+    result.source = source;
+    result.width = image->getWidth();
+    result.height = image->getHeight();
+    if (!output.data || output.width != result.width ||
+        output.height != result.height) {
+      throw Error("Output buffer is " + std::to_string(output.width) + "x" +
+                  std::to_string(output.height) + ", image is " +
+                  std::to_string(result.width) + "x" +
+                  std::to_string(result.height));
+    }
+    size_t stride =
+        output.rowStride ? output.rowStride : static_cast<size_t>(output.width);
+    if (stride < static_cast<size_t>(output.width)) {
+      throw Error("Output row stride is smaller than a row");
+    }
+
+    PipelineStages stages = runReferencePipeline(image, params);
+    if (stages.mask->getDataType() != TYPE_UINT8) {
+      throw Error("Unexpected mask data type");
+    }
+    auto access = stages.mask->getImageAccess(ACCESS_READ);
+    const uint8_t *mask = static_cast<const uint8_t *>(access->get());
+    for (int y = 0; y < result.height; ++y) {
+      const uint8_t *in = mask + static_cast<size_t>(y) * result.width;
+      uint8_t *out = output.data + y * stride;
+      for (int x = 0; x < result.width; ++x) {
+        out[x] = in[x] != 0;
+        result.foregroundPixels += out[x];
+      }
+    }
+
+    result.milliseconds = std::chrono::duration<double, std::milli>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+    return result;
+  }
+
+  Mask runOwned(Image::pointer image, const std::string &source) {
+    Mask mask;
+    mask.pixels.resize(static_cast<size_t>(image->getWidth()) *
+                       image->getHeight());
+    MaskBuffer buffer;
+    buffer.data = mask.pixels.data();
+    buffer.width = image->getWidth();
+    buffer.height = image->getHeight();
+    mask.result = run(image, buffer, source);
+    return mask;
+  }
+};
+
+Context::Context(const PipelineParams &params)
+    : impl(std::make_unique<Impl>()) {
+  impl->params = params;
+}
+
+Context::~Context() = default;
+Context::Context(Context &&) noexcept = default;
+Context &Context::operator=(Context &&) noexcept = default;
+
+const PipelineParams &Context::getParams() const { return impl->params; }
+
+void Context::setParams(const PipelineParams &params) {
+  impl->params = params;
+}
+
+SliceResult Context::segment(const ImageView &input,
+                             const MaskBuffer &output) {
+  return guarded("segment", [&] {
+    return impl->run(impl->wrap(input), output, "");
+  });
+}
+
+Mask Context::segment(const ImageView &input) {
+  return guarded("segment",
+                 [&] { return impl->runOwned(impl->wrap(input), ""); });
+}
+
+SliceResult Context::segmentFile(const std::string &path,
+                                 const MaskBuffer &output) {
+  return guarded(path,
+                 [&] { return impl->run(Impl::load(path), output, path); });
+}
+
+Mask Context::segmentFile(const std::string &path) {
+  return guarded(path, [&] { return impl->runOwned(Impl::load(path), path); });
+}
+
+std::vector<SliceResult> Context::segmentSeries(const std::string &directory,
+                                                const MaskAllocator &allocate) {
+  return guarded(directory, [&] {
+    std::vector<SliceResult> results;
+    std::vector<std::string> files = seriesFiles(directory);
+    for (size_t i = 0; i < files.size(); ++i) {
+      Image::pointer image = Impl::load(files[i]);
+      MaskBuffer output =
+          allocate(i, files[i], image->getWidth(), image->getHeight());
+      results.push_back(impl->run(image, output, files[i]));
+    }
+    return results;
+  });
+}
+
+std::vector<Mask> Context::segmentSeries(const std::string &directory) {
+  return guarded(directory, [&] {
+    std::vector<Mask> masks;
+    for (const auto &file : seriesFiles(directory)) {
+      masks.push_back(impl->runOwned(Impl::load(file), file));
+    }
+    return masks;
+  });
+}
+
+const char *version() { return VERSION; }
+
+} // namespace brainseg
@@ -1,9 +1,28 @@
 #include "FAST/FAST_directives.hpp"
+#include "archive_source.hpp"
+#include "dicom_decoder.hpp"
+#include "job_scheduler.hpp"
+#include "memory_budget.hpp"
+#include "montage.hpp"
+#include "pipeline_params.hpp"
+#include "progress_reporter.hpp"
+#include "run_journal.hpp"
+#include "segmentation_pipeline.hpp"
+#include "slice_watchdog.hpp"
+#include "thread_config.hpp"
+#include "timing_report.hpp"
 #include <atomic>
+#include <chrono>
+#include <cmath>
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <mutex>
 #include <omp.h>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
 using namespace fast;
@@ -12,26 +31,243 @@ namespace fs = std::filesystem;
 // Structure to hold processed image data
 struct ProcessedImageData {
   std::string filename;
+  std::string outputPath;
+  size_t job = 0;
+  // Position of the slice in its job
+  size_t slice = 0;
   std::shared_ptr<Image> originalImage;
   std::shared_ptr<Image> processedImage;
+  // The mask in run-length form instead of processedImage (--rle-masks)
+  std::shared_ptr<rle::RleMask> rleMask;
+  // Set when the watchdog stopped the slice before it finished
+  bool cancelled = false;
+  // Journal hash of the parameters the mask was made with: a straggler
+  // retry records the cheaper set's, so --resume redoes it at full quality
+  std::string paramHash;
+  // Bytes the memory budget counts for this result until it is exported
+  size_t heldBytes = 0;
+  // Set by exportBatch once both images are on disk, or the slice is drawn
+  // into its patient's montage
+  bool exported = false;
+
+  bool hasMask() const { return processedImage || rleMask; }
+};
+
+// Run-time options for the parallel processor, filled in from the command line
+struct ProcessorOptions {
+  // Seconds between progress reports, 0 disables them
+  double progressInterval = 5.0;
+  // Rolling JSON status file, empty means <output>/status.json
+  std::string statusFile;
+  // Seconds a single slice may run before it is flagged, 0 disables the
+  // watchdog
+  double sliceDeadline = 60.0;
+  StragglerPolicy stragglerPolicy = StragglerPolicy::Flag;
+  // Keep existing output and skip slices already recorded in the journal
+  bool resume = false;
+  // Patients dispatched ahead of the backlog from the start of the run
+  std::vector<std::string> urgentPatients;
+  // File polled during the run; each line is a patient ID, optionally
+  // followed by a priority (default URGENT_PRIORITY)
+  std::string urgentFile;
+  // Collect hardware counters per stage (perf_event_open)
+  bool perfCounters = false;
+  // Stage parameters; lower levels trade mask fidelity for throughput
+  Quality quality = Quality::Full;
+  // Sharpen on the CPU with the separable unsharp mask instead of
+  // ImageSharpening
+  bool nativeSharpen = false;
+  // Normalize and clip in one native pass instead of the two FAST filters
+  bool nativePreprocess = false;
+  // Normalize between these percentiles of each slice's histogram rather
+  // than the fixed intensity range (implies nativePreprocess)
+  bool percentileNormalize = false;
+  float normalizeLowPercentile = 1.0f;
+  float normalizeHighPercentile = 99.0f;
+  // Dilate on the CPU via distance transforms instead of FAST's Dilation
+  bool nativeMorphology = false;
+  // Overrides the dilation size of the quality level when positive
+  int dilationSize = 0;
+  // Disk instead of square structuring element (implies nativeMorphology)
+  bool diskDilation = false;
+  // Keep masks run-length encoded after region growing, post-process them
+  // on their runs and export them as .rle next to the JPEGs
+  bool rleMasks = false;
+  // Draw every slice into one montage per patient, encoded once with an
+  // index of the crops, instead of two JPEGs per slice. Slices reach the
+  // journal when the montage is written, so --resume redoes whole patients.
+  bool montageExport = false;
+  int montageTileSize = montage::DEFAULT_TILE_SIZE;
+  // Grow each slice from seeds propagated from the previous slice's mask
+  // (seed_propagation.hpp); the slices of a series then run in order, with
+  // series pipelined side by side
+  bool propagateSeeds = false;
+  int propagationErosion = propagation::DEFAULT_EROSION_RADIUS;
+  int propagationMargin = propagation::DEFAULT_MARGIN;
+  // Bytes in-flight slices and pooled buffers may hold before admission of
+  // new slices is throttled; 0 only tracks the peak
+  size_t memoryBudget = 0;
+};
+
+// Bytes per pixel of a slice while it is processed: the 16-bit original,
+// four float intermediates (normalized, clipped, median, sharpened) and
+// three byte masks, each on the host and on the OpenCL device
+constexpr size_t WORKING_BYTES_PER_PIXEL = 2 * (2 + 4 * 4 + 3);
+// Admission estimate for a job whose first slice header could not be read
+constexpr size_t FALLBACK_SLICE_PIXELS = 512 * 512;
+
+// What a journal entry is recorded under: the parameter hash, plus the
+// export mode when it is not the per-slice JPEGs, so a slice exported one
+// way is not taken as done by a run exporting the other way
+inline std::string journalKey(const PipelineParams &params,
+                              const ProcessorOptions &options) {
+  std::string key = params.hash();
+  if (options.montageExport) {
+    key += "-montage" + std::to_string(options.montageTileSize);
+  }
+  return key;
+}
+
+// A malformed command-line argument; reported on its own rather than as a
+// fatal error of the run
+class ArgumentError : public std::invalid_argument {
+public:
+  using std::invalid_argument::invalid_argument;
+};
+
+// Parses an integer option value as a whole, so a bad one is reported
+// against its option rather than as a bare std::stoi failure
+inline int parseIntArgument(const std::string &option,
+                            const std::string &text) {
+  size_t end = 0;
+  int value = 0;
+  try {
+    value = std::stoi(text, &end);
+  } catch (const std::exception &) {
+    end = 0;
+  }
+  if (end == 0 || end != text.size()) {
+    throw ArgumentError(option + " expects an integer, got \"" + text +
+                        "\"");
+  }
+  return value;
+}
+
+// parseIntArgument for a finite decimal number
+inline double parseDoubleArgument(const std::string &option,
+                                  const std::string &text) {
+  size_t end = 0;
+  double value = 0;
+  try {
+    value = std::stod(text, &end);
+  } catch (const std::exception &) {
+    end = 0;
+  }
+  if (end == 0 || end != text.size() || !std::isfinite(value)) {
+    throw ArgumentError(option + " expects a number, got \"" + text + "\"");
+  }
+  return value;
+}
+
+// Applies the options that override stage parameters
+inline PipelineParams withOptions(PipelineParams params,
+                                  const ProcessorOptions &options) {
+  if (options.percentileNormalize) {
+    params.percentileNormalize = true;
+    params.normalizeLowPercentile = options.normalizeLowPercentile;
+    params.normalizeHighPercentile = options.normalizeHighPercentile;
+  }
+  if (options.dilationSize > 0) {
+    params.dilationSize = options.dilationSize;
+  }
+  params.diskDilation = params.diskDilation || options.diskDilation;
+  return params;
+}
+
+// One patient's series, scheduled slice by slice
+struct PatientJob {
+  std::string patientID;
+  std::string outputPath;
+  // Slice file paths, or member names when the study is an archive
+  std::vector<std::string> files;
+  // Set for archived studies; archiveMembers parallels files
+  std::shared_ptr<ArchiveSource> archive;
+  std::vector<ArchiveSource::Member> archiveMembers;
+  int priority = BULK_PRIORITY;
+  // When the job was queued at its current priority; job latency is
+  // measured from here to the export of its last slice
+  std::chrono::steady_clock::time_point queuedAt;
+  size_t remaining = 0;
+  size_t successCount = 0;
+  // Rows x Columns from the header of the first slice, which the series'
+  // other slices share; what admission estimates each slice from
+  size_t slicePixels = FALLBACK_SLICE_PIXELS;
+  // The first slice's transfer syntax is one dicom::decode handles. Only
+  // then are slices read and decoded natively (one that turns out not to
+  // be decodable still falls back to the importer); otherwise they go to
+  // the importer without being opened first.
+  bool nativeDecode = false;
+  // Filled as slices are exported with options.montageExport
+  std::shared_ptr<montage::Montage> montage;
+  // Slice name and parameter hash of every slice drawn into the montage,
+  // journaled once the montage is written
+  std::vector<std::pair<std::string, std::string>> montageSlices;
 };
 
 class OptimizedParallelProcessor {
 private:
-  std::vector<std::string> dicomFiles;
   std::string baseDataPath;
-  std::string patientPath;
   std::string outputBasePath;
-  std::string currentOutputPath;
   std::mutex outputMutex;
   std::shared_ptr<RenderToImage> renderToImage;
-  std::atomic<size_t> completedImages{0};
+  ProgressCounters progress;
+  ProcessorOptions options;
+  std::unique_ptr<ProgressReporter> progressReporter;
+  std::unique_ptr<SliceWatchdog> watchdog;
+  std::unique_ptr<RunJournal> journal;
+  // Stage parameters for the selected quality level
+  PipelineParams params;
+  // Journal entries only count as done for the same parameter set and
+  // export mode (journalKey)
+  std::string paramHash;
+  // Cheaper parameters for straggler retries, derived from the same level
+  PipelineParams retryParams;
+  std::string retryParamHash;
+  size_t successfulImages = 0;
+  TimingReport timing;
+  ThreadingMode threadingMode = ThreadingMode::Independent;
+  // Threads each worker may use inside one slice: native decode, histogram,
+  // morphology and region growing on large slices
+  int decodeThreads = 1;
+  // One native sharpener per worker when options.nativeSharpen is set
+  std::vector<std::unique_ptr<unsharp::UnsharpMask>> sharpeners;
+  // Held around each FAST filter update in SharedQueue mode
+  std::mutex deviceMutex;
+  // Guards job priorities while the urgent file is applied
+  std::mutex urgentMutex;
+  fs::file_time_type urgentFileTime;
+  std::atomic<long> nextUrgentPoll{0};
+  // Masks kept in RLE form, their bytes, and the bytes as dense UINT8
+  std::atomic<size_t> rleMaskCount{0};
+  std::atomic<size_t> rleMaskBytes{0};
+  std::atomic<size_t> denseMaskBytes{0};
+  // Seeds for the next slice of each job, with options.propagateSeeds
+  std::vector<std::shared_ptr<const propagation::Propagation>> propagated;
+  // Slices grown from propagated seeds, their seeds, and slices that fell
+  // back to the fixed seeds
+  std::atomic<size_t> propagatedSlices{0};
+  std::atomic<size_t> propagatedSeeds{0};
+  std::atomic<size_t> independentSlices{0};
+  // Admission control over the bytes held by slices and pooled buffers
+  MemoryBudget memory;
 
+public:
   // Corresponds to the batches that are divided into worker threads
   // Patient datasets range between 21-25 .dcm files, so just set to largest
   // possible num of dcm files in a patient directory
   static const size_t DEFAULT_BATCH_SIZE = 25;
 
+private:
   int extractFileNumber(const std::string &filename) {
     size_t dashPos = filename.find_last_of('-');
     size_t dotPos = filename.find(".dcm");
@@ -46,24 +282,64 @@ private:
     return 1000;
   }
 
-  void setupOutputDirectory(const std::string &patientID) {
+  std::string setupOutputDirectory(const std::string &patientID) {
     try {
-      currentOutputPath = outputBasePath + "/" + patientID;
-      if (system(("mkdir -p " + currentOutputPath + " && cd " +
-                  currentOutputPath + " && rm -rf *")
-                     .c_str()) != 0) {
+      std::string outputPath = outputBasePath + "/" + patientID;
+      // When resuming, earlier output belongs to slices we are skipping
+      std::string command = options.resume
+                                ? "mkdir -p " + outputPath
+                                : "mkdir -p " + outputPath + " && cd " +
+                                      outputPath + " && rm -rf *";
+      if (system(command.c_str()) != 0) {
         throw std::runtime_error("Failed to setup output directory: " +
-                                 currentOutputPath);
+                                 outputPath);
       }
-      std::cout << "Created output directory: " + currentOutputPath
-                << std::endl;
+      std::cout << "Created output directory: " + outputPath << std::endl;
+      return outputPath;
     } catch (const std::exception &e) {
       throw std::runtime_error("Error setting up output directory: " +
                                std::string(e.what()));
     }
   }
 
-  ProcessedImageData processSingleImage(const std::string &filename) {
+  // Slices of a series whose syntax we can decode natively are read once
+  // and decoded here (JPEG 2000 with up to decodeThreads threads within the
+  // slice); everything else goes straight to FAST's importer, which opens
+  // the file itself
+  Image::pointer loadSlice(const std::string &filename,
+                           const std::string &importPath, bool nativeDecode,
+                           int thread) {
+    if (nativeDecode) {
+      try {
+        ScopedStageTimer timer(timing, thread, Stage::Decode);
+        return imageFromDecoded(
+            dicom::decode(dicom::readFile(importPath), decodeThreads));
+      } catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cerr << "Native decode of " << filename << " failed ("
+                  << e.what() << "), using importer" << std::endl;
+      }
+    }
+
+    auto importer = DICOMFileImporter::create(importPath);
+    importer->setLoadSeries(false);
+    {
+      ScopedStageTimer timer(timing, thread, Stage::Import);
+      importer->update();
+    }
+    return importer->getOutputData<Image>(0);
+  }
+
+  // importPath is what the importer opens; it differs from filename when the
+  // slice comes from an archive and lives in an in-memory file. nativeDecode
+  // is the job's PatientJob::nativeDecode.
+  // Regions grow from seedsFrom when it holds seeds, from seedPoints
+  // otherwise
+  ProcessedImageData
+  processSingleImage(const std::string &filename,
+                     const std::string &importPath, bool nativeDecode,
+                     const PipelineParams &params,
+                     const propagation::Propagation *seedsFrom = nullptr) {
     ProcessedImageData result;
     result.filename = filename;
 
@@ -73,16 +349,15 @@ private:
                 << "\"" << std::endl;
     }
 
+    int thread = omp_get_thread_num();
+
     try {
       // Import Stage
-      auto importer = DICOMFileImporter::create(filename);
-      importer->setLoadSeries(false);
-      importer->update();
-
-      result.originalImage = importer->getOutputData<Image>(0);
+      Image::pointer importedImage =
+          loadSlice(filename, importPath, nativeDecode, thread);
+      result.originalImage = importedImage;
 
       // Get image dimensions to adjust seed points accordingly
-      auto importedImage = importer->getOutputData<Image>(0);
       if (!importedImage) {
         throw Exception("Failed to get imported image");
       }
@@ -96,70 +371,116 @@ private:
                         "x" + std::to_string(height));
       }
 
+      // In SharedQueue mode only one worker at a time runs FAST filters on
+      // the device; the native stages between them are not serialized
+      std::mutex *device = threadingMode == ThreadingMode::SharedQueue
+                               ? &deviceMutex
+                               : nullptr;
+
       // Preprocessing Stage
-      auto normalize =
-          IntensityNormalization::create(0.5f, 2.5f, 0.0f, 10000.0f);
-      normalize->connect(importer);
-      normalize->update();
+      watchdog->checkpoint(thread);
+      Image::pointer clipped;
+      if (options.nativePreprocess) {
+        // One fused pass, reported under the normalize stage
+        ScopedStageTimer timer(timing, thread, Stage::Normalize);
+        clipped = preprocessNative(importedImage, params, decodeThreads);
+      } else {
+        auto normalize = IntensityNormalization::create(
+            params.normalizeLowest, params.normalizeHighest,
+            params.normalizeMinIntensity, params.normalizeMaxIntensity);
+        normalize->connect(importedImage);
+        {
+          ScopedStageTimer timer(timing, thread, Stage::Normalize);
+          auto lock = lockDevice(device);
+          normalize->update();
+        }
 
-      auto clipping = IntensityClipping::create(0.68f, 4000.0f);
-      clipping->connect(normalize);
-      clipping->update();
+        watchdog->checkpoint(thread);
+        auto clipping =
+            IntensityClipping::create(params.clipMin, params.clipMax);
+        clipping->connect(normalize);
+        {
+          ScopedStageTimer timer(timing, thread, Stage::Clip);
+          auto lock = lockDevice(device);
+          clipping->update();
+        }
+        clipped = clipping->getOutputData<Image>(0);
+      }
 
-      auto medianfilter = VectorMedianFilter::create(7);
-      medianfilter->connect(clipping);
-      medianfilter->update();
+      watchdog->checkpoint(thread);
+      auto medianfilter = VectorMedianFilter::create(params.medianSize);
+      medianfilter->connect(clipped);
+      {
+        ScopedStageTimer timer(timing, thread, Stage::Median);
+        auto lock = lockDevice(device);
+        medianfilter->update();
+      }
 
-      auto sharpen = ImageSharpening::create(2.0f, 0.5f, 9);
-      sharpen->connect(medianfilter);
-      sharpen->update();
+      watchdog->checkpoint(thread);
+      Image::pointer sharpened;
+      if (options.nativeSharpen) {
+        unsharp::UnsharpMask &sharpener = *sharpeners[thread];
+        sharpener.configure(params.sharpenGain, params.sharpenStdDev,
+                            params.sharpenMaskSize);
+        size_t scratch = sharpener.bytes();
+        {
+          ScopedStageTimer timer(timing, thread, Stage::Sharpen);
+          sharpened =
+              sharpenNative(medianfilter->getOutputData<Image>(0), sharpener);
+        }
+        memory.addPooled(static_cast<int64_t>(sharpener.bytes()) -
+                         static_cast<int64_t>(scratch));
+      } else {
+        auto sharpen = ImageSharpening::create(
+            params.sharpenGain, params.sharpenStdDev, params.sharpenMaskSize);
+        sharpen->connect(medianfilter);
+        ScopedStageTimer timer(timing, thread, Stage::Sharpen);
+        auto lock = lockDevice(device);
+        sharpen->update();
+        sharpened = sharpen->getOutputData<Image>(0);
+      }
 
       // Segmentation Stage
-      // Calculate center and adjust seed points based on image dimensions
-      int centerX = width / 2;
-      int centerY = height / 2;
-
-      // Create seed points relative to center
-      std::vector<Vector3i> seedPoints;
-
-      // Add central seed point
-      seedPoints.push_back(Vector3i(centerX, centerY, 0));
-
-      // Add seed points around center
-      int offsetX = width / 8;
-      int offsetY = height / 8;
-
-      seedPoints.push_back(Vector3i(centerX + offsetX, centerY, 0));
-      seedPoints.push_back(Vector3i(centerX - offsetX, centerY, 0));
-      seedPoints.push_back(Vector3i(centerX, centerY + offsetY, 0));
-      seedPoints.push_back(Vector3i(centerX, centerY - offsetY, 0));
-
-      auto regionGrowing =
-          SeededRegionGrowing::create(0.74f, 0.91f, seedPoints);
-      regionGrowing->connect(sharpen);
-
-      // Add additional seed points in a grid pattern
-      for (int x = width / 4; x < width * 3 / 4; x += width / 10) {
-        for (int y = height / 4; y < height * 3 / 4; y += height / 10) {
-          {
-            regionGrowing->addSeedPoint(x, y);
-          }
+      // Last chance to cancel: region growing cannot be interrupted, and a
+      // slice that gets through it is finished rather than thrown away
+      watchdog->lastCheckpoint(thread);
+      // Centre seeds plus, with params.gridSeeds, the grid over the central
+      // half of the image, at params.regionScale of the resolution; or the
+      // previous slice's propagated seeds
+      Image::pointer regions;
+      {
+        ScopedStageTimer timer(timing, thread, Stage::RegionGrowing);
+        if (seedsFrom && !seedsFrom->empty()) {
+          regions = growRegionsPropagated(sharpened, params, *seedsFrom,
+                                          decodeThreads, device);
+        } else {
+          regions = growRegions(sharpened, params, decodeThreads, device);
         }
       }
 
-      regionGrowing->update();
-
       // Post-processing Stage
-      auto caster = ImageCaster::create(TYPE_UINT8);
-      caster->connect(regionGrowing);
-      caster->update();
-
-      auto dilation = Dilation::create(3);
-      dilation->connect(caster);
-      dilation->update();
-
-      result.processedImage = dilation->getOutputData<Image>(0);
+      {
+        ScopedStageTimer timer(timing, thread, Stage::PostProcess);
+        if (options.rleMasks) {
+          result.rleMask = std::make_shared<rle::RleMask>(
+              postProcessMaskRle(regions, width, height, params, device));
+          rleMaskCount++;
+          rleMaskBytes += result.rleMask->bytes();
+          denseMaskBytes += static_cast<size_t>(width) * height;
+        } else {
+          result.processedImage =
+              postProcessMask(regions, width, height, params,
+                              options.nativeMorphology, decodeThreads,
+                              device);
+        }
+      }
 
+    } catch (SliceCancelled &e) {
+      result.cancelled = true;
+      result.processedImage.reset();
+      result.rleMask.reset();
+      std::lock_guard<std::mutex> lock(outputMutex);
+      std::cerr << e.what() << std::endl;
     } catch (Exception &e) {
       std::lock_guard<std::mutex> lock(outputMutex);
       std::cerr << "Error processing file " << filename << ":\n"
@@ -169,17 +490,256 @@ private:
     return result;
   }
 
-  void exportBatch(const std::vector<ProcessedImageData> &batch) {
+  // Runs one slice under the watchdog. With the Retry policy a cancelled
+  // slice, which never reached region growing, gets one more attempt with
+  // the cheaper parameter set.
+  ProcessedImageData
+  processWithDeadline(const PatientJob &job, size_t slice,
+                      const propagation::Propagation *seedsFrom = nullptr) {
+    int thread = omp_get_thread_num();
+    auto start = std::chrono::steady_clock::now();
+    const std::string &filename = job.files[slice];
+
+    // Archived slices come from the study's shared decompression pass (which
+    // this worker may be driving) into a memfd; waiting for the pass counts
+    // as reading
+    std::unique_ptr<InMemoryFile> memoryFile;
+    std::string importPath = filename;
+    if (job.archive) {
+      try {
+        ScopedStageTimer timer(timing, thread, Stage::ArchiveRead);
+        memoryFile = std::make_unique<InMemoryFile>(
+            fs::path(filename).filename().string(),
+            job.archive->read(job.archiveMembers[slice]));
+        importPath = memoryFile->path();
+      } catch (const std::exception &e) {
+        {
+          std::lock_guard<std::mutex> lock(outputMutex);
+          std::cerr << "Error reading " << filename << " from "
+                    << job.archive->getPath() << ": " << e.what() << std::endl;
+        }
+        ProcessedImageData result;
+        result.filename = filename;
+        progress.sliceDone(0, false);
+        return result;
+      }
+    }
+
+    watchdog->begin(thread, filename);
+    ProcessedImageData result =
+        processSingleImage(filename, importPath, job.nativeDecode, params,
+                           seedsFrom);
+    watchdog->end(thread);
+    result.paramHash = paramHash;
+
+    if (result.cancelled && watchdog->getPolicy() == StragglerPolicy::Retry) {
+      {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cerr << "Retrying " << filename << " with cheaper parameters"
+                  << std::endl;
+      }
+      watchdog->begin(thread, filename);
+      result = processSingleImage(filename, importPath, job.nativeDecode,
+                                  retryParams, seedsFrom);
+      watchdog->end(thread);
+      result.paramHash = retryParamHash;
+    }
+
+    timing.recordSlice(thread, std::chrono::duration<double, std::milli>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count());
+    size_t pixels = result.originalImage
+                        ? static_cast<size_t>(result.originalImage->getWidth()) *
+                              result.originalImage->getHeight()
+                        : 0;
+    timing.recordPixels(thread, pixels);
+    progress.sliceDone(pixels, result.hasMask());
+    return result;
+  }
+
+  // What a finished slice keeps in memory until it is exported
+  static size_t retainedBytes(const ProcessedImageData &result) {
+    size_t bytes = 0;
+    if (result.originalImage) {
+      DataType type = result.originalImage->getDataType();
+      size_t pixelBytes = type == TYPE_UINT8 ? 1
+                          : type == TYPE_FLOAT ? 4
+                                               : 2;
+      bytes += static_cast<size_t>(result.originalImage->getWidth()) *
+               result.originalImage->getHeight() *
+               result.originalImage->getNrOfChannels() * pixelBytes;
+    }
+    if (result.processedImage) {
+      bytes += static_cast<size_t>(result.processedImage->getWidth()) *
+               result.processedImage->getHeight();
+    }
+    if (result.rleMask) {
+      bytes += result.rleMask->bytes();
+    }
+    return bytes;
+  }
+
+  // Seeds for the slice after this one; none when it has no mask
+  std::shared_ptr<const propagation::Propagation>
+  propagateFrom(const ProcessedImageData &result) {
+    if (!result.hasMask()) {
+      return nullptr;
+    }
+    try {
+      if (result.processedImage) {
+        return std::make_shared<propagation::Propagation>(propagationFromMask(
+            result.processedImage, options.propagationErosion,
+            options.propagationMargin));
+      }
+      std::vector<uint8_t> mask = result.rleMask->toDense();
+      return std::make_shared<propagation::Propagation>(propagation::fromMask(
+          mask.data(), result.rleMask->getWidth(),
+          result.rleMask->getHeight(), options.propagationErosion,
+          options.propagationMargin));
+    } catch (const std::exception &e) {
+      std::lock_guard<std::mutex> lock(outputMutex);
+      std::cerr << "No seeds propagated from " << result.filename << ": "
+                << e.what() << std::endl;
+      return nullptr;
+    }
+  }
+
+  // Draws a slice and its mask into cell imageData.slice of a montage
+  void drawSlice(montage::Montage &sheet, const ProcessedImageData &imageData) {
+    Image::pointer original = imageData.originalImage;
+    if (original->getNrOfChannels() != 1) {
+      throw Exception("Montage export needs single channel slices");
+    }
+    int width = original->getWidth();
+    int height = original->getHeight();
+    std::string name = fs::path(imageData.filename).stem().string();
+
+    std::vector<uint8_t> runs;
+    const uint8_t *mask = nullptr;
+    int maskWidth = width;
+    int maskHeight = height;
+    ImageAccess::pointer maskAccess;
+    if (imageData.processedImage) {
+      maskWidth = imageData.processedImage->getWidth();
+      maskHeight = imageData.processedImage->getHeight();
+      maskAccess = imageData.processedImage->getImageAccess(ACCESS_READ);
+      mask = static_cast<const uint8_t *>(maskAccess->get());
+    } else {
+      runs = imageData.rleMask->toDense();
+      maskWidth = imageData.rleMask->getWidth();
+      maskHeight = imageData.rleMask->getHeight();
+      mask = runs.data();
+    }
+
+    auto access = original->getImageAccess(ACCESS_READ);
+    const void *pixels = access->get();
+    switch (original->getDataType()) {
+    case TYPE_UINT8:
+      sheet.addSlice(imageData.slice, name,
+                     static_cast<const uint8_t *>(pixels), width, height,
+                     mask, maskWidth, maskHeight);
+      break;
+    case TYPE_UINT16:
+      sheet.addSlice(imageData.slice, name,
+                     static_cast<const uint16_t *>(pixels), width, height,
+                     mask, maskWidth, maskHeight);
+      break;
+    case TYPE_INT16:
+      sheet.addSlice(imageData.slice, name,
+                     static_cast<const int16_t *>(pixels), width, height,
+                     mask, maskWidth, maskHeight);
+      break;
+    case TYPE_FLOAT:
+      sheet.addSlice(imageData.slice, name,
+                     static_cast<const float *>(pixels), width, height, mask,
+                     maskWidth, maskHeight);
+      break;
+    default:
+      throw Exception("Unsupported pixel type for montage export");
+    }
+  }
+
+  // Montage export: no renders, each slice is drawn into its patient's
+  // montage on the CPU, several slices at once. The montage is encoded by
+  // writeMontage when the patient's last slice is in.
+  void exportToMontages(std::vector<ProcessedImageData> &batch,
+                        std::vector<PatientJob> &jobs) {
+    for (const auto &imageData : batch) {
+      PatientJob &job = jobs[imageData.job];
+      if (!job.montage) {
+        job.montage = std::make_shared<montage::Montage>(
+            job.files.size(), options.montageTileSize);
+        memory.addPooled(static_cast<int64_t>(job.montage->bytes()));
+      }
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < batch.size(); ++i) {
+      ProcessedImageData &imageData = batch[i];
+      if (!imageData.originalImage || !imageData.hasMask()) {
+        continue;
+      }
+      try {
+        ScopedStageTimer timer(timing, omp_get_thread_num(), Stage::Export);
+        drawSlice(*jobs[imageData.job].montage, imageData);
+        if (imageData.rleMask) {
+          imageData.rleMask->save(
+              imageData.outputPath + "/" +
+              fs::path(imageData.filename).stem().string() + "_mask.rle");
+        }
+        imageData.exported = true;
+      } catch (const std::exception &e) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        std::cerr << "Error drawing " << imageData.filename
+                  << " into the montage: " << e.what() << std::endl;
+      }
+    }
+  }
+
+  // Encodes a finished patient's montage once, writes its index and records
+  // the slices it holds in the journal
+  void writeMontage(PatientJob &job) {
+    if (!job.montage) {
+      return;
+    }
+    std::string base = job.outputPath + "/" + job.patientID + "_montage";
+    try {
+      ScopedStageTimer timer(timing, omp_get_thread_num(), Stage::Export);
+      auto image = Image::create(job.montage->getWidth(),
+                                 job.montage->getHeight(), TYPE_UINT8, 3,
+                                 job.montage->data());
+      auto exporter = ImageFileExporter::create(base + ".jpg");
+      exporter->connect(image);
+      exporter->update();
+      job.montage->writeIndex(base + ".tsv");
+      for (const auto &[slice, hash] : job.montageSlices) {
+        journal->markCompleted(job.patientID, slice, hash);
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Error writing montage " << base << ": " << e.what()
+                << std::endl;
+    }
+    memory.addPooled(-static_cast<int64_t>(job.montage->bytes()));
+    job.montage.reset();
+  }
+
+  void exportBatch(std::vector<ProcessedImageData> &batch,
+                   std::vector<PatientJob> &jobs) {
+    if (options.montageExport) {
+      exportToMontages(batch, jobs);
+      return;
+    }
     try {
       LabelColors labelColors;
       labelColors[1] = Color::White();
 
-      for (const auto &imageData : batch) {
-        if (!imageData.originalImage || !imageData.processedImage) {
+      for (auto &imageData : batch) {
+        if (!imageData.originalImage || !imageData.hasMask()) {
           continue;
         }
 
         std::string baseName = fs::path(imageData.filename).stem().string();
+        ScopedStageTimer timer(timing, omp_get_thread_num(), Stage::Export);
 
         // Export original
         {
@@ -189,8 +749,8 @@ private:
           renderToImage->connect(originalRenderer);
           renderToImage->update();
 
-          auto exporter = ImageFileExporter::create(currentOutputPath + "/" +
-                                                    baseName + "_original.jpg");
+          auto exporter = ImageFileExporter::create(
+              imageData.outputPath + "/" + baseName + "_original.jpg");
           exporter->connect(renderToImage->getOutputData<Image>(0));
           exporter->update();
         }
@@ -200,24 +760,63 @@ private:
           renderToImage->removeAllRenderers();
           auto processedRenderer =
               SegmentationRenderer::create(labelColors, 0.6f, 1.0f, 2);
-          processedRenderer->addInputData(imageData.processedImage);
+          processedRenderer->addInputData(
+              imageData.processedImage ? imageData.processedImage
+                                       : imageFromRle(*imageData.rleMask));
           renderToImage->connect(processedRenderer);
           renderToImage->update();
 
           auto exporter = ImageFileExporter::create(
-              currentOutputPath + "/" + baseName + "_processed.jpg");
+              imageData.outputPath + "/" + baseName + "_processed.jpg");
           exporter->connect(renderToImage->getOutputData<Image>(0));
           exporter->update();
         }
+
+        if (imageData.rleMask) {
+          imageData.rleMask->save(imageData.outputPath + "/" + baseName +
+                                  "_mask.rle");
+        }
+
+        imageData.exported = true;
       }
-    } catch (Exception &e) {
+    } catch (const std::exception &e) {
       std::cerr << "Error in export stage: " << e.what() << std::endl;
     }
   }
 
 public:
-  OptimizedParallelProcessor(const std::string &outputDir = "../out-parallel")
-      : outputBasePath(outputDir) {
+  // Sizes the per-thread timing slots and selects how device stages are
+  // shared between workers
+  void configureThreads(const ThreadConfig &config) {
+    timing = TimingReport(config.workerThreads);
+    threadingMode = config.mode;
+    if (options.perfCounters && !timing.enableCounters()) {
+      std::cerr << "Hardware counters unavailable: "
+                << PerfEventGroup::unavailableReason()
+                << "; reporting wall-clock times only" << std::endl;
+    }
+    // Physical cores left over once every worker has one go to intra-slice
+    // work
+    decodeThreads = config.sliceThreads();
+    sharpeners.clear();
+    if (options.nativeSharpen) {
+      for (int i = 0; i < config.workerThreads; ++i) {
+        sharpeners.push_back(std::make_unique<unsharp::UnsharpMask>(
+            params.sharpenGain, params.sharpenStdDev, params.sharpenMaskSize));
+      }
+    }
+  }
+
+  OptimizedParallelProcessor(const ProcessorOptions &options = {},
+                             const std::string &outputDir = "../out-parallel")
+      : outputBasePath(outputDir), options(options),
+        params(withOptions(PipelineParams::forQuality(options.quality),
+                           options)),
+        paramHash(journalKey(params, options)),
+        retryParams(withOptions(PipelineParams::cheap(options.quality),
+                                options)),
+        retryParamHash(journalKey(retryParams, options)),
+        memory(options.memoryBudget) {
     baseDataPath = Config::getTestDataPath() +
                    "Brain-Tumor-Progression/T1-Post-Combined-P001-P020/";
 
@@ -228,19 +827,38 @@ public:
     }
 
     renderToImage = RenderToImage::create(Color::Black(), 512, 512);
+
+    journal = std::make_unique<RunJournal>(outputBasePath + "/journal.tsv",
+                                           options.resume);
+    if (options.resume) {
+      std::cout << "Resuming run: " << journal->completedCount()
+                << " slice(s) recorded in " << outputBasePath << "/journal.tsv"
+                << std::endl;
+    }
+
+    watchdog = std::make_unique<SliceWatchdog>(
+        omp_get_max_threads(),
+        std::chrono::milliseconds(
+            static_cast<long>(options.sliceDeadline * 1000)),
+        options.stragglerPolicy);
   }
 
+  // Returns patient directory names and, when built with libarchive,
+  // archived patient studies (e.g. PGBM-001.tar.zst)
   std::vector<std::string> findAllPatientDirectories() {
     std::vector<std::string> patientDirs;
 
     try {
       for (const auto &entry : fs::directory_iterator(baseDataPath)) {
-        if (entry.is_directory()) {
-          std::string dirName = entry.path().filename().string();
-          // Check if it's a patient directory (starts with "PGBM-")
-          if (dirName.find("PGBM-") == 0) {
-            patientDirs.push_back(dirName);
-          }
+        std::string dirName = entry.path().filename().string();
+        // Check if it's a patient directory (starts with "PGBM-")
+        if (dirName.find("PGBM-") != 0) {
+          continue;
+        }
+        if (entry.is_directory() ||
+            (ArchiveSource::supported() && entry.is_regular_file() &&
+             ArchiveSource::isArchive(dirName))) {
+          patientDirs.push_back(dirName);
         }
       }
 
@@ -258,25 +876,30 @@ public:
     return patientDirs;
   }
 
-  void loadDICOMFilesForPatient(const std::string &patientID) {
-    try {
-      // First find all subdirectories in the patient folder
-      patientPath = baseDataPath + patientID + "/";
-      std::vector<std::string> seriesDirs;
+  std::string findSeriesDirectory(const std::string &patientID) {
+    // First find all subdirectories in the patient folder
+    std::string path = baseDataPath + patientID + "/";
+    std::vector<std::string> seriesDirs;
 
-      for (const auto &entry : fs::directory_iterator(patientPath)) {
-        if (entry.is_directory()) {
-          seriesDirs.push_back(entry.path().string() + "/");
-        }
+    for (const auto &entry : fs::directory_iterator(path)) {
+      if (entry.is_directory()) {
+        seriesDirs.push_back(entry.path().string() + "/");
       }
+    }
 
-      if (seriesDirs.empty()) {
-        throw std::runtime_error("No series directories found for patient: " +
-                                 patientID);
-      }
+    if (seriesDirs.empty()) {
+      throw std::runtime_error("No series directories found for patient: " +
+                               patientID);
+    }
+
+    // Use the first series directory found (usually there's only one)
+    return seriesDirs[0];
+  }
 
-      // Use the first series directory found (usually there's only one)
-      std::string seriesPath = seriesDirs[0];
+  std::vector<std::string>
+  loadDICOMFilesForPatient(const std::string &patientID) {
+    try {
+      std::string seriesPath = findSeriesDirectory(patientID);
       std::cout << "Using series directory: " << seriesPath << std::endl;
 
       std::vector<std::pair<std::string, int>> fileNumberPairs;
@@ -293,13 +916,14 @@ public:
           fileNumberPairs.begin(), fileNumberPairs.end(),
           [](const auto &a, const auto &b) { return a.second < b.second; });
 
-      dicomFiles.clear();
+      std::vector<std::string> dicomFiles;
       for (const auto &pair : fileNumberPairs) {
         dicomFiles.push_back(pair.first);
       }
 
       std::cout << "Found " << dicomFiles.size() << " DICOM files for patient "
                 << patientID << std::endl;
+      return dicomFiles;
     } catch (const std::exception &e) {
       std::cerr << "Error loading DICOM files for patient " << patientID << ": "
                 << e.what() << std::endl;
@@ -307,52 +931,371 @@ public:
     }
   }
 
-  void processPatient(const std::string &patientID,
-                      size_t batchSize = DEFAULT_BATCH_SIZE) {
+  // Indexes an archived study once and keeps the .dcm members of its first
+  // series, ordered like loadDICOMFilesForPatient orders files
+  void loadDICOMMembersFromArchive(const std::string &archiveName,
+                                   PatientJob &job) {
+    std::string archivePath = baseDataPath + archiveName;
+    job.archive = std::make_shared<ArchiveSource>(archivePath);
+
+    std::vector<ArchiveSource::Member> members = job.archive->getMembers();
+    if (members.empty()) {
+      throw std::runtime_error("No DICOM files found in archive: " +
+                               archivePath);
+    }
+    std::string seriesDir = fs::path(members[0].name).parent_path().string();
+    members.erase(std::remove_if(members.begin(), members.end(),
+                                 [&](const ArchiveSource::Member &member) {
+                                   return fs::path(member.name)
+                                              .parent_path()
+                                              .string() != seriesDir;
+                                 }),
+                  members.end());
+    std::stable_sort(members.begin(), members.end(),
+                     [this](const auto &a, const auto &b) {
+                       return extractFileNumber(
+                                  fs::path(a.name).filename().string()) <
+                              extractFileNumber(
+                                  fs::path(b.name).filename().string());
+                     });
+
+    for (const auto &member : members) {
+      job.files.push_back(member.name);
+      job.archiveMembers.push_back(member);
+    }
+    std::cout << "Indexed " << job.files.size() << " DICOM files for patient "
+              << job.patientID << " in " << archivePath << std::endl;
+  }
+
+private:
+  // entry is a patient directory name or an archive file name
+  PatientJob createJob(const std::string &entry) {
+    PatientJob job;
+    bool archived = ArchiveSource::isArchive(entry);
+    std::string patientID = archived ? ArchiveSource::stem(entry) : entry;
+    job.patientID = patientID;
+    job.outputPath = setupOutputDirectory(patientID);
+    if (archived) {
+      loadDICOMMembersFromArchive(entry, job);
+    } else {
+      job.files = loadDICOMFilesForPatient(patientID);
+    }
+
+    if (options.resume) {
+      std::vector<std::string> slices;
+      for (const auto &file : job.files) {
+        slices.push_back(fs::path(file).stem().string());
+      }
+      // A montage is written whole, so a patient whose montage is not
+      // complete is processed again from its first slice
+      std::vector<size_t> unfinished = journal->unfinished(
+          patientID, slices, paramHash, options.montageExport);
+      std::vector<std::string> files;
+      std::vector<ArchiveSource::Member> members;
+      for (size_t i : unfinished) {
+        files.push_back(job.files[i]);
+        if (job.archive) {
+          members.push_back(job.archiveMembers[i]);
+        }
+      }
+      std::cout << "Resuming: skipping " << job.files.size() - files.size()
+                << " slice(s) already completed" << std::endl;
+      job.files = std::move(files);
+      job.archiveMembers = std::move(members);
+    }
+    if (job.archive) {
+      // Only the slices this run processes are buffered by the shared pass
+      job.archive->select(job.archiveMembers);
+    }
+    if (!job.files.empty()) {
+      dicom::Header header = firstSliceHeader(job);
+      if (header.pixels() > 0) {
+        job.slicePixels = header.pixels();
+      }
+      job.nativeDecode = dicom::canDecode(header.transferSyntax);
+    }
+
+    if (std::find(options.urgentPatients.begin(), options.urgentPatients.end(),
+                  patientID) != options.urgentPatients.end()) {
+      job.priority = URGENT_PRIORITY;
+    }
+    job.remaining = job.files.size();
+    job.queuedAt = std::chrono::steady_clock::now();
+    return job;
+  }
+
+  // Header of a job's first slice, empty if it cannot be read. An archived
+  // slice is peeked at through the shared pass, which keeps it buffered for
+  // its worker.
+  dicom::Header firstSliceHeader(const PatientJob &job) {
+    dicom::Header header;
     try {
-      std::cout << "\n=== Processing Patient: " << patientID
-                << " using Parallel Processing ===\n"
-                << std::endl;
+      if (job.archive) {
+        std::vector<char> data = job.archive->peek(job.archiveMembers[0]);
+        header = dicom::readHeader(
+            reinterpret_cast<const uint8_t *>(data.data()), data.size());
+      } else {
+        header = dicom::readHeader(job.files[0]);
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Could not read the header of " << job.files[0] << ": "
+                << e.what() << std::endl;
+    }
+    return header;
+  }
+
+  // Re-reads the urgent file when it has changed, at most once a second.
+  // Called by workers at slice boundaries; only one thread polls at a time.
+  void pollUrgentFile(std::vector<PatientJob> &jobs,
+                      SliceScheduler &scheduler) {
+    if (options.urgentFile.empty()) {
+      return;
+    }
+    long now = std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+                   .count();
+    if (now < nextUrgentPoll.load(std::memory_order_relaxed)) {
+      return;
+    }
+    std::unique_lock<std::mutex> lock(urgentMutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      return;
+    }
+    nextUrgentPoll.store(now + 1000, std::memory_order_relaxed);
+
+    std::error_code error;
+    auto modified = fs::last_write_time(options.urgentFile, error);
+    if (error || modified == urgentFileTime) {
+      return;
+    }
+    urgentFileTime = modified;
+
+    std::ifstream file(options.urgentFile);
+    std::string line;
+    while (std::getline(file, line)) {
+      std::istringstream in(line);
+      std::string patientID;
+      int priority = URGENT_PRIORITY;
+      if (!(in >> patientID)) {
+        continue;
+      }
+      in >> priority;
+      for (size_t j = 0; j < jobs.size(); ++j) {
+        if (jobs[j].patientID != patientID || jobs[j].priority >= priority ||
+            jobs[j].remaining == 0) {
+          continue;
+        }
+        size_t moved = scheduler.setJobPriority(j, priority);
+        jobs[j].priority = priority;
+        jobs[j].queuedAt = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> outputLock(outputMutex);
+        std::cout << "Raised " << patientID << " to priority " << priority
+                  << " (" << moved << " queued slice(s))" << std::endl;
+      }
+    }
+  }
 
-      // Setup output directory for this patient
-      setupOutputDirectory(patientID);
+  // Dispatches every slice of every job through the priority scheduler.
+  // Work proceeds in rounds of batchSize slices: workers pop tasks one at a
+  // time, so a newly urgent job is picked up at the next slice boundary,
+  // and each round is exported and checkpointed before the next starts.
+  size_t runJobs(std::vector<PatientJob> &jobs, size_t batchSize) {
+    SliceScheduler scheduler;
+    size_t totalImages = 0;
+    for (size_t j = 0; j < jobs.size(); ++j) {
+      for (size_t slice = 0; slice < jobs[j].files.size(); ++slice) {
+        if (options.propagateSeeds) {
+          scheduler.pushAfterPrevious(j, slice, jobs[j].priority);
+        } else {
+          scheduler.push(j, slice, jobs[j].priority);
+        }
+      }
+      totalImages += jobs[j].files.size();
+    }
+    propagated.assign(jobs.size(), nullptr);
 
-      // Load DICOM files for this patient
-      loadDICOMFilesForPatient(patientID);
+    std::cout << "Scheduling " << totalImages << " slice(s) from "
+              << jobs.size() << " patient(s) using " << omp_get_max_threads()
+              << " threads"
+              << (options.propagateSeeds ? " (wavefront over series)" : "")
+              << "\n"
+              << std::endl;
 
-      int successCount = 0;
-      std::cout << "Found " << dicomFiles.size()
-                << " images to process for patient " << patientID << std::endl;
-      std::cout << "Using " << omp_get_max_threads() << " threads\n"
-                << std::endl;
+    progressReporter = std::make_unique<ProgressReporter>(
+        progress, totalImages,
+        std::chrono::milliseconds(
+            static_cast<long>(options.progressInterval * 1000)),
+        options.statusFile.empty() ? outputBasePath + "/status.json"
+                                   : options.statusFile,
+        [&jobs](size_t job) { return jobs[job].patientID; });
+    timing.startRun();
+    progressReporter->start();
+
+    size_t completedJobs = 0;
+    for (auto &job : jobs) {
+      if (job.remaining == 0) {
+        completedJobs++;
+      }
+    }
 
-      // Process images in batches
-      for (size_t batchStart = 0; batchStart < dicomFiles.size();
-           batchStart += batchSize) {
-        size_t currentBatchSize =
-            std::min(batchSize, dicomFiles.size() - batchStart);
-        std::vector<ProcessedImageData> batchResults(currentBatchSize);
-
-#pragma omp parallel for schedule(auto) reduction(+ : successCount)
-        for (size_t i = 0; i < currentBatchSize; ++i) {
-          size_t fileIndex = batchStart + i;
-          batchResults[i] = processSingleImage(dicomFiles[fileIndex]);
-          if (batchResults[i].originalImage && batchResults[i].processedImage) {
-            successCount++;
+    while (scheduler.size() > 0) {
+      std::vector<ProcessedImageData> roundResults(batchSize);
+      std::atomic<size_t> claimed{0};
+
+#pragma omp parallel
+      {
+        SliceTask task;
+        while (true) {
+          pollUrgentFile(jobs, scheduler);
+          size_t slot = claimed.fetch_add(1);
+          if (slot >= batchSize) {
+            break;
+          }
+          if (!scheduler.pop(task)) {
+            break;
+          }
+          const PatientJob &job = jobs[task.job];
+          // Over budget with no slice left to finish: put the slice back and
+          // end the round so its results are exported and their memory
+          // released
+          size_t admitted = job.slicePixels * WORKING_BYTES_PER_PIXEL;
+          if (!memory.admit(admitted)) {
+            scheduler.putBack(task);
+            break;
+          }
+          progressReporter->setCurrent(task.job);
+          // The scheduler only hands out slice N + 1 once slice N completed,
+          // so its seeds are in place
+          std::shared_ptr<const propagation::Propagation> seedsFrom;
+          if (options.propagateSeeds) {
+            seedsFrom = propagated[task.job];
+            if (seedsFrom && !seedsFrom->empty()) {
+              propagatedSlices++;
+              propagatedSeeds += seedsFrom->seeds.size();
+            } else {
+              independentSlices++;
+            }
           }
+          ProcessedImageData result =
+              processWithDeadline(job, task.slice, seedsFrom.get());
+          result.heldBytes = retainedBytes(result);
+          memory.finish(admitted, result.heldBytes);
+          if (options.propagateSeeds) {
+            propagated[task.job] = propagateFrom(result);
+          }
+          scheduler.complete(task.job, task.slice);
+          result.job = task.job;
+          result.slice = task.slice;
+          result.outputPath = job.outputPath;
+          roundResults[slot] = std::move(result);
         }
+      }
 
-        // Export batch results
-        exportBatch(batchResults);
+      // Slots past the end of the queue were never filled
+      roundResults.erase(std::remove_if(roundResults.begin(),
+                                        roundResults.end(),
+                                        [](const ProcessedImageData &r) {
+                                          return r.filename.empty();
+                                        }),
+                         roundResults.end());
+
+      // Export round results
+      exportBatch(roundResults, jobs);
+
+      // Checkpoint: an interrupted run loses at most this round (montage
+      // slices are recorded once their montage is written)
+      for (const auto &imageData : roundResults) {
+        PatientJob &job = jobs[imageData.job];
+        memory.release(imageData.heldBytes);
+        std::string slice = fs::path(imageData.filename).stem().string();
+        if (imageData.exported && options.montageExport) {
+          job.montageSlices.push_back({slice, imageData.paramHash});
+        } else if (imageData.exported) {
+          journal->markCompleted(job.patientID, slice, imageData.paramHash);
+        }
+        if (imageData.originalImage && imageData.hasMask()) {
+          job.successCount++;
+          successfulImages++;
+        }
+        if (--job.remaining == 0) {
+          writeMontage(job);
+          double latency = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - job.queuedAt)
+                               .count();
+          bool urgent = job.priority > BULK_PRIORITY;
+          timing.recordJobLatency(urgent, latency);
+          completedJobs++;
+          std::cout << "\nPatient " << job.patientID
+                    << " completed. Successfully processed "
+                    << job.successCount << "/" << job.files.size()
+                    << " images" << (urgent ? " (urgent)" : "") << " in "
+                    << latency << " s." << std::endl;
+        }
       }
+      journal->flush();
+    }
+
+    progressReporter->stop();
+    return completedJobs;
+  }
 
-      std::cout << "\nPatient " << patientID
-                << " completed. Successfully processed " << successCount << "/"
-                << dicomFiles.size() << " images." << std::endl;
+  void reportRun() {
+    timing.finishRun(successfulImages);
+    timing.setStragglers(watchdog->stragglerCount());
+    timing.print(std::string("threading mode ") +
+                 threadingModeName(threadingMode));
+    if (rleMaskCount > 0) {
+      std::cout << "RLE masks: " << rleMaskCount << " masks, "
+                << rleMaskBytes / 1024 << " KiB (dense UINT8 would be "
+                << denseMaskBytes / 1024 << " KiB, "
+                << std::fixed << std::setprecision(1)
+                << static_cast<double>(denseMaskBytes) /
+                       std::max<size_t>(1, rleMaskBytes)
+                << "x smaller)" << std::endl;
+    }
+    // The accounted peak sums the estimates admission works with; VmHWM is
+    // what the process actually reached, FAST and OpenCL included
+    std::cout << "Memory: accounted peak " << std::fixed
+              << std::setprecision(1) << memory.getPeak() / (1024.0 * 1024.0)
+              << " MiB";
+    if (memory.getBudget() > 0) {
+      std::cout << " of " << memory.getBudget() / (1024.0 * 1024.0)
+                << " MiB budget (" << std::setprecision(0)
+                << 100.0 * memory.getPeak() / memory.getBudget() << "%), "
+                << memory.getWaits() << " admission wait(s) totalling "
+                << std::setprecision(1) << memory.getWaitSeconds() << " s, "
+                << memory.getRefusals() << " round(s) cut short";
+    } else {
+      std::cout << " (no budget)";
+    }
+    std::cout << "; process peak RSS " << std::setprecision(1)
+              << peakResidentBytes() / (1024.0 * 1024.0) << " MiB"
+              << std::endl;
+    if (options.propagateSeeds) {
+      std::cout << "Seed propagation: " << propagatedSlices
+                << " slice(s) grown from the previous slice (mean "
+                << std::fixed << std::setprecision(1)
+                << static_cast<double>(propagatedSeeds) /
+                       std::max<size_t>(1, propagatedSlices)
+                << " seeds), " << independentSlices
+                << " from the fixed seeds" << std::endl;
+    }
+  }
+
+public:
+  void processPatient(const std::string &patientID,
+                      size_t batchSize = DEFAULT_BATCH_SIZE) {
+    try {
+      std::cout << "\n=== Processing Patient: " << patientID
+                << " using Parallel Processing ===\n"
+                << std::endl;
+
+      std::vector<PatientJob> jobs = {createJob(patientID)};
+      runJobs(jobs, batchSize);
+      reportRun();
     } catch (const std::exception &e) {
       std::cerr << "Error processing patient " << patientID << ": " << e.what()
                 << std::endl;
-      // Don't throw here - allow processing of other patients to continue
     }
   }
 
@@ -368,21 +1311,24 @@ public:
       return;
     }
 
-    // Process each patient directory
-    int successfulPatients = 0;
+    // Queue each patient directory
+    std::vector<PatientJob> jobs;
     for (const auto &patientID : patientDirs) {
       try {
-        processPatient(patientID, batchSize);
-        successfulPatients++;
+        jobs.push_back(createJob(patientID));
       } catch (const std::exception &e) {
-        std::cerr << "Failed to process patient " << patientID
-                  << ". Moving to next patient." << std::endl;
+        std::cerr << "Failed to queue patient " << patientID << ": "
+                  << e.what() << ". Moving to next patient." << std::endl;
       }
     }
 
+    size_t successfulPatients = runJobs(jobs, batchSize);
+
     std::cout << "\n=== All Processing Completed ===\n" << std::endl;
     std::cout << "Successfully processed " << successfulPatients << "/"
               << patientDirs.size() << " patients." << std::endl;
+
+    reportRun();
   }
 };
 
@@ -398,11 +1344,189 @@ int main(int argc, char *argv[]) {
     Reporter::setGlobalReportMethod(Reporter::ERROR,
                                     Reporter::COUT); // Keep errors to console
 
-    omp_set_num_threads(16);
+    // Optional: --threads N to override the detected worker count
+    //           --threading independent|shared (see ThreadingMode)
+    //           --progress-interval SECONDS (0 disables periodic reports)
+    //           --status-file PATH
+    //           --slice-deadline SECONDS (0 disables the watchdog)
+    //           --straggler-policy flag|cancel|retry
+    //           --resume (skip slices recorded in the run journal)
+    //           --urgent ID[,ID...] (dispatch these patients first)
+    //           --urgent-file PATH (polled for patients to promote)
+    //           --perf-counters (per-stage cycles, IPC, misses per pixel)
+    //           --quality full|balanced|preview
+    //           --native-sharpen (separable unsharp mask on the CPU)
+    //           --native-preprocess (fused normalize + clip on the CPU)
+    //           --normalize-percentiles LOW,HIGH (adaptive intensity range)
+    //           --native-morphology (distance-transform dilation)
+    //           --dilation-size N (positive, odd; structuring element width)
+    //           --dilation-shape square|disk
+    //           --rle-masks (run-length masks, exported as .rle)
+    //           --montage (one montage + crop index per patient)
+    //           --montage-tile N (pixels per montage tile)
+    //           --propagate-seeds (seed each slice from the previous mask)
+    //           --propagation-erosion N (mask erosion before seeding)
+    //           --propagation-margin N (search region around the mask)
+    //           --memory-budget SIZE (e.g. 4G; throttles slice admission)
+    int requestedThreads = 0;
+    ThreadingMode threadingMode = ThreadingMode::Independent;
+    ProcessorOptions options;
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--threads" && i + 1 < argc) {
+        requestedThreads = parseIntArgument(arg, argv[++i]);
+        if (requestedThreads <= 0) {
+          std::cerr << "--threads expects a positive count, got " << argv[i]
+                    << std::endl;
+          return 1;
+        }
+      } else if (arg == "--threading" && i + 1 < argc) {
+        threadingMode = parseThreadingMode(argv[++i]);
+      } else if (arg == "--progress-interval" && i + 1 < argc) {
+        options.progressInterval = parseDoubleArgument(arg, argv[++i]);
+        if (options.progressInterval < 0) {
+          std::cerr << "--progress-interval expects seconds >= 0, got "
+                    << argv[i] << std::endl;
+          return 1;
+        }
+      } else if (arg == "--status-file" && i + 1 < argc) {
+        options.statusFile = argv[++i];
+      } else if (arg == "--slice-deadline" && i + 1 < argc) {
+        options.sliceDeadline = parseDoubleArgument(arg, argv[++i]);
+        if (options.sliceDeadline < 0) {
+          throw ArgumentError("--slice-deadline expects seconds >= 0, got " +
+                              std::string(argv[i]));
+        }
+      } else if (arg == "--straggler-policy" && i + 1 < argc) {
+        options.stragglerPolicy = parseStragglerPolicy(argv[++i]);
+      } else if (arg == "--resume") {
+        options.resume = true;
+      } else if (arg == "--urgent" && i + 1 < argc) {
+        std::istringstream ids(argv[++i]);
+        std::string id;
+        while (std::getline(ids, id, ',')) {
+          options.urgentPatients.push_back(id);
+        }
+      } else if (arg == "--urgent-file" && i + 1 < argc) {
+        options.urgentFile = argv[++i];
+      } else if (arg == "--perf-counters") {
+        options.perfCounters = true;
+      } else if (arg == "--quality" && i + 1 < argc) {
+        options.quality = parseQuality(argv[++i]);
+      } else if (arg == "--native-sharpen") {
+        options.nativeSharpen = true;
+      } else if (arg == "--native-preprocess") {
+        options.nativePreprocess = true;
+      } else if (arg == "--normalize-percentiles" && i + 1 < argc) {
+        std::string range = argv[++i];
+        size_t comma = range.find(',');
+        if (comma == std::string::npos) {
+          std::cerr << "--normalize-percentiles expects LOW,HIGH" << std::endl;
+          return 1;
+        }
+        double low = parseDoubleArgument(arg, range.substr(0, comma));
+        double high = parseDoubleArgument(arg, range.substr(comma + 1));
+        if (low < 0 || high > 100 || low >= high) {
+          throw ArgumentError("--normalize-percentiles expects 0 <= LOW < "
+                              "HIGH <= 100, got " + range);
+        }
+        options.percentileNormalize = true;
+        options.nativePreprocess = true;
+        options.normalizeLowPercentile = static_cast<float>(low);
+        options.normalizeHighPercentile = static_cast<float>(high);
+      } else if (arg == "--native-morphology") {
+        options.nativeMorphology = true;
+      } else if (arg == "--dilation-size" && i + 1 < argc) {
+        options.dilationSize = parseIntArgument(arg, argv[++i]);
+        // Even sizes have no centre pixel and 0 would mean "the quality
+        // level's size"
+        if (options.dilationSize <= 0 || options.dilationSize % 2 == 0) {
+          std::cerr << "--dilation-size expects a positive odd size, got "
+                    << argv[i] << std::endl;
+          return 1;
+        }
+      } else if (arg == "--dilation-shape" && i + 1 < argc) {
+        options.diskDilation = morphology::parseShape(argv[++i]) ==
+                               morphology::Shape::Disk;
+        options.nativeMorphology =
+            options.nativeMorphology || options.diskDilation;
+      } else if (arg == "--rle-masks") {
+        options.rleMasks = true;
+      } else if (arg == "--propagate-seeds") {
+        options.propagateSeeds = true;
+      } else if (arg == "--propagation-erosion" && i + 1 < argc) {
+        options.propagateSeeds = true;
+        options.propagationErosion = parseIntArgument(arg, argv[++i]);
+        if (options.propagationErosion < 0) {
+          throw ArgumentError(
+              "--propagation-erosion expects pixels >= 0, got " +
+              std::string(argv[i]));
+        }
+      } else if (arg == "--propagation-margin" && i + 1 < argc) {
+        options.propagateSeeds = true;
+        options.propagationMargin = parseIntArgument(arg, argv[++i]);
+        if (options.propagationMargin < 0) {
+          throw ArgumentError(
+              "--propagation-margin expects pixels >= 0, got " +
+              std::string(argv[i]));
+        }
+      } else if (arg == "--memory-budget" && i + 1 < argc) {
+        options.memoryBudget = parseBytes(argv[++i]);
+      } else if (arg == "--montage") {
+        options.montageExport = true;
+      } else if (arg == "--montage-tile" && i + 1 < argc) {
+        options.montageExport = true;
+        options.montageTileSize = parseIntArgument(arg, argv[++i]);
+        if (options.montageTileSize <= 0 ||
+            options.montageTileSize > montage::MAX_TILE_SIZE) {
+          throw ArgumentError("--montage-tile expects 1 to " +
+                              std::to_string(montage::MAX_TILE_SIZE) +
+                              " pixels, got " + std::string(argv[i]));
+        }
+      } else {
+        std::cerr << "Unknown argument: " << arg << std::endl;
+        return 1;
+      }
+    }
+
+    // Size the worker pool from what this process may actually use rather
+    // than a fixed count; a batch never has more than DEFAULT_BATCH_SIZE
+    // images, so more workers than that would only sit idle
+    ThreadConfig threadConfig = thread_config::detect(
+        requestedThreads,
+        static_cast<int>(OptimizedParallelProcessor::DEFAULT_BATCH_SIZE));
+    // Must happen before anything touches OpenCL
+    thread_config::applyRuntimeThreadCap(threadConfig, threadingMode);
+    threadConfig.print();
+    std::cout << "Quality: " << qualityName(options.quality) << std::endl;
+    if (options.percentileNormalize) {
+      std::cout << "Normalization: percentiles "
+                << options.normalizeLowPercentile << "-"
+                << options.normalizeHighPercentile << std::endl;
+    }
+    if (options.nativeSharpen) {
+      std::cout << "Sharpening: native ("
+                << unsharp::isaName(unsharp::bestIsa()) << ")" << std::endl;
+    }
+    omp_set_num_threads(threadConfig.workerThreads);
 
-    OptimizedParallelProcessor processor;
+    OptimizedParallelProcessor processor(options);
+    processor.configureThreads(threadConfig);
+
+    auto device = DeviceManager::getInstance()->getDefaultDevice();
+    bool cpuDevice = device && device->getDevice().getInfo<CL_DEVICE_TYPE>() ==
+                                   CL_DEVICE_TYPE_CPU;
+    std::cout << "OpenCL device: " << (cpuDevice ? "CPU" : "GPU/accelerator")
+              << std::endl;
+    if (!cpuDevice && threadingMode == ThreadingMode::SharedQueue) {
+      std::cout << "Runtime pool size only applies to CPU OpenCL devices"
+                << std::endl;
+    }
     processor.processAllPatients();
 
+  } catch (const ArgumentError &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
   } catch (const std::exception &e) {
     std::cerr << "Fatal error: " << e.what() << std::endl;
     return 1;
@@ -0,0 +1,246 @@
+#include "brainseg.hpp"
+
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace py = pybind11;
+
+// Python bindings for libbrainseg.
+// Images come in through the buffer protocol: the array's rows and stride
+// are handed to the library, which copies them once into FAST's image
+// storage, or twice when the rows are padded (packed into its scratch
+// buffer first). Masks are returned as NumPy arrays that view the
+// library's own mask storage. The GIL is released while the pipeline runs,
+// so Python threads with separate Contexts segment in parallel.
+
+namespace {
+
+// Compared as NumPy dtypes rather than by format string, so arrays that
+// spell out the native byte order ('<H', '=h') match too; a byte-swapped
+// array does not
+brainseg::PixelType pixelType(const py::buffer_info &info) {
+  py::dtype dtype(info);
+  if (dtype.equal(py::dtype::of<uint8_t>())) {
+    return brainseg::PixelType::UInt8;
+  }
+  if (dtype.equal(py::dtype::of<int16_t>())) {
+    return brainseg::PixelType::Int16;
+  }
+  if (dtype.equal(py::dtype::of<uint16_t>())) {
+    return brainseg::PixelType::UInt16;
+  }
+  if (dtype.equal(py::dtype::of<float>())) {
+    return brainseg::PixelType::Float32;
+  }
+  throw py::type_error("Unsupported dtype " +
+                       py::str(dtype).cast<std::string>() + " (format '" +
+                       info.format +
+                       "'); expected native uint8, int16, uint16 or "
+                       "float32");
+}
+
+// Describes a 2D array with contiguous rows as an ImageView over its data
+brainseg::ImageView viewOf(const py::buffer_info &info) {
+  if (info.ndim != 2) {
+    throw py::value_error("Expected a 2D array, got " +
+                          std::to_string(info.ndim) + " dimensions");
+  }
+  if (info.strides[1] != info.itemsize || info.strides[0] <= 0) {
+    throw py::value_error(
+        "Rows must be contiguous; pass numpy.ascontiguousarray(image)");
+  }
+  brainseg::ImageView view;
+  view.data = info.ptr;
+  view.height = static_cast<int>(info.shape[0]);
+  view.width = static_cast<int>(info.shape[1]);
+  view.type = pixelType(info);
+  view.rowStride = static_cast<size_t>(info.strides[0]);
+  return view;
+}
+
+// A NumPy array viewing mask.pixels; the capsule owns the mask
+py::array_t<uint8_t> toArray(brainseg::Mask &&mask) {
+  auto *owned = new brainseg::Mask(std::move(mask));
+  py::capsule owner(owned, [](void *pointer) {
+    delete static_cast<brainseg::Mask *>(pointer);
+  });
+  return py::array_t<uint8_t>(
+      {static_cast<py::ssize_t>(owned->result.height),
+       static_cast<py::ssize_t>(owned->result.width)},
+      {static_cast<py::ssize_t>(owned->result.width),
+       static_cast<py::ssize_t>(1)},
+      owned->pixels.data(), owner);
+}
+
+// A Context plus the lock that keeps two Python threads from sharing it
+// once the GIL is released
+class PyContext {
+private:
+  brainseg::Context context;
+  std::mutex mutex;
+  std::vector<brainseg::SliceResult> lastResults;
+
+public:
+  explicit PyContext(const PipelineParams &params) : context(params) {}
+
+  PipelineParams getParams() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return context.getParams();
+  }
+
+  void setParams(const PipelineParams &params) {
+    std::lock_guard<std::mutex> lock(mutex);
+    context.setParams(params);
+  }
+
+  std::vector<brainseg::SliceResult> getLastResults() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lastResults;
+  }
+
+  py::array segment(py::buffer image, py::object out) {
+    py::buffer_info input = image.request();
+    brainseg::ImageView view = viewOf(input);
+
+    if (out.is_none()) {
+      brainseg::Mask mask;
+      {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(mutex);
+        mask = context.segment(view);
+        lastResults = {mask.result};
+      }
+      return toArray(std::move(mask));
+    }
+
+    // Caller-provided output, written in place
+    auto target = out.cast<py::array_t<uint8_t>>();
+    if (!target.writeable() || target.ndim() != 2 ||
+        target.shape(0) != view.height || target.shape(1) != view.width ||
+        target.strides(1) != 1 || out.ptr() != target.ptr()) {
+      throw py::value_error("out must be a writeable uint8 array of shape "
+                            "(height, width) with contiguous rows");
+    }
+    brainseg::MaskBuffer buffer;
+    buffer.data = target.mutable_data();
+    buffer.width = view.width;
+    buffer.height = view.height;
+    buffer.rowStride = static_cast<size_t>(target.strides(0));
+    {
+      py::gil_scoped_release release;
+      std::lock_guard<std::mutex> lock(mutex);
+      lastResults = {context.segment(view, buffer)};
+    }
+    return target;
+  }
+
+  py::array segmentFile(const std::string &path) {
+    brainseg::Mask mask;
+    {
+      py::gil_scoped_release release;
+      std::lock_guard<std::mutex> lock(mutex);
+      mask = context.segmentFile(path);
+      lastResults = {mask.result};
+    }
+    return toArray(std::move(mask));
+  }
+
+  py::list segmentSeries(const std::string &directory) {
+    std::vector<brainseg::Mask> masks;
+    {
+      py::gil_scoped_release release;
+      std::lock_guard<std::mutex> lock(mutex);
+      masks = context.segmentSeries(directory);
+      lastResults.clear();
+      for (const auto &mask : masks) {
+        lastResults.push_back(mask.result);
+      }
+    }
+    py::list arrays;
+    for (auto &mask : masks) {
+      arrays.append(toArray(std::move(mask)));
+    }
+    return arrays;
+  }
+};
+
+} // namespace
+
+PYBIND11_MODULE(brainseg, m) {
+  m.doc() = "Brain tumour segmentation pipeline (libbrainseg)";
+  m.attr("__version__") = brainseg::version();
+
+  py::register_exception<brainseg::Error>(m, "Error", PyExc_RuntimeError);
+
+  py::class_<PipelineParams>(m, "Params")
+      .def(py::init<>())
+      .def_static("reference", &PipelineParams::reference)
+      .def_static(
+          "cheap",
+          [](const std::string &quality) {
+            return PipelineParams::cheap(parseQuality(quality));
+          },
+          py::arg("quality") = "full",
+          "Straggler retry params derived from a --quality level")
+      .def_static(
+          "for_quality",
+          [](const std::string &name) {
+            return PipelineParams::forQuality(parseQuality(name));
+          },
+          py::arg("quality"), "Params of a --quality level")
+      .def_readwrite("normalize_lowest", &PipelineParams::normalizeLowest)
+      .def_readwrite("normalize_highest", &PipelineParams::normalizeHighest)
+      .def_readwrite("normalize_min_intensity",
+                     &PipelineParams::normalizeMinIntensity)
+      .def_readwrite("normalize_max_intensity",
+                     &PipelineParams::normalizeMaxIntensity)
+      .def_readwrite("percentile_normalize",
+                     &PipelineParams::percentileNormalize)
+      .def_readwrite("normalize_low_percentile",
+                     &PipelineParams::normalizeLowPercentile)
+      .def_readwrite("normalize_high_percentile",
+                     &PipelineParams::normalizeHighPercentile)
+      .def_readwrite("clip_min", &PipelineParams::clipMin)
+      .def_readwrite("clip_max", &PipelineParams::clipMax)
+      .def_readwrite("median_size", &PipelineParams::medianSize)
+      .def_readwrite("sharpen_gain", &PipelineParams::sharpenGain)
+      .def_readwrite("sharpen_std_dev", &PipelineParams::sharpenStdDev)
+      .def_readwrite("sharpen_mask_size", &PipelineParams::sharpenMaskSize)
+      .def_readwrite("region_min", &PipelineParams::regionMin)
+      .def_readwrite("region_max", &PipelineParams::regionMax)
+      .def_readwrite("grid_seeds", &PipelineParams::gridSeeds)
+      .def_readwrite("region_scale", &PipelineParams::regionScale)
+      .def_readwrite("dilation_size", &PipelineParams::dilationSize)
+      .def_readwrite("disk_dilation", &PipelineParams::diskDilation)
+      .def("hash", &PipelineParams::hash);
+
+  py::class_<brainseg::SliceResult>(m, "SliceResult")
+      .def_readonly("source", &brainseg::SliceResult::source)
+      .def_readonly("width", &brainseg::SliceResult::width)
+      .def_readonly("height", &brainseg::SliceResult::height)
+      .def_readonly("foreground_pixels",
+                    &brainseg::SliceResult::foregroundPixels)
+      .def_readonly("milliseconds", &brainseg::SliceResult::milliseconds);
+
+  py::class_<PyContext>(m, "Context")
+      .def(py::init<const PipelineParams &>(),
+           py::arg("params") = PipelineParams::reference())
+      .def_property("params", &PyContext::getParams, &PyContext::setParams)
+      .def_property_readonly("last_results", &PyContext::getLastResults,
+                             "Timing and size of the slices of the last call")
+      .def("segment", &PyContext::segment, py::arg("image"),
+           py::arg("out") = py::none(),
+           "Segments a 2D uint8/int16/uint16/float32 array. The array is "
+           "copied once into the pipeline's image, twice if its rows are "
+           "padded. Returns a uint8 mask, written into out when given.")
+      .def("segment_file", &PyContext::segmentFile, py::arg("path"),
+           "Segments one 2D DICOM slice")
+      .def("segment_series", &PyContext::segmentSeries, py::arg("directory"),
+           "Segments every .dcm slice of a series directory in order");
+}
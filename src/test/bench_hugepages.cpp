@@ -0,0 +1,177 @@
+#include "huge_pages.hpp"
+#include "perf_counters.hpp"
+#include "synthetic_slices.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Huge-page benchmark.
+// Fills a patient-sized stack of float slices (default 25 x 512 x 512) in
+// each allocation mode and runs two access patterns over it: a 7x7 median
+// (the VectorMedianFilter footprint, seven rows per output pixel) and a
+// median through the stack at every pixel (one slice stride per read).
+// Reports runtime, dTLB load misses where the PMU allows it, and how much of
+// the stack the kernel actually backed with huge pages.
+//
+// Usage: bench_hugepages [--slices N] [--size N] [--repeat N]
+
+namespace {
+
+struct Kernel {
+  const char *name;
+  void (*run)(const float *stack, float *out, int slices, int size);
+};
+
+void median7x7(const float *stack, float *out, int slices, int size) {
+  float window[49];
+  for (int s = 0; s < slices; ++s) {
+    const float *slice = stack + static_cast<size_t>(s) * size * size;
+    float *result = out + static_cast<size_t>(s) * size * size;
+    for (int y = 3; y < size - 3; ++y) {
+      for (int x = 3; x < size - 3; ++x) {
+        int n = 0;
+        for (int dy = -3; dy <= 3; ++dy) {
+          const float *row = slice + static_cast<size_t>(y + dy) * size + x;
+          for (int dx = -3; dx <= 3; ++dx) {
+            window[n++] = row[dx];
+          }
+        }
+        std::nth_element(window, window + 24, window + 49);
+        result[static_cast<size_t>(y) * size + x] = window[24];
+      }
+    }
+  }
+}
+
+void medianThroughStack(const float *stack, float *out, int slices,
+                        int size) {
+  size_t sliceSize = static_cast<size_t>(size) * size;
+  std::vector<float> column(static_cast<size_t>(slices));
+  for (size_t i = 0; i < sliceSize; ++i) {
+    for (int s = 0; s < slices; ++s) {
+      column[s] = stack[s * sliceSize + i];
+    }
+    std::nth_element(column.begin(), column.begin() + slices / 2,
+                     column.end());
+    out[i] = column[slices / 2];
+  }
+}
+
+// Huge-page backed kB of the mapping containing address, from smaps
+size_t hugePageKB(const void *address) {
+  std::ifstream smaps("/proc/self/smaps");
+  uintptr_t target = reinterpret_cast<uintptr_t>(address);
+  std::string line;
+  bool inMapping = false;
+  size_t total = 0;
+  while (std::getline(smaps, line)) {
+    // Mapping headers start with "start-end"; field names have no '-'
+    std::string range = line.substr(0, line.find(' '));
+    size_t dash = range.find('-');
+    if (dash != std::string::npos) {
+      uintptr_t start = std::stoull(range.substr(0, dash), nullptr, 16);
+      uintptr_t end = std::stoull(range.substr(dash + 1), nullptr, 16);
+      inMapping = target >= start && target < end;
+      continue;
+    }
+    if (inMapping && (line.rfind("AnonHugePages:", 0) == 0 ||
+                      line.rfind("Private_Hugetlb:", 0) == 0)) {
+      std::istringstream fields(line.substr(line.find(':') + 1));
+      size_t kb = 0;
+      fields >> kb;
+      total += kb;
+    }
+  }
+  return total;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int slices = 25;
+  int size = 512;
+  int repeat = 3;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--slices" && i + 1 < argc) {
+      slices = std::stoi(argv[++i]);
+    } else if (arg == "--size" && i + 1 < argc) {
+      size = std::stoi(argv[++i]);
+    } else if (arg == "--repeat" && i + 1 < argc) {
+      repeat = std::stoi(argv[++i]);
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 2;
+    }
+  }
+
+  size_t elements = static_cast<size_t>(slices) * size * size;
+  const Kernel kernels[] = {{"median7x7", median7x7},
+                            {"stack-median", medianThroughStack}};
+
+  std::cout << "Stack: " << slices << " x " << size << "x" << size
+            << " floats (" << elements * sizeof(float) / (1 << 20)
+            << " MiB)\n";
+  PerfEventCounter probe = PerfEventCounter::dtlbMisses();
+  if (!probe.available()) {
+    std::cout << "dTLB counter unavailable: "
+              << PerfEventGroup::unavailableReason() << "\n";
+  }
+
+  std::cout << std::left << std::setw(14) << "kernel" << std::setw(10)
+            << "mode" << std::setw(10) << "backing" << std::right
+            << std::setw(12) << "huge MiB" << std::setw(12) << "best ms"
+            << std::setw(16) << "dTLB misses" << "\n";
+
+  for (const Kernel &kernel : kernels) {
+    for (hugepages::Mode mode :
+         {hugepages::Mode::Off, hugepages::Mode::Transparent,
+          hugepages::Mode::Explicit}) {
+      HugePageBuffer<float> stack(elements, mode);
+      HugePageBuffer<float> out(elements, mode);
+      for (int s = 0; s < slices; ++s) {
+        SyntheticSlice slice = makeSyntheticSlice(s, size, size);
+        std::copy(slice.pixels.begin(), slice.pixels.end(),
+                  stack.data() + static_cast<size_t>(s) * size * size);
+      }
+      std::fill(out.data(), out.data() + elements, 0.0f);
+
+      double best = 0.0;
+      uint64_t misses = 0;
+      for (int r = 0; r < repeat; ++r) {
+        PerfEventCounter dtlb = PerfEventCounter::dtlbMisses();
+        auto start = std::chrono::steady_clock::now();
+        kernel.run(stack.data(), out.data(), slices, size);
+        double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+        uint64_t count = dtlb.read();
+        if (r == 0 || ms < best) {
+          best = ms;
+          misses = count;
+        }
+      }
+
+      std::cout << std::left << std::setw(14) << kernel.name << std::setw(10)
+                << hugepages::modeName(mode) << std::setw(10)
+                << hugepages::backingName(stack.backing()) << std::right
+                << std::setw(12) << hugePageKB(stack.data()) / 1024
+                << std::setw(12) << std::fixed << std::setprecision(1) << best
+                << std::setw(16);
+      if (probe.available()) {
+        std::cout << misses;
+      } else {
+        std::cout << "n/a";
+      }
+      std::cout << "\n";
+    }
+  }
+  std::cout << std::flush;
+  return 0;
+}
@@ -0,0 +1,123 @@
+#include "morphology.hpp"
+#include "rle_mask.hpp"
+#include "synthetic_slices.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Morphology benchmark.
+// Dilates a tumour-like mask (the bright ellipse of a synthetic slice) with
+// growing radii: brute force over a square window, which is what a direct
+// Dilation kernel does, against the distance-transform square and disk of
+// morphology.hpp, and the square on the mask's runs (rle_mask.hpp). The
+// direct cost grows with the radius squared; the distance transforms stay
+// flat, and the run-based dilation follows the mask outline, not its area.
+//
+// Usage: bench_morphology [--size N] [--threads N] [--repeat N]
+
+namespace {
+
+std::vector<uint8_t> bruteForceSquare(const std::vector<uint8_t> &mask,
+                                      int size, int radius) {
+  std::vector<uint8_t> out(mask.size(), 0);
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      uint8_t value = 0;
+      for (int dy = -radius; dy <= radius && !value; ++dy) {
+        int ny = std::min(std::max(y + dy, 0), size - 1);
+        for (int dx = -radius; dx <= radius; ++dx) {
+          int nx = std::min(std::max(x + dx, 0), size - 1);
+          if (mask[static_cast<size_t>(ny) * size + nx]) {
+            value = 1;
+            break;
+          }
+        }
+      }
+      out[static_cast<size_t>(y) * size + x] = value;
+    }
+  }
+  return out;
+}
+
+template <typename Run> double bestMs(int repeat, Run run) {
+  double best = 0.0;
+  for (int r = 0; r < repeat; ++r) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - start)
+                    .count();
+    best = r == 0 ? ms : std::min(best, ms);
+  }
+  return best;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  int size = 512;
+  int threads = 1;
+  int repeat = 3;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--size" && i + 1 < argc) {
+      size = std::stoi(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = std::stoi(argv[++i]);
+    } else if (arg == "--repeat" && i + 1 < argc) {
+      repeat = std::stoi(argv[++i]);
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 2;
+    }
+  }
+
+  SyntheticSlice slice = makeSyntheticSlice(0, size, size);
+  uint16_t threshold = *std::max_element(slice.pixels.begin(),
+                                         slice.pixels.end()) / 2;
+  std::vector<uint8_t> mask(slice.pixels.size());
+  for (size_t i = 0; i < mask.size(); ++i) {
+    mask[i] = slice.pixels[i] > threshold;
+  }
+
+  rle::RleMask runs = rle::RleMask::fromDense(mask.data(), size, size);
+  std::cout << "Mask: " << size << "x" << size << ", "
+            << std::count(mask.begin(), mask.end(), 1) << " foreground, "
+            << threads << " thread(s)\n"
+            << "RLE: " << runs.runCount() << " runs, " << runs.bytes()
+            << " bytes (dense " << mask.size() << " bytes)\n"
+            << std::right << std::setw(8) << "radius" << std::setw(14)
+            << "direct ms" << std::setw(14) << "square ms" << std::setw(14)
+            << "disk ms" << std::setw(14) << "rle ms" << std::setw(10)
+            << "match" << "\n"
+            << std::fixed << std::setprecision(2);
+
+  bool allMatch = true;
+  for (int radius : {1, 2, 4, 8, 16, 32}) {
+    std::vector<uint8_t> direct, square;
+    double directMs = bestMs(
+        repeat, [&] { direct = bruteForceSquare(mask, size, radius); });
+    double squareMs = bestMs(repeat, [&] {
+      square = morphology::dilate(mask.data(), size, size, radius,
+                                  morphology::Shape::Square, threads);
+    });
+    double diskMs = bestMs(repeat, [&] {
+      morphology::dilate(mask.data(), size, size, radius,
+                         morphology::Shape::Disk, threads);
+    });
+    rle::RleMask runDilated;
+    double rleMs = bestMs(repeat, [&] { runDilated = runs.dilate(radius); });
+    bool match = direct == square && runDilated.toDense() == direct;
+    allMatch = allMatch && match;
+    std::cout << std::setw(8) << radius << std::setw(14) << directMs
+              << std::setw(14) << squareMs << std::setw(14) << diskMs
+              << std::setw(14) << rleMs << std::setw(10)
+              << (match ? "yes" : "NO") << "\n";
+  }
+  std::cout << std::flush;
+  return allMatch ? 0 : 1;
+}
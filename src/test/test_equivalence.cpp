@@ -0,0 +1,360 @@
+#include "FAST/FAST_directives.hpp"
+#include "dicom_decoder.hpp"
+#include "image_metrics.hpp"
+#include "segmentation_pipeline.hpp"
+#include "synthetic_slices.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace fast;
+namespace fs = std::filesystem;
+
+// Golden-output equivalence harness.
+// Runs the reference FAST pipeline on every slice of a corpus and checks
+// each registered optimized path against the matching reference output:
+// intensity images by maximum absolute error, masks by Dice and the number
+// of differing pixels. Exits non-zero if any case drifts past its tolerance.
+//
+// Usage: test_equivalence [--corpus DIR] [--limit N] [--synthetic N]
+//                         [--case NAME]
+// Without --corpus or --synthetic, eight synthetic slices are used. An
+// unknown --case name exits with status 2.
+
+struct CorpusSlice {
+  std::string name;
+  std::string path; // empty for synthetic slices
+  Image::pointer image;
+};
+
+struct Tolerance {
+  double maxAbsError = 0.0;
+  double minDice = 1.0;
+  size_t maxDifferingPixels = 0;
+};
+
+// An optimized path and the reference output it must reproduce. Either
+// function may return nullptr to skip a slice the path does not apply to.
+struct EquivalenceCase {
+  std::string name;
+  bool mask = false; // compare with Dice/pixel diff instead of abs error
+  Tolerance tolerance;
+  std::function<Image::pointer(const CorpusSlice &, const PipelineStages &)>
+      reference;
+  std::function<Image::pointer(const CorpusSlice &, const PipelineStages &)>
+      optimized;
+};
+
+struct CaseResult {
+  size_t compared = 0;
+  size_t skipped = 0;
+  size_t failed = 0;
+  double worstAbsError = 0.0;
+  double worstDice = 1.0;
+  size_t worstDiffering = 0;
+};
+
+// Native kernels register their case here
+std::vector<EquivalenceCase> registeredCases(const PipelineParams &params) {
+  std::vector<EquivalenceCase> cases;
+
+  // The reference pipeline run again on the same input. Any drift here is
+  // noise in FAST itself and bounds what the other cases can be held to.
+  cases.push_back(
+      {"reference-rerun", true, Tolerance(),
+       [](const CorpusSlice &, const PipelineStages &reference) {
+         return reference.mask;
+       },
+       [params](const CorpusSlice &slice, const PipelineStages &) {
+         return runReferencePipeline(slice.image, params).mask;
+       }});
+
+  // In-tree DICOM decoding against DICOMFileImporter
+  cases.push_back(
+      {"native-decode", false, Tolerance(),
+       [](const CorpusSlice &slice, const PipelineStages &) {
+         return slice.image;
+       },
+       [](const CorpusSlice &slice, const PipelineStages &) {
+         if (slice.path.empty() ||
+             !dicom::canDecode(dicom::readTransferSyntax(slice.path))) {
+           return Image::pointer();
+         }
+         return imageFromDecoded(dicom::decode(dicom::readFile(slice.path)));
+       }});
+
+  // Fused native normalize + clip (fixed intensity range) against
+  // IntensityNormalization followed by IntensityClipping
+  for (unsharp::Isa isa : {unsharp::bestIsa(), unsharp::Isa::Scalar}) {
+    cases.push_back(
+        {std::string("native-preprocess-") + unsharp::isaName(isa), false,
+         Tolerance{1e-4},
+         [](const CorpusSlice &, const PipelineStages &reference) {
+           return reference.clipped;
+         },
+         [params, isa](const CorpusSlice &slice, const PipelineStages &) {
+           return preprocessNative(slice.image, params, 1, isa);
+         }});
+    if (isa == unsharp::Isa::Scalar) {
+      break;
+    }
+  }
+
+  // Percentile mode: the fused pass over the histogram range against FAST's
+  // normalization and clipping over the same range
+  PipelineParams percentile = params;
+  percentile.percentileNormalize = true;
+  cases.push_back(
+      {"native-preprocess-percentile", false, Tolerance{1e-4},
+       [percentile](const CorpusSlice &slice, const PipelineStages &) {
+         std::pair<float, float> range =
+             percentileRange(slice.image, percentile);
+         auto normalize = IntensityNormalization::create(
+             percentile.normalizeLowest, percentile.normalizeHighest,
+             range.first, range.second);
+         normalize->connect(slice.image);
+         auto clipping =
+             IntensityClipping::create(percentile.clipMin, percentile.clipMax);
+         clipping->connect(normalize);
+         clipping->update();
+         return clipping->getOutputData<Image>(0);
+       },
+       [percentile](const CorpusSlice &slice, const PipelineStages &) {
+         return preprocessNative(slice.image, percentile, 4);
+       }});
+
+  // Separable unsharp mask against ImageSharpening, with the vector path
+  // the CPU supports and with the scalar fallback. Only float rounding may
+  // differ: the taps are summed in another order (and fused on AVX2).
+  for (unsharp::Isa isa : {unsharp::bestIsa(), unsharp::Isa::Scalar}) {
+    auto sharpener = std::make_shared<unsharp::UnsharpMask>(
+        params.sharpenGain, params.sharpenStdDev, params.sharpenMaskSize,
+        isa);
+    cases.push_back(
+        {std::string("native-sharpen-") + unsharp::isaName(isa), false,
+         Tolerance{5e-3},
+         [](const CorpusSlice &, const PipelineStages &reference) {
+           return reference.sharpened;
+         },
+         [sharpener](const CorpusSlice &, const PipelineStages &reference) {
+           return sharpenNative(reference.median, *sharpener);
+         }});
+    if (isa == unsharp::Isa::Scalar) {
+      break; // no vector path on this CPU
+    }
+  }
+
+  // Tiled parallel region growing against SeededRegionGrowing. Small tiles
+  // so even the synthetic slices have many tile borders to merge across.
+  cases.push_back(
+      {"parallel-region-growing", true, Tolerance(),
+       [](const CorpusSlice &, const PipelineStages &reference) {
+         return reference.segmented;
+       },
+       [params](const CorpusSlice &, const PipelineStages &reference) {
+         if (params.regionScale != 1.0f) {
+           return Image::pointer();
+         }
+         return growRegionsParallel(reference.sharpened, params, 4, 32);
+       }});
+
+  // Distance-transform dilation (square) against FAST's Dilation
+  cases.push_back(
+      {"native-dilation", true, Tolerance(),
+       [](const CorpusSlice &, const PipelineStages &reference) {
+         return reference.mask;
+       },
+       [params](const CorpusSlice &, const PipelineStages &reference) {
+         if (params.diskDilation) {
+           return Image::pointer(); // FAST has no disk
+         }
+         return postProcessMask(reference.segmented,
+                                reference.input->getWidth(),
+                                reference.input->getHeight(), params, true);
+       }});
+
+  // Post-processing on run-length encoded masks against FAST's Dilation
+  cases.push_back(
+      {"rle-postprocess", true, Tolerance(),
+       [](const CorpusSlice &, const PipelineStages &reference) {
+         return reference.mask;
+       },
+       [params](const CorpusSlice &, const PipelineStages &reference) {
+         if (params.diskDilation) {
+           return Image::pointer();
+         }
+         return imageFromRle(postProcessMaskRle(
+             reference.segmented, reference.input->getWidth(),
+             reference.input->getHeight(), params));
+       }});
+
+  return cases;
+}
+
+std::vector<CorpusSlice> loadCorpus(const std::string &directory,
+                                    size_t limit) {
+  std::vector<std::string> paths;
+  for (const auto &entry : fs::recursive_directory_iterator(directory)) {
+    if (entry.is_regular_file() && entry.path().extension() == ".dcm") {
+      paths.push_back(entry.path().string());
+    }
+  }
+  std::sort(paths.begin(), paths.end());
+  if (paths.size() > limit) {
+    paths.resize(limit);
+  }
+
+  std::vector<CorpusSlice> corpus;
+  for (const auto &path : paths) {
+    auto importer = DICOMFileImporter::create(path);
+    importer->setLoadSeries(false);
+    importer->update();
+    corpus.push_back({fs::path(path).filename().string(), path,
+                      importer->getOutputData<Image>(0)});
+  }
+  return corpus;
+}
+
+std::vector<CorpusSlice> syntheticCorpus(int count) {
+  std::vector<CorpusSlice> corpus;
+  for (int i = 0; i < count; ++i) {
+    SyntheticSlice slice = makeSyntheticSlice(i);
+    corpus.push_back({"synthetic-" + std::to_string(i), "",
+                      Image::create(slice.width, slice.height, TYPE_UINT16, 1,
+                                    slice.pixels.data())});
+  }
+  return corpus;
+}
+
+int main(int argc, char **argv) {
+  Reporter::setGlobalReportMethod(Reporter::INFO, Reporter::NONE);
+  Reporter::setGlobalReportMethod(Reporter::WARNING, Reporter::COUT);
+  Reporter::setGlobalReportMethod(Reporter::ERROR, Reporter::COUT);
+
+  std::string corpusDirectory;
+  size_t limit = 16;
+  int synthetic = 0;
+  std::string onlyCase;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--corpus" && i + 1 < argc) {
+      corpusDirectory = argv[++i];
+    } else if (arg == "--limit" && i + 1 < argc) {
+      limit = static_cast<size_t>(std::stoul(argv[++i]));
+    } else if (arg == "--synthetic" && i + 1 < argc) {
+      synthetic = std::stoi(argv[++i]);
+    } else if (arg == "--case" && i + 1 < argc) {
+      onlyCase = argv[++i];
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 2;
+    }
+  }
+  if (corpusDirectory.empty() && synthetic == 0) {
+    synthetic = 8;
+  }
+
+  try {
+    PipelineParams params = PipelineParams::reference();
+    std::vector<EquivalenceCase> cases = registeredCases(params);
+    // A misspelt case would otherwise compare nothing and pass
+    if (!onlyCase.empty() &&
+        std::none_of(cases.begin(), cases.end(),
+                     [&](const EquivalenceCase &testCase) {
+                       return testCase.name == onlyCase;
+                     })) {
+      std::cerr << "Unknown case: " << onlyCase << " (known:";
+      for (const auto &testCase : cases) {
+        std::cerr << " " << testCase.name;
+      }
+      std::cerr << ")" << std::endl;
+      return 2;
+    }
+
+    std::vector<CorpusSlice> corpus = syntheticCorpus(synthetic);
+    if (!corpusDirectory.empty()) {
+      std::vector<CorpusSlice> files = loadCorpus(corpusDirectory, limit);
+      corpus.insert(corpus.end(), files.begin(), files.end());
+    }
+    if (corpus.empty()) {
+      std::cerr << "Empty corpus" << std::endl;
+      return 2;
+    }
+
+    std::vector<CaseResult> results(cases.size());
+
+    for (const auto &slice : corpus) {
+      PipelineStages reference = runReferencePipeline(slice.image, params);
+      for (size_t c = 0; c < cases.size(); ++c) {
+        const EquivalenceCase &testCase = cases[c];
+        CaseResult &result = results[c];
+        if (!onlyCase.empty() && testCase.name != onlyCase) {
+          continue;
+        }
+        Image::pointer expected = testCase.reference(slice, reference);
+        Image::pointer actual = testCase.optimized(slice, reference);
+        if (!expected || !actual) {
+          result.skipped++;
+          continue;
+        }
+        result.compared++;
+
+        bool ok;
+        if (testCase.mask) {
+          MaskComparison m = compareMasks(expected, actual);
+          result.worstDice = std::min(result.worstDice, m.dice);
+          result.worstDiffering = std::max(result.worstDiffering, m.differing);
+          ok = m.dice >= testCase.tolerance.minDice &&
+               m.differing <= testCase.tolerance.maxDifferingPixels;
+          if (!ok) {
+            std::cout << "DRIFT " << testCase.name << " " << slice.name
+                      << ": Dice " << m.dice << ", " << m.differing
+                      << " differing pixel(s)" << std::endl;
+          }
+        } else {
+          double error = maxAbsError(expected, actual);
+          result.worstAbsError = std::max(result.worstAbsError, error);
+          ok = error <= testCase.tolerance.maxAbsError;
+          if (!ok) {
+            std::cout << "DRIFT " << testCase.name << " " << slice.name
+                      << ": max abs error " << error << std::endl;
+          }
+        }
+        result.failed += !ok;
+      }
+    }
+
+    std::cout << "\n=== Equivalence: " << corpus.size() << " slice(s) ===\n";
+    std::cout << std::left << std::setw(20) << "case" << std::right
+              << std::setw(10) << "compared" << std::setw(10) << "skipped"
+              << std::setw(14) << "max abs err" << std::setw(12) << "min Dice"
+              << std::setw(12) << "max diff" << "  result\n";
+    bool passed = true;
+    for (size_t c = 0; c < cases.size(); ++c) {
+      const CaseResult &result = results[c];
+      if (!onlyCase.empty() && cases[c].name != onlyCase) {
+        continue;
+      }
+      std::cout << std::left << std::setw(20) << cases[c].name << std::right
+                << std::setw(10) << result.compared << std::setw(10)
+                << result.skipped << std::setw(14) << result.worstAbsError
+                << std::setw(12) << result.worstDice << std::setw(12)
+                << result.worstDiffering << "  "
+                << (result.failed ? "FAIL" : "ok") << "\n";
+      passed = passed && result.failed == 0;
+    }
+    std::cout << std::flush;
+    return passed ? 0 : 1;
+
+  } catch (const std::exception &e) {
+    std::cerr << "Fatal error: " << e.what() << std::endl;
+    return 2;
+  }
+}
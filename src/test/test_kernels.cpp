@@ -0,0 +1,757 @@
+#include "dicom_decoder.hpp"
+#include "intensity_preprocess.hpp"
+#include "montage.hpp"
+#include "morphology.hpp"
+#include "parallel_region_growing.hpp"
+#include "pipeline_params.hpp"
+#include "rle_mask.hpp"
+#include "run_journal.hpp"
+#include "stage_graph.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Unit checks of the native kernels and helpers that need no FAST: each is
+// run on small hand-made inputs and compared with values worked out by hand
+// or with a straightforward reimplementation. Prints every failed check and
+// exits non-zero if there was one.
+//
+// Usage: test_kernels
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string &what) {
+  if (!ok) {
+    std::cout << "FAIL " << what << "\n";
+    failures++;
+  }
+}
+
+bool near(float a, float b, float tolerance = 1e-5f) {
+  return std::fabs(a - b) <= tolerance;
+}
+
+// Histogram of any integral pixels, one map entry per value present
+template <typename T>
+std::map<int, uint64_t> countValues(const std::vector<T> &pixels) {
+  std::map<int, uint64_t> counts;
+  for (T pixel : pixels) {
+    counts[static_cast<int>(pixel)]++;
+  }
+  return counts;
+}
+
+template <typename T>
+bool matches(const preprocess::Histogram &histogram,
+             const std::vector<T> &pixels) {
+  std::map<int, uint64_t> expected = countValues(pixels);
+  if (histogram.total != pixels.size()) {
+    return false;
+  }
+  for (size_t bin = 0; bin < histogram.counts.size(); ++bin) {
+    auto it = expected.find(static_cast<int>(bin) + histogram.offset);
+    uint64_t count = it == expected.end() ? 0 : it->second;
+    if (histogram.counts[bin] != count) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void checkHistograms() {
+  // Percentiles of 1, 2, ..., 100: p % of the pixels are at or below p
+  std::vector<uint16_t> ramp;
+  for (uint16_t value = 1; value <= 100; ++value) {
+    ramp.push_back(value);
+  }
+  preprocess::Histogram histogram =
+      preprocess::buildHistogram(ramp.data(), ramp.size());
+  check(matches(histogram, ramp), "uint16 histogram counts");
+  check(histogram.offset == 0, "uint16 histogram offset");
+  check(histogram.percentile(0.0) == 1.0f, "0th percentile is the minimum");
+  check(histogram.percentile(1.0) == 1.0f, "1st percentile");
+  check(histogram.percentile(50.0) == 50.0f, "median");
+  check(histogram.percentile(99.0) == 99.0f, "99th percentile");
+  check(histogram.percentile(100.0) == 100.0f,
+        "100th percentile is the maximum");
+  check(histogram.percentile(150.0) == 100.0f, "percentile clamped to 100");
+
+  // Signed pixels land in bins offset by -32768, in value order
+  std::vector<int16_t> signedPixels = {-32768, -1000, -1000, -5, 0,
+                                       0,      7,     300,   32767};
+  histogram =
+      preprocess::buildHistogram(signedPixels.data(), signedPixels.size());
+  check(matches(histogram, signedPixels), "int16 histogram counts");
+  check(histogram.offset == -32768, "int16 histogram offset");
+  check(histogram.percentile(0.0) == -32768.0f, "int16 minimum");
+  check(histogram.percentile(30.0) == -1000.0f, "int16 negative percentile");
+  check(histogram.percentile(50.0) == 0.0f, "int16 median");
+  check(histogram.percentile(100.0) == 32767.0f, "int16 maximum");
+
+  std::vector<uint8_t> bytes = {0, 255, 255, 17};
+  histogram = preprocess::buildHistogram(bytes.data(), bytes.size());
+  check(histogram.counts.size() == 256 && matches(histogram, bytes),
+        "uint8 histogram counts");
+
+  // Large enough for four workers; every worker's sub-histograms must be
+  // merged into the same counts as a single thread gives
+  size_t count = 4 * preprocess::detail::MIN_PIXELS_PER_THREAD + 13;
+  std::vector<int16_t> noise(count);
+  uint32_t state = 12345;
+  for (int16_t &pixel : noise) {
+    state = state * 1664525u + 1013904223u;
+    pixel = static_cast<int16_t>(static_cast<int>(state >> 20) - 2048);
+  }
+  preprocess::Histogram single =
+      preprocess::buildHistogram(noise.data(), noise.size(), 1);
+  preprocess::Histogram merged =
+      preprocess::buildHistogram(noise.data(), noise.size(), 4);
+  check(matches(single, noise), "int16 single thread counts");
+  check(merged.counts == single.counts && merged.total == single.total,
+        "int16 four thread merge");
+  check(merged.percentile(1.0) == single.percentile(1.0) &&
+            merged.percentile(99.0) == single.percentile(99.0),
+        "int16 four thread percentiles");
+}
+
+void checkTransform() {
+  // IntensityNormalization(0.5, 2.5, 0, 10000) maps 0 to 0.5 and 10000 to
+  // 2.5; clipping then raises everything below 0.68
+  PipelineParams params = PipelineParams::reference();
+  preprocess::Transform transform = preprocess::transformFor(params);
+  std::vector<uint16_t> pixels = {0,    1000, 1800, 2000, 5000,
+                                  7500, 9000, 10000};
+  std::vector<float> expected = {0.68f, 0.7f, 0.86f, 0.9f,
+                                 1.5f,  2.0f, 2.3f,  2.5f};
+  for (unsharp::Isa isa : {unsharp::bestIsa(), unsharp::Isa::Scalar}) {
+    // Twice over, so the vector path has a full block of eight
+    std::vector<uint16_t> input = pixels;
+    input.insert(input.end(), pixels.begin(), pixels.end());
+    std::vector<float> out(input.size());
+    preprocess::apply(input.data(), out.data(), input.size(), transform, isa);
+    for (size_t i = 0; i < out.size(); ++i) {
+      check(near(out[i], expected[i % expected.size()], 1e-4f),
+            std::string("normalize ") + std::to_string(input[i]) + " (" +
+                unsharp::isaName(isa) + ")");
+    }
+  }
+
+  // Signed input with a percentile range
+  std::vector<int16_t> signedPixels = {-200, -100, 0, 100, 200, 300, 400,
+                                       500};
+  params.percentileNormalize = true;
+  params.normalizeLowPercentile = 0.0f;
+  params.normalizeHighPercentile = 100.0f;
+  params.clipMin = 0.0f;
+  transform = preprocess::transformFor(params);
+  preprocess::setPercentileRange(
+      transform,
+      preprocess::buildHistogram(signedPixels.data(), signedPixels.size()),
+      params);
+  check(transform.minIntensity == -200.0f && transform.maxIntensity == 500.0f,
+        "percentile range of int16 slice");
+  std::vector<float> out(signedPixels.size());
+  preprocess::apply(signedPixels.data(), out.data(), out.size(), transform);
+  check(near(out.front(), 0.5f) && near(out.back(), 2.5f),
+        "int16 percentile normalization keeps the contrast direction");
+}
+
+// A few blobs, a lone pixel and a run along the border of a w x h slice
+std::vector<uint8_t> blobs(int w, int h, uint32_t seed) {
+  std::vector<uint8_t> mask(static_cast<size_t>(w) * h, 0);
+  uint32_t state = seed;
+  for (int blob = 0; blob < 4; ++blob) {
+    state = state * 1664525u + 1013904223u;
+    int cx = static_cast<int>(state >> 8) % w;
+    int cy = static_cast<int>(state >> 20) % h;
+    int r = 1 + static_cast<int>(state >> 28) % 5;
+    for (int y = std::max(0, cy - r); y < std::min(h, cy + r + 1); ++y) {
+      for (int x = std::max(0, cx - r); x < std::min(w, cx + r + 1); ++x) {
+        mask[static_cast<size_t>(y) * w + x] =
+            (x - cx) * (x - cx) + (y - cy) * (y - cy) <= r * r;
+      }
+    }
+  }
+  mask[static_cast<size_t>(h / 2) * w + w / 3] = 1;
+  std::fill(mask.begin() + static_cast<size_t>(h - 1) * w,
+            mask.begin() + static_cast<size_t>(h - 1) * w + w / 2, 1);
+  return mask;
+}
+
+bool rejected(const std::string &bytes) {
+  std::istringstream in(bytes);
+  try {
+    rle::RleMask::read(in);
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+std::string u32(uint32_t value) {
+  std::ostringstream out;
+  rle::detail::writeU32(out, value);
+  return out.str();
+}
+
+void checkRleMasks() {
+  const int w = 41;
+  const int h = 29;
+  std::vector<uint8_t> dense = blobs(w, h, 7);
+  std::vector<uint8_t> other = blobs(w, h, 99);
+  rle::RleMask mask = rle::RleMask::fromDense(dense.data(), w, h);
+  rle::RleMask second = rle::RleMask::fromDense(other.data(), w, h);
+  check(mask.toDense() == dense, "RLE dense round trip");
+
+  std::stringstream stream;
+  mask.write(stream);
+  check(rle::RleMask::read(stream) == mask, "RLE write/read round trip");
+  std::string path = (std::filesystem::temp_directory_path() /
+                      ("test_kernels_" + std::to_string(::getpid()) + ".rle"))
+                         .string();
+  mask.save(path);
+  check(rle::RleMask::load(path) == mask, "RLE file round trip");
+  std::remove(path.c_str());
+  rle::RleMask empty(w, h);
+  stream.str("");
+  empty.write(stream);
+  check(rle::RleMask::read(stream) == empty, "empty RLE round trip");
+
+  std::vector<uint8_t> expected(dense.size());
+  for (size_t i = 0; i < dense.size(); ++i) {
+    expected[i] = dense[i] || other[i];
+  }
+  check(mask.unite(second).toDense() == expected, "RLE unite");
+  for (size_t i = 0; i < dense.size(); ++i) {
+    expected[i] = !dense[i];
+  }
+  check(mask.complement().toDense() == expected, "RLE complement");
+  check(mask.complement().complement() == mask, "RLE double complement");
+
+  for (morphology::Shape shape :
+       {morphology::Shape::Square, morphology::Shape::Disk}) {
+    for (int radius = 0; radius <= 6; ++radius) {
+      std::string what = std::string(morphology::shapeName(shape)) +
+                         " radius " + std::to_string(radius);
+      check(mask.dilate(radius, shape).toDense() ==
+                morphology::dilate(dense.data(), w, h, radius, shape),
+            "RLE dilate matches morphology, " + what);
+      check(mask.erode(radius, shape).toDense() ==
+                morphology::erode(dense.data(), w, h, radius, shape),
+            "RLE erode matches morphology, " + what);
+    }
+  }
+
+  // Malformed files are refused before their sizes are trusted
+  std::string magic(rle::detail::MAGIC, sizeof(rle::detail::MAGIC));
+  check(rejected(magic + u32(0xFFFFFFFFu) + u32(0xFFFFFFFFu) + u32(0)),
+        "RLE read rejects an oversized mask");
+  check(rejected(magic + u32(4) + u32(2) + u32(1000)),
+        "RLE read rejects more runs than fit");
+  check(rejected(magic + u32(4) + u32(2) + u32(1) + u32(0) + u32(3) + u32(2)),
+        "RLE read rejects a run past the row");
+  check(rejected(magic + u32(4) + u32(2) + u32(1) + u32(2) + u32(0) + u32(1)),
+        "RLE read rejects a run past the last row");
+  check(rejected(magic + u32(4) + u32(2) + u32(2) + u32(0) + u32(0) + u32(1) +
+                 u32(0) + u32(1) + u32(1)),
+        "RLE read rejects touching runs");
+  check(rejected(magic + u32(4) + u32(2) + u32(1) + u32(0)),
+        "RLE read rejects a truncated file");
+}
+
+void checkMontage() {
+  // Slices of different shapes, each with a mask over its left half
+  struct Slice {
+    std::string name;
+    int width;
+    int height;
+    std::vector<uint16_t> pixels;
+    std::vector<uint8_t> mask;
+  };
+  std::vector<Slice> slices;
+  int shapes[3][2] = {{20, 10}, {8, 8}, {7, 13}};
+  for (int i = 0; i < 3; ++i) {
+    Slice slice{"slice-" + std::to_string(i), shapes[i][0], shapes[i][1],
+                {}, {}};
+    for (int y = 0; y < slice.height; ++y) {
+      for (int x = 0; x < slice.width; ++x) {
+        slice.pixels.push_back(static_cast<uint16_t>(100 * i + 7 * x + y));
+        slice.mask.push_back(x < slice.width / 2);
+      }
+    }
+    slices.push_back(slice);
+  }
+
+  const int tile = 16;
+  montage::Montage sheet(slices.size(), tile);
+  // Drawn out of order, as the workers finish them
+  for (size_t cell : {2, 0, 1}) {
+    const Slice &slice = slices[cell];
+    sheet.addSlice(cell, slice.name, slice.pixels.data(), slice.width,
+                   slice.height, slice.mask.data(), slice.width,
+                   slice.height);
+  }
+  std::string path = (std::filesystem::temp_directory_path() /
+                      ("test_kernels_" + std::to_string(::getpid()) + ".tsv"))
+                         .string();
+  sheet.writeIndex(path);
+  std::vector<montage::Entry> entries = montage::readIndex(path);
+  std::remove(path.c_str());
+  check(entries.size() == slices.size(), "montage index has every slice");
+
+  int columns = sheet.getWidth() / (2 * tile);
+  for (size_t cell = 0; cell < entries.size() && cell < slices.size();
+       ++cell) {
+    const montage::Entry &entry = entries[cell];
+    const Slice &slice = slices[cell];
+    std::string what = "montage " + slice.name;
+    check(entry.slice == slice.name, what + " index order");
+    int cellX = static_cast<int>(cell) % columns * 2 * tile;
+    int cellY = static_cast<int>(cell) / columns * tile;
+    check(entry.originalX >= cellX && entry.originalY >= cellY &&
+              entry.originalX + entry.width <= cellX + tile &&
+              entry.originalY + entry.height <= cellY + tile &&
+              entry.overlayX == entry.originalX + tile,
+          what + " crop lies in its own cell");
+    check(std::max(entry.width, entry.height) == tile,
+          what + " scaled to the tile");
+
+    // The crop is the slice, sampled to the crop size and stretched to
+    // 0-255, and its overlay has the masked half blended towards red
+    auto range = std::minmax_element(slice.pixels.begin(), slice.pixels.end());
+    std::vector<uint8_t> original = montage::crop(
+        sheet.data(), sheet.getWidth(), entry.originalX, entry.originalY,
+        entry.width, entry.height);
+    std::vector<uint8_t> overlay =
+        montage::crop(sheet.data(), sheet.getWidth(), entry.overlayX,
+                      entry.overlayY, entry.width, entry.height);
+    bool same = true;
+    bool blended = true;
+    for (int y = 0; y < entry.height; ++y) {
+      for (int x = 0; x < entry.width; ++x) {
+        int sx = x * slice.width / entry.width;
+        int sy = y * slice.height / entry.height;
+        size_t source = static_cast<size_t>(sy) * slice.width + sx;
+        int grey = static_cast<int>(
+            std::lround(255.0 * (slice.pixels[source] - *range.first) /
+                        (*range.second - *range.first)));
+        size_t at = (static_cast<size_t>(y) * entry.width + x) * 3;
+        same = same && std::abs(original[at] - grey) <= 1 &&
+               original[at] == original[at + 1] &&
+               original[at] == original[at + 2];
+        bool red = overlay[at] > overlay[at + 1];
+        blended = blended && red == (slice.mask[source] != 0) &&
+                  (red || overlay[at] == original[at]);
+      }
+    }
+    check(same, what + " original crop");
+    check(blended, what + " overlay crop");
+  }
+}
+
+// Explicit VR little-endian Part 10 writer for hand-made slices
+struct DicomWriter {
+  std::vector<uint8_t> bytes = std::vector<uint8_t>(128, 0);
+
+  void u16(uint16_t value) {
+    bytes.push_back(static_cast<uint8_t>(value));
+    bytes.push_back(static_cast<uint8_t>(value >> 8));
+  }
+  void u32(uint32_t value) {
+    u16(static_cast<uint16_t>(value));
+    u16(static_cast<uint16_t>(value >> 16));
+  }
+  void tag(uint32_t tag) {
+    u16(static_cast<uint16_t>(tag >> 16));
+    u16(static_cast<uint16_t>(tag));
+  }
+  void text(uint32_t t, const char *vr, std::string value) {
+    if (value.size() % 2) {
+      value.push_back(vr[0] == 'U' ? '\0' : ' ');
+    }
+    tag(t);
+    bytes.push_back(vr[0]);
+    bytes.push_back(vr[1]);
+    u16(static_cast<uint16_t>(value.size()));
+    bytes.insert(bytes.end(), value.begin(), value.end());
+  }
+  void us(uint32_t t, uint16_t value) {
+    tag(t);
+    bytes.push_back('U');
+    bytes.push_back('S');
+    u16(2);
+    u16(value);
+  }
+};
+
+// A 16-bit RLE Lossless slice: both byte planes as literal PackBits runs
+std::vector<uint8_t> rleSlice(const std::vector<uint16_t> &pixels, int width,
+                              int height, const std::string &photometric,
+                              int bitsStored, int highBit, bool isSigned) {
+  DicomWriter out;
+  out.bytes.insert(out.bytes.end(), {'D', 'I', 'C', 'M'});
+  out.text(0x00020010, "UI", dicom::RLE_LOSSLESS);
+  out.us(0x00280002, 1);
+  out.text(0x00280004, "CS", photometric);
+  out.us(0x00280010, static_cast<uint16_t>(height));
+  out.us(0x00280011, static_cast<uint16_t>(width));
+  out.us(0x00280100, 16);
+  out.us(0x00280101, static_cast<uint16_t>(bitsStored));
+  out.us(0x00280102, static_cast<uint16_t>(highBit));
+  out.us(0x00280103, isSigned ? 1 : 0);
+
+  std::vector<uint8_t> segments[2];
+  for (int plane = 0; plane < 2; ++plane) {
+    for (size_t i = 0; i < pixels.size(); i += 128) {
+      size_t count = std::min<size_t>(128, pixels.size() - i);
+      segments[plane].push_back(static_cast<uint8_t>(count - 1));
+      for (size_t k = 0; k < count; ++k) {
+        segments[plane].push_back(
+            static_cast<uint8_t>(pixels[i + k] >> (plane == 0 ? 8 : 0)));
+      }
+    }
+  }
+  std::vector<uint8_t> frame(64, 0);
+  uint32_t header[3] = {2, 64,
+                        64 + static_cast<uint32_t>(segments[0].size())};
+  for (int i = 0; i < 3; ++i) {
+    for (int b = 0; b < 4; ++b) {
+      frame[4 * i + b] = static_cast<uint8_t>(header[i] >> (8 * b));
+    }
+  }
+  frame.insert(frame.end(), segments[0].begin(), segments[0].end());
+  frame.insert(frame.end(), segments[1].begin(), segments[1].end());
+  if (frame.size() % 2) {
+    frame.push_back(0);
+  }
+
+  out.tag(0x7FE00010);
+  out.bytes.insert(out.bytes.end(), {'O', 'B', 0, 0});
+  out.u32(0xFFFFFFFF);
+  out.tag(0xFFFEE000); // empty basic offset table
+  out.u32(0);
+  out.tag(0xFFFEE000);
+  out.u32(static_cast<uint32_t>(frame.size()));
+  out.bytes.insert(out.bytes.end(), frame.begin(), frame.end());
+  out.tag(0xFFFEE0DD);
+  out.u32(0);
+  return out.bytes;
+}
+
+std::vector<uint16_t> samples(const dicom::DecodedImage &image) {
+  std::vector<uint16_t> values(image.pixels.size() / 2);
+  for (size_t i = 0; i < values.size(); ++i) {
+    values[i] = static_cast<uint16_t>(image.pixels[2 * i] |
+                                      (image.pixels[2 * i + 1] << 8));
+  }
+  return values;
+}
+
+bool refused(const std::vector<uint8_t> &file) {
+  try {
+    dicom::decode(file);
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+void checkResume() {
+  std::string path = (std::filesystem::temp_directory_path() /
+                      ("test_kernels_journal_" + std::to_string(::getpid()) +
+                       ".tsv"))
+                         .string();
+  std::vector<std::string> slices = {"1-01", "1-02", "1-03", "1-04"};
+  {
+    // Interrupted halfway through the first patient; the second finished
+    RunJournal journal(path, false);
+    journal.markCompleted("PGBM-001", slices[0], "hash");
+    journal.markCompleted("PGBM-001", slices[1], "hash");
+    for (const auto &slice : slices) {
+      journal.markCompleted("PGBM-002", slice, "hash");
+    }
+    journal.flush();
+  }
+  RunJournal journal(path, true);
+  std::remove(path.c_str());
+
+  std::vector<size_t> perSlice =
+      journal.unfinished("PGBM-001", slices, "hash", false);
+  check(perSlice == std::vector<size_t>({2, 3}),
+        "resume redoes only the unfinished slices");
+  check(journal.unfinished("PGBM-001", slices, "other", false).size() ==
+            slices.size(),
+        "resume redoes slices recorded with other parameters");
+
+  std::vector<size_t> whole =
+      journal.unfinished("PGBM-001", slices, "hash", true);
+  check(whole == std::vector<size_t>({0, 1, 2, 3}),
+        "resume redoes a half-finished montage patient from the start");
+  check(journal.unfinished("PGBM-002", slices, "hash", true).empty(),
+        "resume skips a finished montage patient");
+
+  // The rebuilt montage has a cell for every slice, not just the
+  // unfinished ones
+  const int size = 4;
+  std::vector<uint16_t> pixels(size * size, 1);
+  std::vector<uint8_t> mask(size * size, 1);
+  montage::Montage sheet(slices.size(), 8);
+  for (size_t cell : whole) {
+    sheet.addSlice(cell, slices[cell], pixels.data(), size, size, mask.data(),
+                   size, size);
+  }
+  std::string indexPath = path + ".index";
+  sheet.writeIndex(indexPath);
+  std::vector<montage::Entry> entries = montage::readIndex(indexPath);
+  std::remove(indexPath.c_str());
+  check(entries.size() == slices.size(),
+        "resumed montage indexes every slice");
+}
+
+void checkDecoder() {
+  const int w = 20;
+  const int h = 15;
+  // 12-bit values with junk in the top four bits
+  std::vector<uint16_t> pixels(w * h);
+  std::vector<uint16_t> stored(w * h);
+  for (size_t i = 0; i < pixels.size(); ++i) {
+    stored[i] = static_cast<uint16_t>((i * 37) & 0x0FFF);
+    pixels[i] = static_cast<uint16_t>(stored[i] | 0xA000);
+  }
+  std::vector<uint8_t> file =
+      rleSlice(pixels, w, h, "MONOCHROME2", 12, 11, false);
+  dicom::Header header = dicom::readHeader(file.data(), file.size());
+  check(header.transferSyntax == dicom::RLE_LOSSLESS && header.rows == h &&
+            header.columns == w,
+        "DICOM header syntax, rows and columns");
+  dicom::DecodedImage image = dicom::decode(file);
+  check(image.width == w && image.height == h, "RLE decoded size");
+  check(samples(image) == stored, "RLE decode keeps the BitsStored bits");
+
+  // Signed 12-bit samples are sign-extended from bit 11
+  std::vector<uint16_t> negative = {0x0800, 0x0FFF, 0x07FF, 0xF001};
+  negative.resize(w * h, 0x0000);
+  image = dicom::decode(rleSlice(negative, w, h, "MONOCHROME2", 12, 11, true));
+  std::vector<uint16_t> values = samples(image);
+  check(static_cast<int16_t>(values[0]) == -2048 &&
+            static_cast<int16_t>(values[1]) == -1 && values[2] == 0x07FF &&
+            values[3] == 1,
+        "signed samples sign-extended from BitsStored");
+
+  check(refused(rleSlice(pixels, w, h, "MONOCHROME1", 12, 11, false)),
+        "MONOCHROME1 left to the importer");
+  check(refused(rleSlice(pixels, w, h, "MONOCHROME2", 12, 15, false)),
+        "HighBit above BitsStored left to the importer");
+
+  // Lengths that run past the end of the data are refused rather than
+  // read; each prefix is its own allocation so a sanitizer build sees any
+  // overread
+  bool truncatedRefused = true;
+  for (size_t size = 0; size < file.size(); ++size) {
+    std::vector<uint8_t> prefix(file.begin(), file.begin() + size);
+    dicom::readHeader(prefix.data(), prefix.size());
+    truncatedRefused = truncatedRefused && refused(prefix);
+  }
+  check(truncatedRefused, "every truncation of a slice refused");
+
+  // The frame's item length is the u32 after the second item tag (the
+  // first is the offset table); make it claim more than the file holds
+  std::vector<uint8_t> longFragment = file;
+  static const uint8_t itemTag[] = {0xFE, 0xFF, 0x00, 0xE0};
+  auto item = std::search(longFragment.begin(), longFragment.end(),
+                          std::begin(itemTag), std::end(itemTag));
+  item = std::search(item + 1, longFragment.end(), std::begin(itemTag),
+                     std::end(itemTag));
+  for (int b = 0; b < 4; ++b) {
+    item[4 + b] = 0xF0;
+  }
+  check(refused(longFragment), "fragment longer than the file refused");
+
+  DicomWriter badSyntax;
+  badSyntax.bytes.insert(badSyntax.bytes.end(), {'D', 'I', 'C', 'M'});
+  badSyntax.tag(0x00020010);
+  badSyntax.bytes.insert(badSyntax.bytes.end(), {'U', 'I'});
+  badSyntax.u16(0x4000);
+  badSyntax.bytes.insert(badSyntax.bytes.end(), {'1', '.', '2'});
+  check(dicom::readTransferSyntax(badSyntax.bytes.data(),
+                                  badSyntax.bytes.size())
+            .empty(),
+        "transfer syntax longer than the file ignored");
+
+  DicomWriter shortValue;
+  shortValue.bytes = rleSlice(pixels, w, h, "MONOCHROME2", 12, 11, false);
+  // Rows with an empty value instead of its 2 bytes
+  static const uint8_t rowsTag[] = {0x28, 0x00, 0x10, 0x00, 'U', 'S', 2, 0};
+  auto rows = std::search(shortValue.bytes.begin(), shortValue.bytes.end(),
+                          std::begin(rowsTag), std::end(rowsTag));
+  rows[6] = 0;
+  shortValue.bytes.erase(rows + 8, rows + 10);
+  check(refused(shortValue.bytes), "US element shorter than 2 bytes refused");
+}
+
+// SeededRegionGrowing's flood: every seed is foreground, and in-range
+// 8-neighbours of foreground pixels join it
+std::vector<uint8_t> floodFill(const std::vector<float> &image, int w, int h,
+                               float minimum, float maximum,
+                               const std::vector<regiongrow::Seed> &seeds) {
+  std::vector<uint8_t> mask(image.size(), 0);
+  std::vector<regiongrow::Seed> stack(seeds);
+  while (!stack.empty()) {
+    regiongrow::Seed p = stack.back();
+    stack.pop_back();
+    mask[static_cast<size_t>(p.y) * w + p.x] = 1;
+    for (int dy = -1; dy <= 1; ++dy) {
+      for (int dx = -1; dx <= 1; ++dx) {
+        int x = p.x + dx;
+        int y = p.y + dy;
+        if (x < 0 || x >= w || y < 0 || y >= h) {
+          continue;
+        }
+        size_t i = static_cast<size_t>(y) * w + x;
+        if (!mask[i] && image[i] >= minimum && image[i] <= maximum) {
+          mask[i] = 1;
+          stack.push_back({x, y});
+        }
+      }
+    }
+  }
+  return mask;
+}
+
+void checkRegionGrowing() {
+  const int w = 97;
+  const int h = 61;
+  const float minimum = 0.4f;
+  const float maximum = 0.95f;
+  std::vector<float> image(static_cast<size_t>(w) * h);
+  uint32_t state = 7;
+  for (float &value : image) {
+    state = state * 1664525u + 1013904223u;
+    value = static_cast<float>(state >> 8) / static_cast<float>(1u << 24);
+  }
+  // In-range seeds, out-of-range seeds (below and above the range) and
+  // corners
+  std::vector<regiongrow::Seed> seeds = {{0, 0}, {w - 1, h - 1}};
+  for (int y = 5; y < h; y += 11) {
+    for (int x = 3; x < w; x += 13) {
+      seeds.push_back({x, y});
+    }
+  }
+  image[static_cast<size_t>(seeds[2].y) * w + seeds[2].x] = 0.1f;
+  image[static_cast<size_t>(seeds[3].y) * w + seeds[3].x] = 0.99f;
+  image[static_cast<size_t>(seeds[4].y) * w + seeds[4].x] = 0.5f;
+
+  std::vector<uint8_t> expected =
+      floodFill(image, w, h, minimum, maximum, seeds);
+  for (int tile : {1, 7, 16, regiongrow::DEFAULT_TILE_SIZE}) {
+    for (int threads : {1, 3}) {
+      std::vector<uint8_t> grown = regiongrow::grow(
+          image.data(), w, h, minimum, maximum, seeds, threads, tile);
+      check(grown == expected, "tiled region growing matches the flood, tile " +
+                                   std::to_string(tile) + ", " +
+                                   std::to_string(threads) + " thread(s)");
+    }
+  }
+
+  // A lone out-of-range seed is foreground by itself
+  std::vector<float> flat(16, 0.0f);
+  std::vector<uint8_t> lone =
+      regiongrow::grow(flat.data(), 4, 4, 1.0f, 2.0f, {{1, 2}});
+  check(std::count(lone.begin(), lone.end(), 1) == 1 && lone[2 * 4 + 1] == 1,
+        "out-of-range seed is foreground on its own");
+
+  bool threw = false;
+  try {
+    regiongrow::grow(flat.data(), 4, 4, 0.0f, 1.0f, {{4, 0}});
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  check(threw, "seed outside the image refused");
+}
+
+void checkStageGraph() {
+  StageGraph<int> graph;
+  int runs = 0;
+  auto input = graph.add("input", {}, [&](const auto &) {
+    runs++;
+    return 3;
+  });
+  auto scale = [&](int factor) {
+    return [&runs, factor](const std::vector<int> &in) {
+      runs++;
+      return in[0] * factor;
+    };
+  };
+  auto doubled = graph.share("scale", "scale 2", {input}, scale(2));
+  auto again = graph.share("scale", "scale 2", {input}, scale(2));
+  auto tripled = graph.share("scale", "scale 3", {input}, scale(3));
+  check(again == doubled, "same operation on the same input is shared");
+  check(tripled != doubled, "different parameters are a separate stage");
+  check(graph.size() == 3, "shared stage added once");
+
+  auto sum = graph.add("sum", {doubled, again, tripled},
+                       [&](const std::vector<int> &in) {
+                         runs++;
+                         return in[0] + in[1] + in[2];
+                       });
+  graph.request(sum);
+  std::vector<size_t> ran = graph.update();
+  check(graph.get(sum) == 6 + 6 + 9, "graph output through shared stage");
+  check(ran.size() == 4 && runs == 4, "shared stage computed once");
+
+  graph.invalidate(doubled);
+  runs = 0;
+  ran = graph.update();
+  check(ran.size() == 2 && runs == 2 && !graph.isDirty(tripled),
+        "invalidating a shared stage reruns it and its consumers only");
+
+  bool threw = false;
+  try {
+    graph.add("scale", {input}, scale(4));
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  check(threw, "add() refuses a name its inputs already feed");
+  threw = false;
+  try {
+    graph.add("sum", {doubled, again, tripled},
+              [](const std::vector<int> &) { return 0; });
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  check(threw, "add() never returns an existing stage");
+  check(graph.size() == 4, "refused stages are not added");
+}
+
+} // namespace
+
+int main() {
+  checkHistograms();
+  checkTransform();
+  checkDecoder();
+  checkRleMasks();
+  checkMontage();
+  checkResume();
+  checkRegionGrowing();
+  checkStageGraph();
+  if (failures) {
+    std::cout << failures << " check(s) failed" << std::endl;
+    return 1;
+  }
+  std::cout << "All checks passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,378 @@
+#include "FAST/FAST_directives.hpp"
+#include "image_metrics.hpp"
+#include "segmentation_pipeline.hpp"
+#include "synthetic_slices.hpp"
+#include "thread_config.hpp"
+#include "timing_report.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace fast;
+
+// Performance regression gate.
+// Runs the reference pipeline end to end on synthetic slices and compares
+// throughput and the per-stage medians against a baseline file. Fails when
+// throughput drops, or a stage's median grows, by more than the tolerance.
+// Baselines are machine specific, so ctest keeps one per build tree: when
+// the baseline file is missing or holds no values, the run is recorded as
+// the baseline and every later run is compared against it. Rebase it with
+// --update-baseline (or by deleting the file) after an intended change.
+//
+// With --quality-sweep it instead runs every --quality level and reports
+// throughput gain and Dice loss against the full pipeline. --propagation
+// runs a smoothly varying series (makeSeriesSlice) with seeds propagated
+// from slice to slice and reports speed and Dice against independent
+// seeding. --threading MODE
+// runs the slices on --threads workers the way img_processing_parallel does
+// in that mode and reports throughput; the runtime pool is sized once per
+// process, so compare the modes with one run each.
+//
+// Usage: test_performance --baseline FILE [--tolerance PERCENT]
+//                         [--slices N] [--update-baseline]
+//        test_performance --quality-sweep [--slices N]
+//        test_performance --propagation [--slices N]
+//        test_performance --threading independent|shared [--threads N]
+//                         [--slices N]
+
+// Stage differences smaller than this are timer noise, whatever the ratio
+constexpr double NOISE_FLOOR_MS = 0.2;
+
+const std::vector<Stage> GATED_STAGES = {Stage::Normalize, Stage::Clip,
+                                         Stage::Median,    Stage::Sharpen,
+                                         Stage::RegionGrowing,
+                                         Stage::PostProcess};
+
+// "key value" lines; '#' starts a comment
+std::map<std::string, double> readBaseline(const std::string &path) {
+  std::map<std::string, double> values;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line)) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream fields(line);
+    std::string key;
+    double value;
+    if (fields >> key >> value) {
+      values[key] = value;
+    }
+  }
+  return values;
+}
+
+void writeBaseline(const std::string &path,
+                   const std::map<std::string, double> &values, int slices) {
+  std::ofstream out(path);
+  out << "# Performance baseline for test_performance (" << slices
+      << " synthetic slices).\n"
+      << "# Recorded on this machine; rebase with --update-baseline.\n"
+      << "# throughput is slices/s, stage entries are median ms per slice.\n";
+  out << std::fixed << std::setprecision(3);
+  for (const auto &[key, value] : values) {
+    out << key << " " << value << "\n";
+  }
+  if (!out) {
+    throw std::runtime_error("Failed to write baseline " + path);
+  }
+}
+
+// Throughput and mask agreement of each quality level relative to Full
+int qualitySweep(const std::vector<Image::pointer> &slices) {
+  const Quality levels[] = {Quality::Full, Quality::Balanced,
+                            Quality::Preview};
+  std::vector<std::vector<float>> fullMasks;
+  double fullThroughput = 0.0;
+
+  std::cout << "\n=== Quality sweep: " << slices.size()
+            << " slice(s) ===\n"
+            << std::left << std::setw(12) << "quality" << std::right
+            << std::setw(12) << "slices/s" << std::setw(10) << "gain"
+            << std::setw(12) << "mean Dice" << std::setw(12) << "min Dice"
+            << std::setw(14) << "Dice loss" << "\n"
+            << std::fixed << std::setprecision(3);
+  for (Quality quality : levels) {
+    PipelineParams params = PipelineParams::forQuality(quality);
+    runReferencePipeline(slices[0], params); // warm-up
+
+    std::vector<std::vector<float>> masks;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &slice : slices) {
+      masks.push_back(imageToFloats(runReferencePipeline(slice, params).mask));
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    double throughput = slices.size() / seconds;
+
+    if (quality == Quality::Full) {
+      fullMasks = masks;
+      fullThroughput = throughput;
+    }
+    double sum = 0.0;
+    double worst = 1.0;
+    for (size_t i = 0; i < masks.size(); ++i) {
+      double dice = compareMasks(fullMasks[i], masks[i]).dice;
+      sum += dice;
+      worst = std::min(worst, dice);
+    }
+    double mean = sum / masks.size();
+    std::cout << std::left << std::setw(12) << qualityName(quality)
+              << std::right << std::setw(12) << throughput << std::setw(9)
+              << throughput / fullThroughput << "x" << std::setw(12) << mean
+              << std::setw(12) << worst << std::setw(14) << 1.0 - mean
+              << "\n";
+  }
+  std::cout << std::flush;
+  return 0;
+}
+
+// Speed and mask agreement of seed propagation relative to independent
+// seeding, over the slices taken as one series
+int propagationComparison(const std::vector<Image::pointer> &slices) {
+  PipelineParams params = PipelineParams::reference();
+  runReferencePipeline(slices[0], params); // warm-up
+
+  std::vector<std::vector<float>> masks[2];
+  double seconds[2];
+  double regionMs[2];
+  size_t seeds = 0;
+  size_t propagatedSlices = 0;
+  for (int mode = 0; mode < 2; ++mode) {
+    TimingReport timing(1);
+    propagation::Propagation previous;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &slice : slices) {
+      PipelineStages stages = runReferencePipeline(
+          slice, params, &timing, 0, mode == 1 ? &previous : nullptr);
+      if (mode == 1) {
+        if (!previous.empty()) {
+          seeds += previous.seeds.size();
+          propagatedSlices++;
+        }
+        previous = propagationFromMask(stages.mask);
+      }
+      masks[mode].push_back(imageToFloats(stages.mask));
+    }
+    seconds[mode] = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+    regionMs[mode] = timing.median(Stage::RegionGrowing);
+  }
+
+  double sum = 0.0;
+  double worst = 1.0;
+  for (size_t i = 0; i < slices.size(); ++i) {
+    double dice = compareMasks(masks[0][i], masks[1][i]).dice;
+    sum += dice;
+    worst = std::min(worst, dice);
+  }
+  size_t fixedSeeds =
+      seedPoints(slices[0]->getWidth(), slices[0]->getHeight(), params).size();
+  std::cout << "\n=== Seed propagation: " << slices.size()
+            << " slice(s) as one series ===\n"
+            << std::left << std::setw(14) << "seeding" << std::right
+            << std::setw(12) << "slices/s" << std::setw(16)
+            << "region ms" << std::setw(12) << "seeds" << "\n"
+            << std::fixed << std::setprecision(3) << std::left
+            << std::setw(14) << "independent" << std::right << std::setw(12)
+            << slices.size() / seconds[0] << std::setw(16) << regionMs[0]
+            << std::setw(12) << static_cast<double>(fixedSeeds) << "\n"
+            << std::left << std::setw(14) << "propagated" << std::right
+            << std::setw(12) << slices.size() / seconds[1] << std::setw(16)
+            << regionMs[1] << std::setw(12)
+            << static_cast<double>(seeds) / std::max<size_t>(1, propagatedSlices)
+            << "\n"
+            << "Speedup " << seconds[0] / seconds[1] << "x (region growing "
+            << regionMs[0] / std::max(1e-9, regionMs[1]) << "x), "
+            << propagatedSlices << "/" << slices.size()
+            << " slice(s) propagated, Dice vs independent: mean "
+            << sum / slices.size() << ", min " << worst << std::endl;
+  return 0;
+}
+
+// Throughput of `workers` threads sharing the slices, with FAST updates
+// serialized on one device mutex in SharedQueue mode
+int threadingComparison(const std::vector<Image::pointer> &slices,
+                        const ThreadConfig &config, int workers) {
+  PipelineParams params = PipelineParams::reference();
+  runReferencePipeline(slices[0], params); // warm-up
+
+  std::mutex deviceMutex;
+  std::mutex *device =
+      config.mode == ThreadingMode::SharedQueue ? &deviceMutex : nullptr;
+  TimingReport timing(workers);
+  std::atomic<size_t> next{0};
+  timing.startRun();
+  std::vector<std::thread> threads;
+  for (int worker = 0; worker < workers; ++worker) {
+    threads.emplace_back([&, worker] {
+      for (size_t i = next++; i < slices.size(); i = next++) {
+        auto start = std::chrono::steady_clock::now();
+        runReferencePipeline(slices[i], params, &timing, worker, nullptr,
+                             device);
+        timing.recordSlice(worker,
+                           std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - start)
+                               .count());
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  timing.finishRun(slices.size());
+  timing.print(std::string("threading ") + threadingModeName(config.mode));
+  std::cout << "\n=== Threading mode " << threadingModeName(config.mode)
+            << ": " << workers << " worker(s), runtime threads "
+            << (config.runtimeThreads > 0
+                    ? std::to_string(config.runtimeThreads)
+                    : std::string("default"))
+            << " ===\n"
+            << std::fixed << std::setprecision(3)
+            << slices.size() / timing.wallTime() << " slices/s" << std::endl;
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  Reporter::setGlobalReportMethod(Reporter::INFO, Reporter::NONE);
+  Reporter::setGlobalReportMethod(Reporter::WARNING, Reporter::COUT);
+  Reporter::setGlobalReportMethod(Reporter::ERROR, Reporter::COUT);
+
+  std::string baselinePath;
+  double tolerance = 15.0;
+  int sliceCount = 32;
+  bool update = false;
+  bool sweep = false;
+  bool propagate = false;
+  bool threading = false;
+  ThreadingMode threadingMode = ThreadingMode::Independent;
+  int workers = 0;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--baseline" && i + 1 < argc) {
+      baselinePath = argv[++i];
+    } else if (arg == "--tolerance" && i + 1 < argc) {
+      tolerance = std::stod(argv[++i]);
+    } else if (arg == "--slices" && i + 1 < argc) {
+      sliceCount = std::stoi(argv[++i]);
+    } else if (arg == "--update-baseline") {
+      update = true;
+    } else if (arg == "--quality-sweep") {
+      sweep = true;
+    } else if (arg == "--propagation") {
+      propagate = true;
+    } else if (arg == "--threading" && i + 1 < argc) {
+      threading = true;
+      threadingMode = parseThreadingMode(argv[++i]);
+    } else if (arg == "--threads" && i + 1 < argc) {
+      workers = std::stoi(argv[++i]);
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 2;
+    }
+  }
+  if (baselinePath.empty() && !sweep && !propagate && !threading) {
+    std::cerr << "--baseline is required" << std::endl;
+    return 2;
+  }
+
+  // Like img_processing_parallel, before anything touches OpenCL
+  ThreadConfig threadConfig = thread_config::detect(workers);
+  thread_config::applyRuntimeThreadCap(threadConfig, threadingMode);
+
+  try {
+    PipelineParams params = PipelineParams::reference();
+    std::vector<Image::pointer> slices;
+    for (int i = 0; i < sliceCount; ++i) {
+      // Propagation needs neighbouring slices that look like neighbours
+      SyntheticSlice slice = propagate ? makeSeriesSlice(i, 512, 512)
+                                       : makeSyntheticSlice(i, 512, 512);
+      slices.push_back(Image::create(slice.width, slice.height, TYPE_UINT16,
+                                     1, slice.pixels.data()));
+    }
+
+    if (sweep) {
+      return qualitySweep(slices);
+    }
+    if (propagate) {
+      return propagationComparison(slices);
+    }
+    if (threading) {
+      return threadingComparison(slices, threadConfig,
+                                 threadConfig.workerThreads);
+    }
+
+    // Warm-up: the first run compiles the OpenCL kernels
+    runReferencePipeline(slices[0], params);
+
+    TimingReport timing(1);
+    timing.startRun();
+    for (const auto &slice : slices) {
+      auto start = std::chrono::steady_clock::now();
+      runReferencePipeline(slice, params, &timing, 0);
+      timing.recordSlice(0, std::chrono::duration<double, std::milli>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+    }
+    timing.finishRun(slices.size());
+    timing.print("performance gate");
+
+    std::map<std::string, double> current;
+    current["throughput"] = slices.size() / timing.wallTime();
+    for (Stage stage : GATED_STAGES) {
+      current[stageName(stage)] = timing.median(stage);
+    }
+
+    std::map<std::string, double> baseline = readBaseline(baselinePath);
+    if (update || baseline.empty()) {
+      // Nothing to compare against yet: this run becomes the baseline
+      writeBaseline(baselinePath, current, sliceCount);
+      std::cout << "Baseline written to " << baselinePath
+                << "; later runs are compared against it" << std::endl;
+      return 0;
+    }
+
+    double allowed = 1.0 + tolerance / 100.0;
+    bool passed = true;
+    std::cout << "\n=== Regression gate (tolerance " << tolerance
+              << "%) ===\n"
+              << std::left << std::setw(16) << "metric" << std::right
+              << std::setw(12) << "baseline" << std::setw(12) << "current"
+              << std::setw(10) << "change" << "  result\n"
+              << std::fixed << std::setprecision(2);
+    for (const auto &[key, value] : current) {
+      auto it = baseline.find(key);
+      if (it == baseline.end() || it->second <= 0.0) {
+        continue;
+      }
+      double base = it->second;
+      bool regressed;
+      if (key == "throughput") {
+        regressed = value * allowed < base;
+      } else {
+        regressed = value > base * allowed && value - base > NOISE_FLOOR_MS;
+      }
+      passed = passed && !regressed;
+      std::cout << std::left << std::setw(16) << key << std::right
+                << std::setw(12) << base << std::setw(12) << value
+                << std::setw(9) << (value / base - 1.0) * 100.0 << "%  "
+                << (regressed ? "REGRESSED" : "ok") << "\n";
+    }
+    std::cout << std::flush;
+    return passed ? 0 : 1;
+
+  } catch (const std::exception &e) {
+    std::cerr << "Fatal error: " << e.what() << std::endl;
+    return 2;
+  }
+}
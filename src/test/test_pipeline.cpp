@@ -1,8 +1,33 @@
 #include "FAST/FAST_directives.hpp"
+#include "pipeline_params.hpp"
+#include "segmentation_pipeline.hpp"
+#include "stage_graph.hpp"
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
 #include <sys/types.h>
+#include <vector>
 
 using namespace fast;
 
+// Usage: test_pipeline [--adjustments N] [--outputs NAME[,NAME...]]
+//
+// Every stage is a node of a StageGraph holding its last output. The sliders
+// under the views change one parameter each; only the stage reading it and
+// the stages after it are recomputed, on the cached upstream images, and
+// the time each adjustment took is printed. --adjustments N skips the
+// window and times N region growing threshold adjustments instead.
+// --outputs picks the views shown and exported (original_image,
+// preprocessed_image, segmentation, erosion_result, final_dilated_result;
+// default all); stages none of them need are never computed.
+
+using ImageGraph = StageGraph<Image::pointer>;
+
 // == Export Stage Helper Function ==
 void exportImages(
     const std::string &outputPath, std::shared_ptr<RenderToImage> renderToImage,
@@ -26,7 +51,61 @@ void exportImages(
   }
 }
 
+// Runs a filter on one image and returns its output
+template <typename Filter>
+Image::pointer runFilter(std::shared_ptr<Filter> filter, Image::pointer input) {
+  filter->connect(input);
+  filter->update();
+  return filter->template getOutputData<Image>(0);
+}
+
+// Recomputes the dirty stages, hands the new outputs to the renderers showing
+// them and reports what the adjustment cost
+double refresh(
+    ImageGraph &graph,
+    const std::vector<std::pair<ImageGraph::StageId, std::shared_ptr<Renderer>>>
+        &views,
+    const std::string &reason) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<ImageGraph::StageId> recomputed = graph.update();
+  for (const auto &[stage, renderer] : views) {
+    if (std::find(recomputed.begin(), recomputed.end(), stage) !=
+        recomputed.end()) {
+      renderer->connect(graph.get(stage));
+    }
+  }
+  double ms = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+
+  std::cout << reason << ": recomputed";
+  for (ImageGraph::StageId stage : recomputed) {
+    std::cout << " " << graph.name(stage) << " (" << std::fixed
+              << std::setprecision(1) << graph.milliseconds(stage) << " ms)";
+  }
+  std::cout << " in " << ms << " ms" << std::endl;
+  return ms;
+}
+
 int main(int argc, char **argv) {
+  int adjustments = 0;
+  std::vector<std::string> outputs;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--adjustments" && i + 1 < argc) {
+      adjustments = std::stoi(argv[++i]);
+    } else if (arg == "--outputs" && i + 1 < argc) {
+      std::istringstream names(argv[++i]);
+      std::string name;
+      while (std::getline(names, name, ',')) {
+        outputs.push_back(name);
+      }
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 2;
+    }
+  }
+
   // Define the DICOM File Importer and point to T1C Brain Tumor Dataset .dcm
   // file for testing
   // 1. == Input/Import Stage ==
@@ -50,112 +129,200 @@ int main(int argc, char **argv) {
   int width = importedImage->getWidth();
   int height = importedImage->getHeight();
 
+  // Stage parameters; the sliders below write into these
+  PipelineParams params = PipelineParams::reference();
+  int erosionSize = 3;
+
+  ImageGraph graph;
+  auto input = graph.add("input", {}, [&](const auto &) {
+    return importedImage;
+  });
+
   // 2. == Image Preprocessing Stage ==
   // 1. Intensity Normalization
-  auto normalize = IntensityNormalization::create(0.5f, 2.5f, 0.0f, 10000.0f);
-  normalize->connect(importer);
-  normalize->update();
+  auto normalized = graph.add("normalize", {input}, [&](const auto &in) {
+    return runFilter(IntensityNormalization::create(
+                         params.normalizeLowest, params.normalizeHighest,
+                         params.normalizeMinIntensity,
+                         params.normalizeMaxIntensity),
+                     in[0]);
+  });
 
   // 2. Intensity Clipping
-  auto clipping = IntensityClipping::create(0.68f, 4000.0f);
-  clipping->connect(normalize);
-  clipping->update();
+  auto clipped = graph.add("clip", {normalized}, [&](const auto &in) {
+    return runFilter(IntensityClipping::create(params.clipMin, params.clipMax),
+                     in[0]);
+  });
 
   // 3. VMF Filter (Denoise, and preserves edges)
-  auto medianfilter = VectorMedianFilter::create(
-      7); // Updated filter size to 7 from main_sequential
-  medianfilter->connect(clipping);
-  medianfilter->update();
+  auto median = graph.add("median", {clipped}, [&](const auto &in) {
+    return runFilter(VectorMedianFilter::create(params.medianSize), in[0]);
+  });
 
   // 4. Sharpen (Sharpen edges)
-  auto sharpen = ImageSharpening::create(2.0f, 0.5f, 9);
-  sharpen->connect(medianfilter);
-  sharpen->update();
+  auto sharpened = graph.add("sharpen", {median}, [&](const auto &in) {
+    return runFilter(ImageSharpening::create(params.sharpenGain,
+                                             params.sharpenStdDev,
+                                             params.sharpenMaskSize),
+                     in[0]);
+  });
 
   // =============================================================
 
   // 3. == Segmentation Stage ==
-  // Calculate center and adjust seed points based on image dimensions
-  int centerX = width / 2;
-  int centerY = height / 2;
-
-  // Create seed points relative to center
-  std::vector<Vector3i> seedPoints;
-
-  // Add central seed point
-  seedPoints.push_back(Vector3i(centerX, centerY, 0));
-
-  // Add seed points around center
-  int offsetX = width / 8;
-  int offsetY = height / 8;
-
-  seedPoints.push_back(Vector3i(centerX + offsetX, centerY, 0));
-  seedPoints.push_back(Vector3i(centerX - offsetX, centerY, 0));
-  seedPoints.push_back(Vector3i(centerX, centerY + offsetY, 0));
-  seedPoints.push_back(Vector3i(centerX, centerY - offsetY, 0));
-
-  // SeededRegionGrowing Segmentation with adaptive seed points
-  auto regionGrowing = SeededRegionGrowing::create(0.74f, 0.91f, seedPoints);
-  regionGrowing->connect(sharpen);
-
-  // Add additional seed points in a grid pattern
-  for (int x = width / 4; x < width * 3 / 4; x += width / 10) {
-    for (int y = height / 4; y < height * 3 / 4; y += height / 10) {
-      regionGrowing->addSeedPoint(x, y);
-    }
-  }
-
-  regionGrowing->update();
+  // Five seeds around the centre plus the grid over the central half (see
+  // seedPoints)
+  auto regions = graph.add("region growing", {sharpened},
+                           [&](const auto &in) {
+                             return growRegions(in[0], params);
+                           });
 
   // =============================================================
 
   // 4. == Post-Processing Stage ==
   // Cast to uint8 for morphology operations
-  auto caster = ImageCaster::create(TYPE_UINT8);
-  caster->connect(regionGrowing);
-  caster->update();
+  auto mask = graph.add("cast", {regions}, [&](const auto &in) {
+    return resizeMask(in[0], width, height);
+  });
 
-  // Morphological operations to clean up segmentation
-  auto erosion = Erosion::create(3);
-  erosion->connect(caster);
-  erosion->update();
+  // Morphological operations to clean up segmentation. Dilation works on
+  // the cast mask, as in the production pipeline, so erosion only feeds its
+  // own view and is dead when that view is not selected.
+  auto eroded = graph.add("erosion", {mask}, [&](const auto &in) {
+    return runFilter(Erosion::create(erosionSize), in[0]);
+  });
 
-  auto dilation = Dilation::create(3);
-  dilation->connect(caster);
-  dilation->update();
+  auto dilated = graph.add("dilation", {mask}, [&](const auto &in) {
+    return runFilter(Dilation::create(params.dilationSize), in[0]);
+  });
 
   // =============================================================
 
   // 5. == Visualization Stage ==
-  LabelColors labelColors;
-  labelColors[1] = Color::White();
-
-  auto original = ImageRenderer::create()->connect(importer);
-  auto prefilter = ImageRenderer::create()->connect(sharpen);
-
-  auto segmentationRenderer =
-      SegmentationRenderer::create(labelColors, 0.6f, 1.0f, 2)
-          ->connect(regionGrowing);
+  // Each view is shown in the window and exported under its name. Only the
+  // stages the selected views need are ever computed.
+  struct View {
+    std::string name;
+    ImageGraph::StageId stage;
+    bool segmentation;
+  };
+  std::vector<View> views;
+  for (const View &view : std::vector<View>{
+           {"original_image", input, false},
+           {"preprocessed_image", sharpened, false},
+           {"segmentation", regions, true},
+           {"erosion_result", eroded, true},
+           // This will be the final segegmented result that will get
+           // exported into /out
+           {"final_dilated_result", dilated, true}}) {
+    if (outputs.empty() ||
+        std::find(outputs.begin(), outputs.end(), view.name) !=
+            outputs.end()) {
+      views.push_back(view);
+      graph.request(view.stage);
+    }
+  }
+  if (views.empty()) {
+    std::cerr << "No known view in --outputs" << std::endl;
+    return 2;
+  }
+  for (ImageGraph::StageId stage : graph.deadStages()) {
+    std::cout << "Skipping " << graph.name(stage)
+              << ": no selected view needs it" << std::endl;
+  }
 
-  auto erosion_render = SegmentationRenderer::create(labelColors, 0.6f, 1.0f, 2)
-                            ->connect(erosion);
+  refresh(graph, {}, "Initial run");
 
-  // This will be the final segegmented result that will get exported into /out
-  auto dilation_render =
-      SegmentationRenderer::create(labelColors, 0.6f, 1.0f, 2)
-          ->connect(dilation);
+  LabelColors labelColors;
+  labelColors[1] = Color::White();
 
-  auto multiWindow =
-      MultiViewWindow::create(5, Color::Black(), 2300, 450, false);
+  // One renderer per stage and kind, shared by the window and the export
+  std::map<std::pair<ImageGraph::StageId, bool>, std::shared_ptr<Renderer>>
+      rendererCache;
+  std::vector<std::shared_ptr<Renderer>> viewRenderers;
+  for (const View &view : views) {
+    auto &renderer = rendererCache[{view.stage, view.segmentation}];
+    if (!renderer) {
+      if (view.segmentation) {
+        renderer = SegmentationRenderer::create(labelColors, 0.6f, 1.0f, 2)
+                       ->connect(graph.get(view.stage));
+      } else {
+        renderer = ImageRenderer::create()->connect(graph.get(view.stage));
+      }
+    }
+    viewRenderers.push_back(renderer);
+  }
+  std::vector<std::pair<ImageGraph::StageId, std::shared_ptr<Renderer>>>
+      renderers;
+  for (const auto &[key, renderer] : rendererCache) {
+    renderers.push_back({key.first, renderer});
+  }
 
-  multiWindow->addRenderer(0, original);
-  multiWindow->addRenderer(1, prefilter);
-  multiWindow->addRenderer(2, segmentationRenderer);
-  multiWindow->addRenderer(3, erosion_render);
-  multiWindow->addRenderer(4, dilation_render);
+  // A parameter change invalidates the stage that reads it
+  auto adjust = [&](const std::string &name, ImageGraph::StageId stage,
+                    std::function<void()> set) {
+    set();
+    graph.invalidate(stage);
+    return refresh(graph, renderers, name);
+  };
+
+  if (adjustments > 0) {
+    // Nudge the lower threshold up and back down; nothing upstream of region
+    // growing should run
+    double total = 0.0;
+    double worst = 0.0;
+    for (int i = 0; i < adjustments; ++i) {
+      float step = i % 2 == 0 ? 0.01f : -0.01f;
+      double ms = adjust("region min", regions,
+                         [&] { params.regionMin += step; });
+      total += ms;
+      worst = std::max(worst, ms);
+    }
+    std::cout << adjustments << " adjustments: mean " << total / adjustments
+              << " ms, worst " << worst << " ms" << std::endl;
+  } else {
+    auto multiWindow = MultiViewWindow::create(
+        static_cast<int>(views.size()), Color::Black(),
+        460 * static_cast<int>(views.size()), 450, false);
+    for (size_t i = 0; i < viewRenderers.size(); ++i) {
+      multiWindow->addRenderer(static_cast<int>(i), viewRenderers[i]);
+    }
 
-  multiWindow->setTitle("Medical Image Processing Stages");
-  multiWindow->run();
+    // Sliders: name, value, minimum, maximum, step. Parameters of dead
+    // stages get none.
+    auto addSlider = [&](const std::string &name, float value, float minimum,
+                         float maximum, float step, ImageGraph::StageId stage,
+                         std::function<void(float)> set) {
+      if (!graph.isLive(stage)) {
+        return;
+      }
+      multiWindow->addWidget(new SliderWidget(
+          name, value, minimum, maximum, step, [&, name, stage, set](float v) {
+            adjust(name, stage, [&] { set(v); });
+          }));
+    };
+    addSlider("Clip min", params.clipMin, 0.0f, 2.0f, 0.02f, clipped,
+              [&](float value) { params.clipMin = value; });
+    addSlider("Median size", params.medianSize, 3, 11, 2, median,
+              [&](float value) {
+                params.medianSize = static_cast<int>(value);
+              });
+    addSlider("Sharpen gain", params.sharpenGain, 0.0f, 4.0f, 0.1f,
+              sharpened, [&](float value) { params.sharpenGain = value; });
+    addSlider("Region min", params.regionMin, 0.0f, 1.5f, 0.01f, regions,
+              [&](float value) { params.regionMin = value; });
+    addSlider("Region max", params.regionMax, 0.0f, 1.5f, 0.01f, regions,
+              [&](float value) { params.regionMax = value; });
+    addSlider("Erosion size", erosionSize, 1, 9, 2, eroded,
+              [&](float value) { erosionSize = static_cast<int>(value); });
+    addSlider("Dilation size", params.dilationSize, 1, 9, 2, dilated,
+              [&](float value) {
+                params.dilationSize = static_cast<int>(value);
+              });
+
+    multiWindow->setTitle("Medical Image Processing Stages");
+    multiWindow->run();
+  }
 
   // =============================================================
 
@@ -163,18 +330,11 @@ int main(int argc, char **argv) {
   // create output directory, create if it does not exist
   auto renderToImage = RenderToImage::create(Color::Black(), 512, 512);
 
-  // Define export configurations
-  std::vector<std::pair<std::string, std::shared_ptr<Renderer>>> renderPairs = {
-      {"original_image", ImageRenderer::create()->connect(importer)},
-      {"preprocessed_image", ImageRenderer::create()->connect(sharpen)},
-      {"segmentation", SegmentationRenderer::create(labelColors, 0.6f, 1.0f, 2)
-                           ->connect(regionGrowing)},
-      {"erosion_result",
-       SegmentationRenderer::create(labelColors, 0.6f, 1.0f, 2)
-           ->connect(erosion)},
-      {"final_dilated_result",
-       SegmentationRenderer::create(labelColors, 0.6f, 1.0f, 2)
-           ->connect(dilation)}};
+  // The window's renderers, holding the parameters last set
+  std::vector<std::pair<std::string, std::shared_ptr<Renderer>>> renderPairs;
+  for (size_t i = 0; i < views.size(); ++i) {
+    renderPairs.push_back({views[i].name, viewRenderers[i]});
+  }
 
   exportImages("../out-test", renderToImage, renderPairs);
 
@@ -0,0 +1,76 @@
+"""Smoke test of the brainseg Python module.
+
+Checks which arrays Context.segment accepts (dtypes in native byte order,
+padded rows) and refuses (byte-swapped or unsupported dtypes, strided
+columns), and that every accepted spelling of the same slice gives the
+same mask. Run by CTest as `python` when pybind11 is found; the module's
+directory must be on PYTHONPATH.
+"""
+
+import sys
+
+import numpy as np
+
+import brainseg
+
+failures = 0
+
+
+def check(condition, what):
+    global failures
+    if not condition:
+        print("FAILED:", what)
+        failures += 1
+
+
+def raises(error, call):
+    try:
+        call()
+    except error:
+        return True
+    return False
+
+
+def synthetic_slice(width=512, height=512):
+    # A bright disk on a darker background, in the range the reference
+    # parameters normalize
+    y, x = np.mgrid[0:height, 0:width]
+    image = np.full((height, width), 1500, dtype=np.uint16)
+    disk = (x - width // 2) ** 2 + (y - height // 2) ** 2 < (width // 6) ** 2
+    image[disk] = 6000
+    return image
+
+
+context = brainseg.Context()
+image = synthetic_slice()
+expected = np.array(context.segment(image))
+check(expected.shape == image.shape and expected.dtype == np.uint8,
+      "mask shape and dtype")
+
+for spelling in ("<u2", "=u2"):
+    mask = context.segment(image.astype(np.dtype(spelling)))
+    check(np.array_equal(mask, expected), "dtype %s accepted" % spelling)
+
+native = ">" if sys.byteorder == "little" else "<"
+check(raises(TypeError,
+             lambda: context.segment(image.astype(native + "u2"))),
+      "byte-swapped array refused")
+check(raises(TypeError, lambda: context.segment(image.astype(np.float64))),
+      "float64 refused")
+
+# Padded rows: a view into a wider array, packed before FAST copies it
+wide = np.zeros((image.shape[0], image.shape[1] + 64), dtype=np.uint16)
+wide[:, :image.shape[1]] = image
+check(np.array_equal(context.segment(wide[:, :image.shape[1]]), expected),
+      "padded rows give the same mask")
+check(raises(ValueError, lambda: context.segment(wide[:, ::2])),
+      "strided columns refused")
+
+out = np.empty_like(expected)
+context.segment(image, out=out)
+check(np.array_equal(out, expected), "out= gets the same mask")
+
+if failures:
+    print("%d check(s) failed" % failures)
+    sys.exit(1)
+print("All checks passed")